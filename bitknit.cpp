@@ -237,7 +237,14 @@ uint32 BitknitDistanceBits_Lookup(BitknitDistanceBits *model, uint32 *bits) {
 }
 
 
-#define RENORMALIZE() { if (bits < 0x10000) bits = (bits << 16) | *(uint16*)src, src += 2; bitst = bits; bits = bits2; bits2 = bitst; }
+// Reads past |src_end| return zeros, the caller notices from the number of bytes used.
+static uint32 __forceinline BitknitRead16(const byte *&src, const byte *src_end) {
+  uint32 v = (src_end - src >= 2) ? *(uint16*)src : 0;
+  src += 2;
+  return v;
+}
+
+#define RENORMALIZE() { if (bits < 0x10000) bits = (bits << 16) | BitknitRead16(src, src_end); bitst = bits; bits = bits2; bits2 = bitst; }
 
 
 static void BitknitCopyLongDist(byte *dst, size_t dist, size_t length) {
@@ -317,6 +324,8 @@ size_t Bitknit_Decode(const byte *src, const byte *src_end, byte *dst, byte *dst
   bits2 = 0x10000;
   last_match_negative = -(intptr_t)bk->last_match_dist;
 
+  if (src_end - src < 4)
+    return 0;
   v = *(uint32*)src, src += 4;
   if (v < 0x10000)
     return 0;
@@ -324,11 +333,11 @@ size_t Bitknit_Decode(const byte *src, const byte *src_end, byte *dst, byte *dst
   a = v >> 4;
   n = v & 0xF;
   if (a < 0x10000)
-    a = (a << 16) | *(uint16*)src, src += 2;
+    a = (a << 16) | BitknitRead16(src, src_end);
   bits = a >> n;
   if (bits < 0x10000)
-    bits = (bits << 16) | *(uint16*)src, src += 2;
-  a = (a << 16) | *(uint16*)src, src += 2;
+    bits = (bits << 16) | BitknitRead16(src, src_end);
+  a = (a << 16) | BitknitRead16(src, src_end);
   
   bits2 = (1 << (n + 16)) | (a & ((1 << (n + 16)) - 1));
   
@@ -379,7 +388,7 @@ size_t Bitknit_Decode(const byte *src, const byte *src_end, byte *dst, byte *dst
       bits >>= (nb & 0xF);
       RENORMALIZE();
       if (nb >= 0x10)
-        match_dist = (match_dist << 16) | *(uint16*)src, src += 2;
+        match_dist = (match_dist << 16) | BitknitRead16(src, src_end);
       match_dist = (32 << nb) + (match_dist << 5) + sym - 39;
 
       bk->recent_dist[(recent_dist_mask >> 21) & 7] = bk->recent_dist[(recent_dist_mask >> 18) & 7];
@@ -392,7 +401,14 @@ size_t Bitknit_Decode(const byte *src, const byte *src_end, byte *dst, byte *dst
       recent_dist_mask = (recent_dist_mask & mask) | ((idx + 8 * recent_dist_mask) & ~mask);
     }
     
-    if (match_dist >= 8) {
+    if (match_dist > (uintptr_t)(dst - dst_start) || copy_length > (uintptr_t)(dst_end - dst))
+      return 0;  // match out of bounds
+
+    if (copy_length + 16 > (uintptr_t)(dst_end - dst)) {
+      // The copies below write up to 16 bytes past the match, near the end go byte by byte.
+      for (i = 0; i != copy_length; i++)
+        dst[i] = (dst - match_dist)[i];
+    } else if (match_dist >= 8) {
       BitknitCopyLongDist(dst, match_dist, copy_length);
     } else {
       BitknitCopyShortDist(dst, match_dist, copy_length);
@@ -402,7 +418,9 @@ size_t Bitknit_Decode(const byte *src, const byte *src_end, byte *dst, byte *dst
 
     last_match_negative = -(intptr_t)match_dist;
   }
-  *(uint32*)dst = (uint16)bits | bits2 << 16;
+  // The last bytes of the quantum come from the coder state, store only those inside the output.
+  uint32 final_bits = (uint16)bits | bits2 << 16;
+  memcpy(dst, &final_bits, (dst_end - dst < 4) ? dst_end - dst : 4);
 
   bk->last_match_dist = -last_match_negative;
   bk->recent_dist_mask = recent_dist_mask;
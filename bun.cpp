@@ -4,13 +4,17 @@
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <fstream>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -33,10 +37,18 @@ size_t const SAFE_SPACE = 64;
 
 using decompress_fun = int(DECOMPRESS_API *)(uint8_t const *src_buf, int src_len, uint8_t *dst, size_t dst_size, int,
                                              int, int, uint8_t *, size_t, void *, void *, void *, size_t, int);
+using decoder_memory_size_fun = size_t(DECOMPRESS_API *)();
+using is_fuzz_safe_fun = int(DECOMPRESS_API *)();
+using is_exact_bounds_fun = int(DECOMPRESS_API *)();
 
 struct Bun {
     std::shared_ptr<void> decompress_mod_;
     decompress_fun decompress_fun_;
+    size_t decoder_memory_size_;
+    bool fuzz_safe_;
+    bool exact_bounds_;
+    int worker_count_;
+    BunThreadPool *thread_pool_;
 };
 
 struct bundle_info {
@@ -58,6 +70,34 @@ struct path_rep_info {
     uint32_t recursive_size;
 };
 
+struct bundle_fixed_header {
+    uint32_t uncompressed_size;
+    uint32_t total_payload_size;
+    uint32_t head_payload_size;
+    enum encoding_schemes { Kraken_6 = 8, Mermaid_A = 9, Leviathan_C = 13 };
+    uint32_t first_file_encode;
+    uint32_t unk10;
+    uint64_t uncompressed_size2;
+    uint64_t total_payload_size2;
+    uint32_t block_count;
+    uint32_t unk28[5];
+};
+
+// Size of the serialized bundle_fixed_header, which is packed on disk.
+size_t const BUNDLE_FIXED_HEADER_SIZE = 60;
+
+static bool read_bundle_fixed_header(reader &r, bundle_fixed_header &fix_h) {
+    return r.read(fix_h.uncompressed_size) && r.read(fix_h.total_payload_size) && r.read(fix_h.head_payload_size) &&
+           r.read(fix_h.first_file_encode) && r.read(fix_h.unk10) && r.read(fix_h.uncompressed_size2) &&
+           r.read(fix_h.total_payload_size2) && r.read(fix_h.block_count) && r.read(fix_h.unk28);
+}
+
+struct cached_bundle {
+    int32_t bundle_id;
+    BunMem mem;
+    size_t pins;
+};
+
 enum class HashAlgorithm {
     Unknown,
     FNV1A_3_11_2,
@@ -66,6 +106,12 @@ enum class HashAlgorithm {
 
 struct BunIndex {
     bool read_file(char const *path, std::vector<uint8_t> &out);
+    bool read_file_range(char const *path, uint64_t offset, size_t size, std::vector<uint8_t> &out);
+    BunMem extract_range(char const *bundle_path, uint64_t offset, size_t size);
+    BunMem decompress_bundle(int32_t bundle_id);
+    cached_bundle *acquire_bundle(int32_t bundle_id, bool fill);
+    void release_bundle(cached_bundle *entry);
+    void evict_over_budget();
     Bun *bun_;
     Vfs *vfs_;
     std::string bundle_root_;
@@ -77,6 +123,25 @@ struct BunIndex {
     BunMem inner_mem_;
     HashAlgorithm hash_algorithm_;
     uint64_t hash_seed_;
+
+    // Decompressed bundle cache, most recently used first. Guarded by cache_mutex_.
+    uint64_t cache_budget_;
+    bool cache_prefetch_;
+    mutable std::mutex cache_mutex_;
+    std::list<cached_bundle> cache_lru_;
+    std::unordered_map<int32_t, std::list<cached_bundle>::iterator> cache_lookup_;
+    uint64_t cache_bytes_;
+    uint64_t cache_hits_;
+    uint64_t cache_misses_;
+    uint64_t cache_evictions_;
+};
+
+struct BunView {
+    BunIndex *idx_;
+    cached_bundle *entry_;
+    BunMem owned_mem_;
+    uint8_t const *data_;
+    int64_t size_;
 };
 
 inline uint64_t hash_path_3_21_2(std::string path, uint64_t seed) {
@@ -131,7 +196,33 @@ bool BunIndex::read_file(char const *path, std::vector<uint8_t> &out) {
     }
 }
 
+bool BunIndex::read_file_range(char const *path, uint64_t offset, size_t size, std::vector<uint8_t> &out) {
+    std::string full_path = bundle_root_ + '/' + path;
+    out.resize(size);
+    if (vfs_) {
+        auto fh = vfs_->open(vfs_, full_path.c_str());
+        if (!fh) {
+            return false;
+        }
+        bool success = vfs_->read(vfs_, fh, out.data(), (int64_t)offset, (int64_t)size) == (int64_t)size;
+
+        vfs_->close(vfs_, fh);
+        return success;
+    } else {
+        std::ifstream is(full_path, std::ios::binary);
+        if (!is) {
+            return false;
+        }
+        is.seekg(offset, std::ios::beg);
+        return !!is.read(reinterpret_cast<char *>(out.data()), out.size());
+    }
+}
+
 BUN_DLL_PUBLIC Bun *BunNew(char const *decompressor_path, char const *decompressor_export) {
+    return BunNewEx(decompressor_path, decompressor_export, 0);
+}
+
+BUN_DLL_PUBLIC Bun *BunNewEx(char const *decompressor_path, char const *decompressor_export, int worker_count) {
     if (!decompressor_export) {
         decompressor_export = "OodleLZ_Decompress";
     }
@@ -149,6 +240,18 @@ BUN_DLL_PUBLIC Bun *BunNew(char const *decompressor_path, char const *decompress
         return nullptr;
     }
     bun->decompress_fun_ = fun;
+
+    auto mem_size_fun = reinterpret_cast<decoder_memory_size_fun>(
+        GetProcAddress((HMODULE)bun->decompress_mod_.get(), "Ooz_DecoderMemorySize"));
+    bun->decoder_memory_size_ = mem_size_fun ? mem_size_fun() : 0;
+
+    auto fuzz_safe_fun = reinterpret_cast<is_fuzz_safe_fun>(
+        GetProcAddress((HMODULE)bun->decompress_mod_.get(), "Ooz_IsFuzzSafe"));
+    bun->fuzz_safe_ = fuzz_safe_fun && fuzz_safe_fun();
+
+    auto exact_bounds_fun = reinterpret_cast<is_exact_bounds_fun>(
+        GetProcAddress((HMODULE)bun->decompress_mod_.get(), "Ooz_IsExactBounds"));
+    bun->exact_bounds_ = exact_bounds_fun && exact_bounds_fun();
 #else
     auto mod = dlopen(decompressor_path, RTLD_NOW | RTLD_LOCAL);
     if (!mod) {
@@ -161,13 +264,64 @@ BUN_DLL_PUBLIC Bun *BunNew(char const *decompressor_path, char const *decompress
         return nullptr;
     }
     bun->decompress_fun_ = fun;
+
+    auto mem_size_fun = reinterpret_cast<decoder_memory_size_fun>(dlsym(mod, "Ooz_DecoderMemorySize"));
+    bun->decoder_memory_size_ = mem_size_fun ? mem_size_fun() : 0;
+
+    auto fuzz_safe_fun = reinterpret_cast<is_fuzz_safe_fun>(dlsym(mod, "Ooz_IsFuzzSafe"));
+    bun->fuzz_safe_ = fuzz_safe_fun && fuzz_safe_fun();
+
+    auto exact_bounds_fun = reinterpret_cast<is_exact_bounds_fun>(dlsym(mod, "Ooz_IsExactBounds"));
+    bun->exact_bounds_ = exact_bounds_fun && exact_bounds_fun();
 #endif
+    bun->worker_count_ = worker_count;
 
     return bun.release();
 }
 
 BUN_DLL_PUBLIC void BunDelete(Bun *bun) { delete bun; }
 
+BUN_DLL_PUBLIC void BunSetWorkerCount(Bun *bun, int worker_count) {
+    if (bun) {
+        bun->worker_count_ = worker_count;
+    }
+}
+
+BUN_DLL_PUBLIC void BunSetThreadPool(Bun *bun, BunThreadPool *pool) {
+    if (bun) {
+        bun->thread_pool_ = pool;
+    }
+}
+
+static size_t effective_worker_count(Bun const *bun) {
+    if (bun->worker_count_ < 0) {
+        return (std::max<size_t>)(std::thread::hardware_concurrency(), 1);
+    }
+    return (std::max<size_t>)(bun->worker_count_, 1);
+}
+
+// Runs task(i) for every i in [0, count), on the application's thread pool if one is set
+// and otherwise on freshly spawned threads with the calling thread taking the first task.
+template <typename Task> static void run_parallel(Bun *bun, size_t count, Task const &task) {
+    if (count == 0) {
+        return;
+    }
+    if (bun->thread_pool_) {
+        auto trampoline = [](void *ctx, size_t index) { (*static_cast<Task const *>(ctx))(index); };
+        bun->thread_pool_->run(bun->thread_pool_, trampoline, const_cast<Task *>(&task), count);
+        return;
+    }
+    std::vector<std::thread> threads;
+    threads.reserve(count - 1);
+    for (size_t i = 1; i < count; ++i) {
+        threads.emplace_back([&task, i] { task(i); });
+    }
+    task(0);
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
 std::string printable_string(uint32_t x) {
     std::string s;
     for (size_t i = 0; i < 4; ++i) {
@@ -213,9 +367,14 @@ std::string hex_dump(size_t width, uint8_t const *p, size_t n) {
 }
 
 BUN_DLL_PUBLIC BunIndex *BunIndexOpen(Bun *bun, Vfs *vfs, char const *root_dir) {
+    return BunIndexOpenEx(bun, vfs, root_dir, 0);
+}
+
+BUN_DLL_PUBLIC BunIndex *BunIndexOpenEx(Bun *bun, Vfs *vfs, char const *root_dir, uint64_t cache_budget) {
     auto idx = std::make_unique<BunIndex>();
     idx->bun_ = bun;
     idx->vfs_ = vfs;
+    idx->cache_budget_ = cache_budget;
     idx->bundle_root_ = vfs ? "Bundles2" : (root_dir + std::string("/Bundles2"));
 
     std::vector<uint8_t> index_bin_src;
@@ -351,6 +510,10 @@ BUN_DLL_PUBLIC void BunIndexClose(BunIndex *idx) {
     if (idx) {
         BunMemFree(idx->index_mem_);
         BunMemFree(idx->inner_mem_);
+        for (auto &entry : idx->cache_lru_) {
+            BunMemFree(entry.mem);
+        }
+        delete idx;
     }
 }
 
@@ -383,17 +546,20 @@ BUN_DLL_PUBLIC BunMem BunIndexExtractFile(BunIndex *idx, int32_t file_id) {
     }
 
     auto &fi = idx->file_infos_[file_id];
+    if (auto *entry = idx->acquire_bundle(fi.bundle_index_, idx->cache_prefetch_)) {
+        BunMem ret_mem = nullptr;
+        if ((uint64_t)fi.file_offset_ + fi.file_size_ <= (uint64_t)BunMemSize(entry->mem)) {
+            ret_mem = BunMemAlloc(fi.file_size_);
+            memcpy(ret_mem, entry->mem + fi.file_offset_, fi.file_size_);
+        }
+        idx->release_bundle(entry);
+        return ret_mem;
+    }
+
     auto &bi = idx->bundle_infos_[fi.bundle_index_];
-    std::filesystem::path bundle_path = idx->bundle_root_;
-    bundle_path /= bi.name_ + ".bundle.bin";
+    std::string bundle_path = bi.name_ + ".bundle.bin";
 
-    std::vector<uint8_t> bundle_data;
-    slurp_file(bundle_path, bundle_data);
-    BunMem all_data = BunDecompressBundleAlloc(idx->bun_, bundle_data.data(), bundle_data.size());
-    BunMem ret_mem = BunMemAlloc(fi.file_size_);
-    memcpy(ret_mem, all_data + fi.file_offset_, fi.file_size_);
-    BunMemFree(all_data);
-    return ret_mem;
+    return idx->extract_range(bundle_path.c_str(), fi.file_offset_, fi.file_size_);
 }
 
 BUN_DLL_PUBLIC BunMem BunIndexExtractBundle(BunIndex *idx, int32_t bundle_id) {
@@ -401,15 +567,179 @@ BUN_DLL_PUBLIC BunMem BunIndexExtractBundle(BunIndex *idx, int32_t bundle_id) {
         return nullptr;
     }
 
-    auto &bi = idx->bundle_infos_[bundle_id];
+    if (auto *entry = idx->acquire_bundle(bundle_id, true)) {
+        auto size = BunMemSize(entry->mem);
+        BunMem ret_mem = BunMemAlloc(size);
+        memcpy(ret_mem, entry->mem, size);
+        idx->release_bundle(entry);
+        return ret_mem;
+    }
+    return idx->decompress_bundle(bundle_id);
+}
+
+BunMem BunIndex::decompress_bundle(int32_t bundle_id) {
+    auto &bi = bundle_infos_[bundle_id];
 
     std::string bundle_path = bi.name_ + ".bundle.bin";
 
     std::vector<uint8_t> bundle_data;
-    if (!idx->read_file(bundle_path.c_str(), bundle_data)) {
+    if (!read_file(bundle_path.c_str(), bundle_data)) {
+        return nullptr;
+    }
+    return BunDecompressBundleAlloc(bun_, bundle_data.data(), bundle_data.size());
+}
+
+// Returns the cache entry for a bundle with an extra pin, decompressing it on a miss if fill is set.
+// Returns nullptr if the index has no cache, the bundle is not cached and fill is not set, or the bundle
+// could not be decompressed.
+cached_bundle *BunIndex::acquire_bundle(int32_t bundle_id, bool fill) {
+    if (cache_budget_ == 0) {
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lk(cache_mutex_);
+        auto I = cache_lookup_.find(bundle_id);
+        if (I != cache_lookup_.end()) {
+            ++cache_hits_;
+            cache_lru_.splice(cache_lru_.begin(), cache_lru_, I->second);
+            ++I->second->pins;
+            return &*I->second;
+        }
+        ++cache_misses_;
+    }
+    if (!fill) {
+        return nullptr;
+    }
+
+    // Decompress without holding the lock; if another thread got there first its copy wins.
+    BunMem mem = decompress_bundle(bundle_id);
+    if (!mem) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lk(cache_mutex_);
+    auto I = cache_lookup_.find(bundle_id);
+    if (I != cache_lookup_.end()) {
+        BunMemFree(mem);
+        cache_lru_.splice(cache_lru_.begin(), cache_lru_, I->second);
+        ++I->second->pins;
+        return &*I->second;
+    }
+    cache_lru_.push_front(cached_bundle{bundle_id, mem, 1});
+    cache_lookup_[bundle_id] = cache_lru_.begin();
+    cache_bytes_ += BunMemSize(mem);
+    evict_over_budget();
+    return &cache_lru_.front();
+}
+
+void BunIndex::release_bundle(cached_bundle *entry) {
+    std::lock_guard<std::mutex> lk(cache_mutex_);
+    --entry->pins;
+    evict_over_budget();
+}
+
+// Drops unpinned bundles from the cold end of the cache until it fits the budget. Must hold cache_mutex_.
+void BunIndex::evict_over_budget() {
+    auto I = cache_lru_.end();
+    while (cache_bytes_ > cache_budget_ && I != cache_lru_.begin()) {
+        --I;
+        if (I->pins) {
+            continue;
+        }
+        cache_bytes_ -= BunMemSize(I->mem);
+        BunMemFree(I->mem);
+        cache_lookup_.erase(I->bundle_id);
+        I = cache_lru_.erase(I);
+        ++cache_evictions_;
+    }
+}
+
+BUN_DLL_PUBLIC BunView *BunIndexViewBundle(BunIndex *idx, int32_t bundle_id) {
+    if (!idx || bundle_id < 0 || bundle_id >= idx->bundle_infos_.size()) {
+        return nullptr;
+    }
+
+    auto view = std::make_unique<BunView>();
+    view->idx_ = idx;
+    if (auto *entry = idx->acquire_bundle(bundle_id, true)) {
+        view->entry_ = entry;
+        view->data_ = entry->mem;
+        view->size_ = BunMemSize(entry->mem);
+    } else if (idx->cache_budget_ == 0) {
+        view->owned_mem_ = idx->decompress_bundle(bundle_id);
+        if (!view->owned_mem_) {
+            return nullptr;
+        }
+        view->data_ = view->owned_mem_;
+        view->size_ = BunMemSize(view->owned_mem_);
+    } else {
         return nullptr;
     }
-    return BunDecompressBundleAlloc(idx->bun_, bundle_data.data(), bundle_data.size());
+    return view.release();
+}
+
+BUN_DLL_PUBLIC BunView *BunIndexViewFile(BunIndex *idx, int32_t file_id) {
+    if (!idx || file_id < 0 || file_id >= idx->file_infos_.size()) {
+        return nullptr;
+    }
+
+    auto &fi = idx->file_infos_[file_id];
+    auto view = std::make_unique<BunView>();
+    view->idx_ = idx;
+    if (auto *entry = idx->acquire_bundle(fi.bundle_index_, idx->cache_prefetch_)) {
+        view->entry_ = entry;
+        if ((uint64_t)fi.file_offset_ + fi.file_size_ > (uint64_t)BunMemSize(entry->mem)) {
+            idx->release_bundle(entry);
+            return nullptr;
+        }
+        view->data_ = entry->mem + fi.file_offset_;
+        view->size_ = fi.file_size_;
+        return view.release();
+    }
+
+    auto &bi = idx->bundle_infos_[fi.bundle_index_];
+    std::string bundle_path = bi.name_ + ".bundle.bin";
+    view->owned_mem_ = idx->extract_range(bundle_path.c_str(), fi.file_offset_, fi.file_size_);
+    if (!view->owned_mem_) {
+        return nullptr;
+    }
+    view->data_ = view->owned_mem_;
+    view->size_ = BunMemSize(view->owned_mem_);
+    return view.release();
+}
+
+BUN_DLL_PUBLIC void BunIndexSetCachePrefetch(BunIndex *idx, int whole_bundle) {
+    if (idx) {
+        idx->cache_prefetch_ = whole_bundle != 0;
+    }
+}
+
+BUN_DLL_PUBLIC uint8_t const *BunViewData(BunView const *view) { return view ? view->data_ : nullptr; }
+
+BUN_DLL_PUBLIC int64_t BunViewSize(BunView const *view) { return view ? view->size_ : -1; }
+
+BUN_DLL_PUBLIC void BunViewRelease(BunView *view) {
+    if (!view) {
+        return;
+    }
+    if (view->entry_) {
+        view->idx_->release_bundle(view->entry_);
+    }
+    BunMemFree(view->owned_mem_);
+    delete view;
+}
+
+BUN_DLL_PUBLIC int BunIndexCacheStats(BunIndex const *idx, uint64_t *hits, uint64_t *misses, uint64_t *evictions,
+                                      uint64_t *bytes_cached) {
+    if (!idx) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lk(idx->cache_mutex_);
+    *hits = idx->cache_hits_;
+    *misses = idx->cache_misses_;
+    *evictions = idx->cache_evictions_;
+    *bytes_cached = idx->cache_bytes_;
+    return 0;
 }
 
 BUN_DLL_PUBLIC int BunIndexBundleInfo(BunIndex const *idx, int32_t bundle_info_id, char const **name,
@@ -602,26 +932,56 @@ void ro_free(uint8_t *s, size_t src_size) {
 }
 #endif
 
-int BunDecompressBlock(Bun *bun, uint8_t const *src_data, size_t src_size, uint8_t *dst_data, size_t dst_size) {
-    auto *s = ro_clone(src_data, src_size);
-    int res = bun->decompress_fun_(s, (int)src_size, dst_data, (int)dst_size, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+// Scratch bytes the decompressor may write past the end of its output.
+static size_t safe_space(Bun *bun) { return bun->exact_bounds_ ? 0 : SAFE_SPACE; }
+
+// Per-thread decoder memory handed to modules that export Ooz_DecoderMemorySize, so that
+// decompressing many blocks doesn't allocate and free the decoder state for every one.
+static void *thread_decoder_memory(Bun *bun) {
+    if (bun->decoder_memory_size_ == 0) {
+        return nullptr;
+    }
+    thread_local std::vector<uint8_t> memory;
+    if (memory.size() < bun->decoder_memory_size_) {
+        memory.resize(bun->decoder_memory_size_);
+    }
+    return memory.data();
+}
+
+static int call_decompress(Bun *bun, uint8_t const *src, size_t src_size, uint8_t *dst, size_t dst_size) {
+    void *decoder_memory = thread_decoder_memory(bun);
+    size_t decoder_memory_size = decoder_memory ? bun->decoder_memory_size_ : 0;
+    return bun->decompress_fun_(src, (int)src_size, dst, (int)dst_size, 0, 0, 0, 0, 0, 0, 0, decoder_memory,
+                                decoder_memory_size, 0);
+}
+
+// Decoders that don't promise to stay inside the source get a copy followed by a
+// read only guard page, so over-reads fault instead of leaking neighbouring data.
+static int call_decompress_guarded(Bun *bun, uint8_t const *src, size_t src_size, uint8_t *dst, size_t dst_size) {
+    if (bun->fuzz_safe_) {
+        return call_decompress(bun, src, src_size, dst, dst_size);
+    }
+    auto *s = ro_clone(src, src_size);
+    int res = call_decompress(bun, s, src_size, dst, dst_size);
     ro_free(s, src_size);
     return res;
 }
 
+int BunDecompressBlock(Bun *bun, uint8_t const *src_data, size_t src_size, uint8_t *dst_data, size_t dst_size) {
+    return call_decompress_guarded(bun, src_data, src_size, dst_data, dst_size);
+}
+
 BunMem BunDecompressBlockAlloc(Bun *bun, uint8_t const *src_data, size_t src_size, size_t dst_size) {
-    BunMem mem = BunMemAlloc(dst_size + SAFE_SPACE);
-    for (size_t i = 0; i < SAFE_SPACE; ++i) {
+    BunMem mem = BunMemAlloc(dst_size + safe_space(bun));
+    for (size_t i = 0; i < safe_space(bun); ++i) {
         mem[dst_size + i] = 0xCD;
     }
-    auto *s = ro_clone(src_data, src_size);
-    int res = bun->decompress_fun_(s, (int)src_size, mem, (int)dst_size, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-    ro_free(s, src_size);
+    int res = call_decompress_guarded(bun, src_data, src_size, mem, dst_size);
     if (res != dst_size) {
         BunMemFree(mem);
         return nullptr;
     }
-    for (size_t i = 0; i < SAFE_SPACE; ++i) {
+    for (size_t i = 0; i < safe_space(bun); ++i) {
         if (mem[dst_size + i] != 0xCD) {
             // fprintf(stderr, "Decompress function clobbered safe space at byte %zu\n", i);
             // fflush(stderr);
@@ -631,26 +991,33 @@ BunMem BunDecompressBlockAlloc(Bun *bun, uint8_t const *src_data, size_t src_siz
     return mem;
 }
 
-struct bundle_fixed_header {
-    uint32_t uncompressed_size;
-    uint32_t total_payload_size;
-    uint32_t head_payload_size;
-    enum encoding_schemes { Kraken_6 = 8, Mermaid_A = 9, Leviathan_C = 13 };
-    uint32_t first_file_encode;
-    uint32_t unk10;
-    uint64_t uncompressed_size2;
-    uint64_t total_payload_size2;
-    uint32_t block_count;
-    uint32_t unk28[5];
+struct bundle_block {
+    uint8_t const *src;
+    size_t src_size;
+    size_t out_offset;
+    size_t out_size;
 };
 
+// Decompresses a single bundle block into its slot in the output. If the bytes the decompressor may scribble on
+// past the slot belong to someone else the block goes through a temporary allocation instead.
+static bool decompress_bundle_block(Bun *bun, bundle_block const &blk, uint8_t *dst_data, bool tail_writable) {
+    int64_t amount_written{};
+    if (tail_writable) {
+        amount_written = BunDecompressBlock(bun, blk.src, blk.src_size, dst_data + blk.out_offset, blk.out_size);
+    } else {
+        auto mem = BunDecompressBlockAlloc(bun, blk.src, blk.src_size, blk.out_size);
+        amount_written = mem ? blk.out_size : 0;
+        memcpy(dst_data + blk.out_offset, mem, amount_written);
+        BunMemFree(mem);
+    }
+    return amount_written == blk.out_size;
+}
+
 int64_t BunDecompressBundle(Bun *bun, uint8_t const *src_data, size_t src_size, uint8_t *dst_data, size_t dst_size) {
     reader r = {src_data, src_size};
 
     bundle_fixed_header fix_h;
-    if (!r.read(fix_h.uncompressed_size) || !r.read(fix_h.total_payload_size) || !r.read(fix_h.head_payload_size) ||
-        !r.read(fix_h.first_file_encode) || !r.read(fix_h.unk10) || !r.read(fix_h.uncompressed_size2) ||
-        !r.read(fix_h.total_payload_size2) || !r.read(fix_h.block_count) || !r.read(fix_h.unk28)) {
+    if (!read_bundle_fixed_header(r, fix_h)) {
         return -1;
     }
 
@@ -668,27 +1035,52 @@ int64_t BunDecompressBundle(Bun *bun, uint8_t const *src_data, size_t src_size,
         return -1;
     }
 
+    std::vector<bundle_block> blocks(entry_sizes.size());
     uint8_t const *p = r.p_;
     size_t n = r.n_;
-    uint8_t *out_p = dst_data;
     size_t out_cur = 0;
     for (size_t i = 0; i < entry_sizes.size(); ++i) {
-        size_t amount_to_write = (std::min<size_t>)(fix_h.uncompressed_size2 - out_cur, fix_h.unk28[0]);
-        int64_t amount_written{};
-        if (out_cur + amount_to_write + SAFE_SPACE < dst_size)
-            amount_written = BunDecompressBlock(bun, p, entry_sizes[i], out_p + out_cur, amount_to_write);
-        else {
-            auto mem = BunDecompressBlockAlloc(bun, p, entry_sizes[i], amount_to_write);
-            amount_written = mem ? amount_to_write : 0;
-            memcpy(out_p + out_cur, mem, amount_written);
-            BunMemFree(mem);
+        if (n < entry_sizes[i]) {
+            return -1;
         }
+        size_t amount_to_write = (std::min<size_t>)(fix_h.uncompressed_size2 - out_cur, fix_h.unk28[0]);
+        blocks[i] = {p, entry_sizes[i], out_cur, amount_to_write};
         p += entry_sizes[i];
         n -= entry_sizes[i];
         out_cur += amount_to_write;
-        if (amount_written != amount_to_write) {
-            return -1;
+    }
+
+    auto tail_writable = [&](bundle_block const &blk) {
+        return blk.out_offset + blk.out_size + safe_space(bun) <= dst_size;
+    };
+
+    size_t run_count = (std::min)(effective_worker_count(bun), blocks.size());
+    if (run_count <= 1) {
+        for (auto &blk : blocks) {
+            if (!decompress_bundle_block(bun, blk, dst_data, tail_writable(blk))) {
+                return -1;
+            }
         }
+        return out_cur;
+    }
+
+    // Each task decompresses a contiguous run of blocks in order, so a block can only overrun into the
+    // following block's slot before that block is written. The last block of a run borders on a slot that
+    // another task may be filling concurrently and has to keep its overrun to itself, unless the
+    // decompressor never overruns.
+    std::atomic<bool> failed{false};
+    run_parallel(bun, run_count, [&](size_t run) {
+        size_t first = blocks.size() * run / run_count;
+        size_t last = blocks.size() * (run + 1) / run_count;
+        for (size_t i = first; i < last && !failed; ++i) {
+            bool borders_other_run = (i + 1 == last) && (last != blocks.size()) && !bun->exact_bounds_;
+            if (!decompress_bundle_block(bun, blocks[i], dst_data, tail_writable(blocks[i]) && !borders_other_run)) {
+                failed = true;
+            }
+        }
+    });
+    if (failed) {
+        return -1;
     }
 
     return out_cur;
@@ -696,7 +1088,7 @@ int64_t BunDecompressBundle(Bun *bun, uint8_t const *src_data, size_t src_size,
 
 BunMem BunDecompressBundleAlloc(Bun *bun, uint8_t const *src_data, size_t src_size) {
     int64_t dst_size = BunDecompressBundle(bun, src_data, src_size, nullptr, 0);
-    BunMem dst_mem = BunMemAlloc(dst_size + SAFE_SPACE);
+    BunMem dst_mem = BunMemAlloc(dst_size + safe_space(bun));
     if (dst_size != BunDecompressBundle(bun, src_data, src_size, dst_mem, dst_size)) {
         BunMemFree(dst_mem);
         return nullptr;
@@ -704,3 +1096,86 @@ BunMem BunDecompressBundleAlloc(Bun *bun, uint8_t const *src_data, size_t src_si
     BunMemShrink(dst_mem, dst_size);
     return dst_mem;
 }
+
+// Reads and decompresses only the blocks of a bundle that overlap [offset, offset + size).
+// Blocks that lie entirely within the range are decompressed straight into the returned memory.
+BunMem BunIndex::extract_range(char const *bundle_path, uint64_t offset, size_t size) {
+    std::vector<uint8_t> header_data;
+    if (!read_file_range(bundle_path, 0, BUNDLE_FIXED_HEADER_SIZE, header_data)) {
+        return nullptr;
+    }
+    reader r = {header_data.data(), header_data.size()};
+    bundle_fixed_header fix_h;
+    if (!read_bundle_fixed_header(r, fix_h)) {
+        return nullptr;
+    }
+    uint64_t const granularity = fix_h.unk28[0];
+    if (granularity == 0 || offset + size > fix_h.uncompressed_size2) {
+        return nullptr;
+    }
+
+    std::vector<uint32_t> entry_sizes(fix_h.block_count);
+    std::vector<uint8_t> entry_data;
+    if (!read_file_range(bundle_path, BUNDLE_FIXED_HEADER_SIZE, entry_sizes.size() * sizeof(uint32_t), entry_data)) {
+        return nullptr;
+    }
+    r = {entry_data.data(), entry_data.size()};
+    if (!r.read(entry_sizes)) {
+        return nullptr;
+    }
+
+    BunMem ret_mem = BunMemAlloc(size + safe_space(bun_));
+    if (size == 0) {
+        BunMemShrink(ret_mem, size);
+        return ret_mem;
+    }
+
+    size_t first_block = offset / granularity;
+    size_t last_block = (offset + size - 1) / granularity;
+    if (last_block >= entry_sizes.size()) {
+        BunMemFree(ret_mem);
+        return nullptr;
+    }
+
+    uint64_t payload_offset = BUNDLE_FIXED_HEADER_SIZE + entry_sizes.size() * sizeof(uint32_t);
+    for (size_t i = 0; i < first_block; ++i) {
+        payload_offset += entry_sizes[i];
+    }
+    size_t payload_size = 0;
+    for (size_t i = first_block; i <= last_block; ++i) {
+        payload_size += entry_sizes[i];
+    }
+    std::vector<uint8_t> payload;
+    if (!read_file_range(bundle_path, payload_offset, payload_size, payload)) {
+        BunMemFree(ret_mem);
+        return nullptr;
+    }
+
+    uint8_t const *p = payload.data();
+    for (size_t i = first_block; i <= last_block; ++i) {
+        uint64_t block_begin = i * granularity;
+        size_t block_size = (size_t)(std::min)(fix_h.uncompressed_size2 - block_begin, granularity);
+        uint64_t copy_begin = (std::max)(block_begin, offset);
+        uint64_t copy_end = (std::min)(block_begin + block_size, offset + size);
+        bool ok;
+        if (copy_begin == block_begin && copy_end == block_begin + block_size) {
+            // Any overrun lands in the next block's slot or the safe space allocated past the end.
+            ok = BunDecompressBlock(bun_, p, entry_sizes[i], ret_mem + (block_begin - offset), block_size) ==
+                 (int)block_size;
+        } else {
+            BunMem block_mem = BunDecompressBlockAlloc(bun_, p, entry_sizes[i], block_size);
+            ok = !!block_mem;
+            if (ok) {
+                memcpy(ret_mem + (copy_begin - offset), block_mem + (copy_begin - block_begin), copy_end - copy_begin);
+            }
+            BunMemFree(block_mem);
+        }
+        if (!ok) {
+            BunMemFree(ret_mem);
+            return nullptr;
+        }
+        p += entry_sizes[i];
+    }
+    BunMemShrink(ret_mem, size);
+    return ret_mem;
+}
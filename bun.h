@@ -37,6 +37,7 @@ extern "C" {
 
 	struct Bun;
 	struct BunIndex;
+	struct BunView;
 
 	struct VfsFile;
 	struct Vfs {
@@ -50,16 +51,54 @@ extern "C" {
 	BUN_DLL_PUBLIC int64_t BunMemSize(BunMem mem);
 	BUN_DLL_PUBLIC void BunMemFree(BunMem mem);
 
+	/* BunThreadPool lets the application run Bun's parallel work on its own threads.
+	* run must call task(ctx, i) exactly once for every i in [0, count), possibly concurrently,
+	* and only return once all of them have finished.
+	*/
+	struct BunThreadPool {
+		void (*run)(BunThreadPool*, void (*task)(void* ctx, size_t index), void* ctx, size_t count);
+	};
+
 	BUN_DLL_PUBLIC Bun* BunNew(char const* decompressor_path, char const* decompressor_export);
+	BUN_DLL_PUBLIC Bun* BunNewEx(char const* decompressor_path, char const* decompressor_export, int worker_count);
 	BUN_DLL_PUBLIC void BunDelete(Bun* bun);
 
+	/* Bundles are made of independent blocks which can be decompressed concurrently.
+	* A worker count of 0 or 1 decompresses on the calling thread, a negative count uses one worker per hardware thread.
+	* If a thread pool is set it is used instead of threads spawned by Bun, with the worker count as the number of tasks.
+	*/
+	BUN_DLL_PUBLIC void BunSetWorkerCount(Bun* bun, int worker_count);
+	BUN_DLL_PUBLIC void BunSetThreadPool(Bun* bun, BunThreadPool* pool);
+
 	BUN_DLL_PUBLIC BunIndex* BunIndexOpen(Bun* bun, Vfs* vfs, char const* bundle_dir);
+	BUN_DLL_PUBLIC BunIndex* BunIndexOpenEx(Bun* bun, Vfs* vfs, char const* bundle_dir, uint64_t cache_budget);
 	BUN_DLL_PUBLIC void BunIndexClose(BunIndex* idx);
 
 	BUN_DLL_PUBLIC int32_t BunIndexLookupFileByPath(BunIndex* idx, char const* path);
 	BUN_DLL_PUBLIC BunMem BunIndexExtractFile(BunIndex* idx, int32_t file_id);
 	BUN_DLL_PUBLIC BunMem BunIndexExtractBundle(BunIndex* idx, int32_t bundle_id);
 
+	/* An index opened with a non-zero cache budget keeps up to that many bytes of decompressed bundles in memory,
+	* evicting the least recently used bundle first. BunIndexExtractFile and BunIndexExtractBundle copy out of the cache.
+	* A BunView refers directly to the decompressed data and pins it in the cache until released. Views can also be
+	* made from an index without a cache, in which case each view owns its data.
+	* All views must be released before the index is closed.
+	*
+	* When a file's bundle is not cached, BunIndexExtractFile and BunIndexViewFile decompress only the blocks covering
+	* the file and leave the cache as it is. BunIndexSetCachePrefetch with a nonzero whole_bundle makes them decompress
+	* and cache the whole bundle instead, which pays off when neighbouring files are read soon after.
+	* Bundle extracts and views always cache the whole bundle.
+	*/
+	BUN_DLL_PUBLIC void BunIndexSetCachePrefetch(BunIndex* idx, int whole_bundle);
+	BUN_DLL_PUBLIC BunView* BunIndexViewBundle(BunIndex* idx, int32_t bundle_id);
+	BUN_DLL_PUBLIC BunView* BunIndexViewFile(BunIndex* idx, int32_t file_id);
+	BUN_DLL_PUBLIC uint8_t const* BunViewData(BunView const* view);
+	BUN_DLL_PUBLIC int64_t BunViewSize(BunView const* view);
+	BUN_DLL_PUBLIC void BunViewRelease(BunView* view);
+
+	BUN_DLL_PUBLIC int BunIndexCacheStats(BunIndex const* idx, uint64_t* hits, uint64_t* misses, uint64_t* evictions,
+		uint64_t* bytes_cached);
+
 	BUN_DLL_PUBLIC int BunIndexBundleInfo(BunIndex const* idx, int32_t bundle_info_id, char const** name, uint32_t* uncompressed_size);
 	BUN_DLL_PUBLIC int BunIndexFileInfo(BunIndex const* idx, int32_t file_info_id,
 		uint64_t* path_hash, uint32_t* bundle_index_, uint32_t* file_offset_, uint32_t* file_size_);
@@ -82,7 +121,8 @@ extern "C" {
 	* They can either decompress into an user-supplied buffer of sufficient size or allocate a buffer for the caller.
 	* Allocating functions return an BunMem or NULL.
 	* Functions with user-supplied storage returns the resulting size or -1 in case of error.
-	* The buffer supplied must have an additional 64 bytes of scratch space at the end.
+	* The buffer supplied must have an additional 64 bytes of scratch space at the end, unless the decompressor
+	* exports Ooz_IsExactBounds and it returns nonzero.
 	*/
 	BUN_DLL_PUBLIC int BunDecompressBlock(Bun* bun, uint8_t const* src_data, size_t src_size, uint8_t* dst_data, size_t dst_size);
 	BUN_DLL_PUBLIC BunMem BunDecompressBlockAlloc(Bun* bun, uint8_t const* src_data, size_t src_size, size_t dst_size);
@@ -22,7 +22,8 @@ static char const *const USAGE =
     "bun_extract_file extract-files [--regex] GGPK_OR_STEAM_DIR OUTPUT_DIR [FILE_PATHS...]\n\n"
     "GGPK_OR_STEAM_DIR should be either a full path to a Standalone GGPK file or the Steam game directory.\n"
     "If FILE_PATHS are omitted the file paths are taken from stdin.\n"
-    "If --regex is given, FILE_PATHS are interpreted as regular expressions to match.\n";
+    "If --regex is given, FILE_PATHS are interpreted as regular expressions to match.\n"
+    "If --threads N is given, the blocks of each bundle are decompressed on N threads (-1 uses all hardware threads).\n";
 
 struct fs_node {
   std::map<std::string_view, std::unique_ptr<fs_node>> children;
@@ -43,6 +44,7 @@ int main(int argc, char *argv[]) {
   std::filesystem::path output_dir;
   bool use_regex = false;
   bool use_mmap = false;
+  int worker_count = 0;
   std::vector<std::string> tail_args;
 
   command = argv[1];
@@ -58,6 +60,9 @@ int main(int argc, char *argv[]) {
     } else if (argv[argi] == "--no-mmap"sv) {
       use_mmap = false;
       ++argi;
+    } else if (argv[argi] == "--threads"sv && argi + 1 < argc) {
+      worker_count = atoi(argv[argi + 1]);
+      argi += 2;
     } else {
       break;
     }
@@ -94,9 +99,9 @@ int main(int argc, char *argv[]) {
 #else
   std::string ooz_dll = "liblibooz.so";
 #endif
-  Bun *bun = BunNew(ooz_dll.c_str(), "Ooz_Decompress");
+  Bun *bun = BunNewEx(ooz_dll.c_str(), "Ooz_Decompress", worker_count);
   if (!bun) {
-    bun = BunNew(("./" + ooz_dll).c_str(), "Ooz_Decompress");
+    bun = BunNewEx(("./" + ooz_dll).c_str(), "Ooz_Decompress", worker_count);
     if (!bun) {
       fprintf(stderr, "Could not initialize Bun library\n");
       return 1;
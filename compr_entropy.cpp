@@ -2,6 +2,7 @@
 #include "stdafx.h"
 #include "compr_entropy.h"
 #include "compr_util.h"
+#include "cost_profile.h"
 #include <algorithm>
 #include <vector>
 #include "qsort.h"
@@ -9,6 +10,15 @@
 #pragma warning (disable: 4018)
 
 float CombineCostComponents(int platforms, float a, float b, float c, float d) {
+  if (platforms & kPlatformsProfile) {
+    const CostProfile *p = CostProfile_Get(platforms);
+    if (p) {
+      const float *w = p->weights;
+      return (c * 0.762f * w[0] + a * 1.130f * w[1] + d * 1.310f * w[2] + b * 0.961f * w[3]) *
+             p->scale[(platforms >> kPlatformsCodecShift) & 3];
+    }
+    platforms = 0;
+  }
   if ((platforms & 0xf) == 0)
     return (a + b + c + d) * 0.25f;
   int n = 0;
@@ -30,6 +40,8 @@ float CombineCostComponents1A(int platforms, float v, float a, float b, float c,
 }
 
 float GetTime_SingleHuffman(int platforms, int count, int numsyms) {
+  if (const float *k = CostProfile_Kernel(platforms, kCostKernel_SingleHuffman))
+    return k[0] + count * k[1] + numsyms * k[2];
   return CombineCostComponents(
     platforms,
     1880.931f + count * 3.243f + numsyms * 10.960f,
@@ -39,6 +51,8 @@ float GetTime_SingleHuffman(int platforms, int count, int numsyms) {
 }
 
 float GetTime_DoubleHuffman(int platforms, int count, int numsyms) {
+  if (const float *k = CostProfile_Kernel(platforms, kCostKernel_DoubleHuffman))
+    return k[0] + count * k[1] + numsyms * k[2];
   return CombineCostComponents(
     platforms,
     2029.917f + count * 2.436f + numsyms * 10.792f,
@@ -54,6 +68,8 @@ float GetTime_AdvRLE(int platforms, int src_size) {
 }
 
 float GetTime_Memset(int platforms, int src_size) {
+  if (const float *k = CostProfile_Kernel(platforms, kCostKernel_Memset))
+    return k[0] + src_size * k[1];
   return CombineCostComponents1A(platforms, src_size,
                                  0.125f, 0.171f, 0.256f, 0.083f,
                                  28.0f, 53.0f, 58.0f, 29.0f);
@@ -783,7 +799,7 @@ void HuffBuilder::CalcNumsymsEtc() {
     min_len++;
   min_code_len_ = min_len;
 
-  int max_len = 31;
+  int max_len = kMaxCodeLen - 1;
   while (!numsyms_of_len_[max_len])
     max_len--;
   max_code_len_ = max_len;
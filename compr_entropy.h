@@ -39,6 +39,7 @@ float GetCost_SingleHuffman(const HistoU8 &histo, int histo_sum, float speed_tra
 float GetTime_SingleHuffman(int platforms, int count, int numsyms);
 float GetTime_DoubleHuffman(int platforms, int count, int numsyms);
 float GetTime_Memset(int platforms, int src_size);
+float GetTime_tANS(int platforms, int src_size, int used_syms, int tans_table_size);
 int GetLog2Interpolate(uint x);
 void CountBytesHistoU8(const uint8 *data, size_t data_size, HistoU8 *histo);
 
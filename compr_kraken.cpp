@@ -2,6 +2,7 @@
 #include "stdafx.h"
 #include "compr_kraken.h"
 #include "compress.h"
+#include "cost_profile.h"
 #include "compr_util.h"
 #include "compr_entropy.h"
 #include <algorithm>
@@ -1642,7 +1643,7 @@ void SetupEncoder_Kraken(LzCoder *coder, int src_len, int level,
   coder->codec_id = kCompressorKraken;
   coder->quantum_blocksize = 0x20000;
   coder->check_plain_huffman = (level >= 3);
-  coder->platforms = 0;
+  coder->platforms = CostProfile_Platforms(copts, kCompressorKraken);
   coder->compression_level = level;
   coder->opts = copts;
   coder->speed_tradeoff = (copts->spaceSpeedTradeoffBytes * 0.00390625f) * 0.0099999998f;
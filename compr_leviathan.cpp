@@ -2,6 +2,7 @@
 #include "stdafx.h"
 #include "compr_leviathan.h"
 #include "compress.h"
+#include "cost_profile.h"
 #include "compr_util.h"
 #include "compr_entropy.h"
 #include "compr_match_finder.h"
@@ -904,8 +905,8 @@ static int Leviathan_EncodeLzArrays(LzTemp *lz_temp, float *cost_ptr, Levi::LitS
   int u32_len_total = (u32_ml - u32_ml_cur) + (u32_lrl_cur - u32_lrl);
   int u8_len_total = u8_lrl_total + u8_ml_total;
 
-  memcpy(u8_lrl_cur, u8_ml_cur, u8_ml_total);
-  memcpy(u32_lrl_cur, u32_ml_cur, sizeof(uint32) * (u32_ml - u32_ml_cur));
+  memmove(u8_lrl_cur, u8_ml_cur, u8_ml_total);
+  memmove(u32_lrl_cur, u32_ml_cur, sizeof(uint32) * (u32_ml - u32_ml_cur));
 
   if (arrhisto) {
     CountBytesHistoU8(u8_lrl, u8_lrl_total, &arrhisto->litlen_histo);
@@ -2063,7 +2064,7 @@ void SetupEncoder_Leviathan(LzCoder *coder, int src_len, int level,
   coder->codec_id = kCompressorLeviathan;
   coder->quantum_blocksize = 0x20000;
   coder->check_plain_huffman = true;
-  coder->platforms = 0;
+  coder->platforms = CostProfile_Platforms(copts, kCompressorLeviathan);
   coder->compression_level = level;
   coder->opts = copts;
   coder->speed_tradeoff = (copts->spaceSpeedTradeoffBytes * 0.00390625f) * 0.0024999999f;
@@ -2075,7 +2076,6 @@ void SetupEncoder_Leviathan(LzCoder *coder, int src_len, int level,
     coder->entropy_opts &= ~kEntropyOpt_MultiArrayAdvanced;
   if (level <= 2)
     coder->entropy_opts &= ~kEntropyOpt_MultiArray;
-  coder->platforms = 0;
 
   if (level <= 1) {
     coder->entropy_opts &= ~kEntropyOpt_tANS;
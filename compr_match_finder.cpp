@@ -2,6 +2,8 @@
 #include "stdafx.h"
 #include "compr_match_finder.h"
 #include <algorithm>
+#include <atomic>
+#include <thread>
 #include <vector>
 #include "compress.h"
 #include "compr_util.h"
@@ -92,13 +94,18 @@ static uint8 *VarLenWriteLength(uint8 *dst, unsigned int value, int A, int B) {
 
 MatchLenStorage *MatchLenStorage::Create(int entries, float avg_bytes) {
   MatchLenStorage *mls = new MatchLenStorage;
-  mls->byte_buffer.resize((int)(entries * avg_bytes));
-  mls->offset2pos.resize(entries);
-  mls->byte_buffer_use = 1;
-  mls->window_base = NULL;
+  mls->Reset(entries, avg_bytes);
   return mls;
 }
 
+void MatchLenStorage::Reset(int entries, float avg_bytes) {
+  if (byte_buffer.size() < (size_t)(entries * avg_bytes))
+    byte_buffer.resize((int)(entries * avg_bytes));
+  offset2pos.assign(entries, 0);
+  byte_buffer_use = 1;
+  window_base = NULL;
+}
+
 void MatchLenStorage::Destroy(MatchLenStorage *mls) {
   delete mls;
 }
@@ -479,9 +486,11 @@ static LengthAndOffset *RemoveIdentical(LengthAndOffset *p, LengthAndOffset *pen
   return pend;
 }
 
-void FindMatchesHashBased(uint8 *src_base, int src_size, MatchLenStorage *mls, int max_num_matches, int preload_size, LRMTable *lrm_table) {
-  MatchHasher<16, true> hasher;
-
+// Finds matches for the positions from |preload_size| to |scan_end|, which may
+// reach up to |src_size|. |mls| is indexed from |preload_size|.
+static void FindMatchesHashBasedRange(uint8 *src_base, int src_size, MatchLenStorage *mls, int max_num_matches,
+                                      int preload_size, int scan_end, LRMTable *lrm_table,
+                                      MatchHasher<16, true> &hasher) {
   int bits = std::min<int>(std::max<int>(BSR(std::max(std::min(src_size, INT_MAX), 2) - 1) + 1, 18), 24);
   hasher.AllocateHash(bits, 0);
   hasher.SetBaseAndPreload(src_base, src_base + preload_size, preload_size);
@@ -495,7 +504,9 @@ void FindMatchesHashBased(uint8 *src_base, int src_size, MatchLenStorage *mls, i
 
   uint8 *src_safe4 = src_base + src_size - 4;
   int src_size_safe = src_size - 8;
-  for (int cur_pos = preload_size; cur_pos < src_size_safe; cur_pos++) {
+  int scan_end_safe = std::min(scan_end, src_size_safe);
+  int num_pos = scan_end - preload_size;
+  for (int cur_pos = preload_size; cur_pos < scan_end_safe; cur_pos++) {
     src = src_base + cur_pos;
     uint32 u32_to_scan_for = *(uint32*)src;
 
@@ -569,8 +580,9 @@ void FindMatchesHashBased(uint8 *src_base, int src_size, MatchLenStorage *mls, i
 
       if (best_ml >= 77) {
         match[0].length = best_ml - 1;
-        MatchLenStorage_InsertMatches(mls, pos + 1, match, 1);
-        for (int i = 4; i < best_ml; i += 4) {
+        if (pos + 1 < num_pos)
+          MatchLenStorage_InsertMatches(mls, pos + 1, match, 1);
+        for (int i = 4; i < best_ml && pos + i < num_pos; i += 4) {
           match[0].length = best_ml - i;
           MatchLenStorage_InsertMatches(mls, pos + i, match, 1);
         }
@@ -585,6 +597,517 @@ void FindMatchesHashBased(uint8 *src_base, int src_size, MatchLenStorage *mls, i
 }
 
 
+// The positions are split into segments of this size, each searched with its own
+// hasher preloaded from the data before it. The split doesn't depend on the
+// number of threads so neither does the output.
+static const int kMatchFinderSegment = 4 << 20;
+
+void FindMatchesHashBased(uint8 *src_base, int src_size, MatchLenStorage *mls, int max_num_matches, int preload_size,
+                          LRMTable *lrm_table, int num_threads, MatchHasher<16, true> *hasher) {
+  int scan_size = src_size - preload_size;
+  int num_segments = std::max(scan_size / kMatchFinderSegment, 1);
+  MatchHasher<16, true> local_hasher;
+  if (num_segments == 1) {
+    FindMatchesHashBasedRange(src_base, src_size, mls, max_num_matches, preload_size, src_size, lrm_table,
+                              hasher ? *hasher : local_hasher);
+    return;
+  }
+  auto segment_start = [&](int i) { return preload_size + (int)((int64)scan_size * i / num_segments); };
+
+  std::vector<MatchLenStorage*> parts(num_segments);
+  std::atomic<int> next(0);
+  auto worker = [&] {
+    for (int i; (i = next++) < num_segments; ) {
+      int start = segment_start(i), end = segment_start(i + 1);
+      parts[i] = MatchLenStorage::Create(end - start + 1, 8.0f);
+      MatchHasher<16, true> segment_hasher;
+      FindMatchesHashBasedRange(src_base, src_size, parts[i], max_num_matches, start, end, lrm_table,
+                                (i == 0 && hasher) ? *hasher : segment_hasher);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < std::min(num_threads, num_segments); i++)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread &t : threads)
+    t.join();
+
+  // Append each segment's matches, skipping the unused first byte of its buffer.
+  for (int i = 0; i < num_segments; i++) {
+    MatchLenStorage *part = parts[i];
+    int start = segment_start(i) - preload_size, end = segment_start(i + 1) - preload_size;
+    int base = mls->byte_buffer_use - 1;
+    if (mls->byte_buffer.size() < (size_t)(base + part->byte_buffer_use))
+      mls->byte_buffer.resize(base + part->byte_buffer_use);
+    memcpy(mls->byte_buffer.data() + mls->byte_buffer_use, part->byte_buffer.data() + 1, part->byte_buffer_use - 1);
+    mls->byte_buffer_use = base + part->byte_buffer_use;
+    for (int j = start; j < end; j++)
+      if (int pos = part->offset2pos[j - start])
+        mls->offset2pos[j] = pos + base;
+    MatchLenStorage::Destroy(part);
+  }
+}
+
+// Binary tree match finder, the BT4 of LZMA. The positions with the same 4 byte
+// hash form a binary search tree ordered by the bytes that follow them, and
+// inserting a position at the root of its tree walks down past the positions
+// sharing the longest prefixes with it. The trees hold the last window of
+// positions, the oldest node being reused for the newest.
+static const int kBinaryTreeMaxWindowBits = 24;
+// Nodes visited per position, and the match length after which the search
+// stops and the position takes over the node it matched.
+static const int kBinaryTreeDepth = 32;
+static const int kBinaryTreeNiceLength = 128;
+
+struct BinaryTree {
+  std::vector<int> head, son;
+  int hash_bits, window_mask;
+};
+
+static __forceinline int *BinaryTree_Head(BinaryTree *bt, const uint8 *p) {
+  return &bt->head[(*(uint32*)p * 2654435761u) >> (32 - bt->hash_bits)];
+}
+
+// Inserts |pos| and returns the matches found on the way, each longer than the
+// one before, in |match| unless it's NULL.
+static int BinaryTree_Insert(BinaryTree *bt, const uint8 *src_base, int pos, int len_limit, LengthAndOffset *match) {
+  const uint8 *cur = src_base + pos;
+  int *head = BinaryTree_Head(bt, cur);
+  int cur_match = *head;
+  *head = pos;
+  int *son = bt->son.data(), mask = bt->window_mask;
+  int *ptr0 = son + ((pos & mask) << 1) + 1, *ptr1 = son + ((pos & mask) << 1);
+  int len0 = 0, len1 = 0, best_len = 3, num_match = 0;
+  for (int depth = kBinaryTreeDepth; ; depth--) {
+    int delta = pos - cur_match;
+    if (cur_match < 0 || delta > mask || depth == 0) {
+      *ptr0 = *ptr1 = -1;
+      break;
+    }
+    int *pair = son + ((cur_match & mask) << 1);
+    const uint8 *pb = cur - delta;
+    int len = std::min(len0, len1);
+    if (pb[len] == cur[len]) {
+      len += 1 + CountMatchingBytes(cur + len + 1, cur + len_limit, delta);
+      if (len > best_len) {
+        best_len = len;
+        if (match)
+          match[num_match++].Set(len, delta);
+        if (len == len_limit) {
+          // Matched as far as it looks, so |pos| takes over the node's subtrees.
+          *ptr1 = pair[0];
+          *ptr0 = pair[1];
+          break;
+        }
+      }
+    }
+    if (pb[len] < cur[len]) {
+      *ptr1 = cur_match;
+      ptr1 = pair + 1;
+      cur_match = *ptr1;
+      len1 = len;
+    } else {
+      *ptr0 = cur_match;
+      ptr0 = pair;
+      cur_match = *ptr0;
+      len0 = len;
+    }
+  }
+  return num_match;
+}
+
+void FindMatchesBinaryTree(uint8 *src_base, int src_size, MatchLenStorage *mls, int max_num_matches, int preload_size,
+                           LRMTable *lrm_table) {
+  BinaryTree bt;
+  int window_bits = std::min<int>(BSR(std::max(src_size, 2) - 1) + 1, kBinaryTreeMaxWindowBits);
+  bt.hash_bits = std::min(std::max(window_bits - 1, 16), 22);
+  bt.window_mask = (1 << window_bits) - 1;
+  bt.head.assign(1 << bt.hash_bits, -1);
+  bt.son.resize(2 << window_bits);
+
+  int src_size_safe = src_size - 8;
+  uint8 *src_end = src_base + src_size;
+  // Only the last window of the preloaded data can still be matched.
+  for (int pos = std::max(preload_size - bt.window_mask, 0); pos < std::min(preload_size, src_size_safe); pos++)
+    BinaryTree_Insert(&bt, src_base, pos, std::min(kBinaryTreeNiceLength, src_size - pos), NULL);
+
+  LRMScannerEx lrm;
+  LRMScannerEx_Setup(&lrm, lrm_table, src_base + preload_size, src_end, 0x40000000);
+
+  int num_pos = src_size - preload_size;
+  for (int cur_pos = preload_size; cur_pos < src_size_safe; cur_pos++) {
+    uint8 *src = src_base + cur_pos;
+    LengthAndOffset match[kBinaryTreeDepth + 1];
+    int num_match = 0;
+
+    if (lrm_table) {
+      int lrm_offset, lrm_length = LRMScannerEx_FindMatch(&lrm, src, src_end, &lrm_offset);
+      if (lrm_length > 0)
+        match[num_match++].Set(lrm_length, lrm_offset);
+    }
+    // The tree walk is bound by cache misses, so fetch the heads of positions
+    // coming up and then the roots they point at. Hashing src + 8 reads up to
+    // src + 12, which near the end is past the input.
+    if (cur_pos + 12 <= src_size)
+      simde_mm_prefetch((char*)BinaryTree_Head(&bt, src + 8), SIMDE_MM_HINT_T0);
+    int next_root = *BinaryTree_Head(&bt, src + 4);
+    if (next_root >= 0) {
+      simde_mm_prefetch((char*)&bt.son[(next_root & bt.window_mask) << 1], SIMDE_MM_HINT_T0);
+      simde_mm_prefetch((char*)(src_base + next_root), SIMDE_MM_HINT_T0);
+    }
+    int len_limit = std::min(kBinaryTreeNiceLength, src_size - cur_pos);
+    int n = BinaryTree_Insert(&bt, src_base, cur_pos, len_limit, match + num_match);
+    num_match += n;
+    // The longest match may go on past where the search stopped.
+    if (n && match[num_match - 1].length == kBinaryTreeNiceLength) {
+      LengthAndOffset &m = match[num_match - 1];
+      m.length += CountMatchingBytes(src + m.length, src_end, m.offset);
+    }
+    if (!num_match)
+      continue;
+
+    MySort(match, match + num_match);
+    num_match = RemoveIdentical(match, match + num_match) - match;
+
+    int pos = cur_pos - preload_size;
+    MatchLenStorage_InsertMatches(mls, pos, match, std::min<int>(max_num_matches, num_match));
+
+    // Long matches are taken as they are, as FindMatchesHashBasedRange does,
+    // the positions they cover only going into the trees.
+    int best_ml = match[0].length;
+    if (best_ml >= 77) {
+      match[0].length = best_ml - 1;
+      if (pos + 1 < num_pos)
+        MatchLenStorage_InsertMatches(mls, pos + 1, match, 1);
+      for (int i = 4; i < best_ml && pos + i < num_pos; i += 4) {
+        match[0].length = best_ml - i;
+        MatchLenStorage_InsertMatches(mls, pos + i, match, 1);
+      }
+      for (int i = 1; i < best_ml && cur_pos + i < src_size_safe; i++)
+        BinaryTree_Insert(&bt, src_base, cur_pos + i, std::min(kBinaryTreeNiceLength, src_size - cur_pos - i), NULL);
+      cur_pos += best_ml - 1;
+      if (lrm_table)
+        LRMScannerEx_Setup(&lrm, lrm_table, src + best_ml, src_end, 0x40000000);
+    }
+  }
+}
+
+// Suffix array construction by induced sorting (SA-IS, Nong, Zhang and Chan,
+// "Two Efficient Algorithms for Linear Time Suffix Array Construction"). The
+// text of |n| symbols up to |k| ends with a unique smallest sentinel. The
+// reduced problem is solved inside |sa|, so besides |sa| this needs a bit per
+// symbol and the buckets.
+struct SaisBytes {
+  const uint8 *s;
+  int size;
+  // Bytes move up by one to make room for the sentinel after them.
+  int operator[](int i) const { return i < size ? s[i] + 1 : 0; }
+};
+
+struct SaisInts {
+  const int *s;
+  int operator[](int i) const { return s[i]; }
+};
+
+template<typename Text>
+static void Sais_GetBuckets(const Text &s, int *bkt, int n, int k, bool end) {
+  memset(bkt, 0, (k + 1) * sizeof(int));
+  for (int i = 0; i < n; i++)
+    bkt[s[i]]++;
+  for (int i = 0, sum = 0; i <= k; i++) {
+    sum += bkt[i];
+    bkt[i] = end ? sum : sum - bkt[i];
+  }
+}
+
+template<typename Text>
+static void Sais_Induce(const Text &s, const std::vector<bool> &stype, int *sa, int *bkt, int n, int k) {
+  Sais_GetBuckets(s, bkt, n, k, false);
+  for (int i = 0; i < n; i++) {
+    int j = sa[i] - 1;
+    if (j >= 0 && !stype[j])
+      sa[bkt[s[j]]++] = j;
+  }
+  Sais_GetBuckets(s, bkt, n, k, true);
+  for (int i = n - 1; i >= 0; i--) {
+    int j = sa[i] - 1;
+    if (j >= 0 && stype[j])
+      sa[--bkt[s[j]]] = j;
+  }
+}
+
+template<typename Text>
+static void Sais_Build(const Text &s, int *sa, int n, int k) {
+  std::vector<bool> stype(n);
+  stype[n - 1] = true;
+  for (int i = n - 2; i >= 0; i--)
+    stype[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && stype[i + 1]);
+  auto is_lms = [&](int i) { return i > 0 && stype[i] && !stype[i - 1]; };
+
+  // Sort the LMS substrings by placing them at their bucket ends and inducing.
+  std::vector<int> bkt(k + 1);
+  Sais_GetBuckets(s, bkt.data(), n, k, true);
+  for (int i = 0; i < n; i++)
+    sa[i] = -1;
+  for (int i = 1; i < n; i++)
+    if (is_lms(i))
+      sa[--bkt[s[i]]] = i;
+  Sais_Induce(s, stype, sa, bkt.data(), n, k);
+
+  // Name them, equal substrings getting equal names, into the back half.
+  int n1 = 0;
+  for (int i = 0; i < n; i++)
+    if (is_lms(sa[i]))
+      sa[n1++] = sa[i];
+  for (int i = n1; i < n; i++)
+    sa[i] = -1;
+  int name = 0, prev = -1;
+  for (int i = 0; i < n1; i++) {
+    int pos = sa[i];
+    bool diff = false;
+    for (int d = 0; d < n; d++) {
+      if (prev == -1 || s[pos + d] != s[prev + d] || stype[pos + d] != stype[prev + d]) {
+        diff = true;
+        break;
+      }
+      if (d > 0 && (is_lms(pos + d) || is_lms(prev + d)))
+        break;
+    }
+    if (diff) {
+      name++;
+      prev = pos;
+    }
+    sa[n1 + pos / 2] = name - 1;
+  }
+  for (int i = n - 1, j = n - 1; i >= n1; i--)
+    if (sa[i] >= 0)
+      sa[j--] = sa[i];
+
+  // Sort the LMS suffixes, recursing if the names aren't unique yet.
+  int *sa1 = sa, *s1 = sa + n - n1;
+  if (name < n1) {
+    SaisInts text1 = { s1 };
+    Sais_Build(text1, sa1, n1, name - 1);
+  } else {
+    for (int i = 0; i < n1; i++)
+      sa1[s1[i]] = i;
+  }
+
+  // Place the sorted LMS suffixes and induce the rest from them.
+  Sais_GetBuckets(s, bkt.data(), n, k, true);
+  for (int i = 1, j = 0; i < n; i++)
+    if (is_lms(i))
+      s1[j++] = i;
+  for (int i = 0; i < n1; i++)
+    sa1[i] = s1[sa1[i]];
+  for (int i = n1; i < n; i++)
+    sa[i] = -1;
+  for (int i = n1 - 1; i >= 0; i--) {
+    int j = sa[i];
+    sa[i] = -1;
+    sa[--bkt[s[j]]] = j;
+  }
+  Sais_Induce(s, stype, sa, bkt.data(), n, k);
+}
+
+// Suffix order is cut into blocks of 16, 256 and 4096 positions, each keeping
+// the latest position added to it and the smallest LCP from its first entry
+// through the one after it, which is what crossing the block costs a prefix.
+static const int kSuffixArrayLevels = 3;
+static const int kSuffixArrayLevelBits[kSuffixArrayLevels] = { 4, 8, 12 };
+
+// The farthest a match of |len| is taken by the encoders (KrakIsMatchLongEnough).
+static int SuffixArrayMaxOffset(int len) {
+  return len < 4 ? 0x4000 : len < 5 ? 0x20000 : len < 6 ? 0x100000 : len < 8 ? 0x400000 : INT_MAX;
+}
+
+// A position in suffix order and the prefix it shares with the one before,
+// side by side to be read together.
+struct SuffixEntry {
+  int pos, lcp;
+};
+
+// Same as FindMatchesSuffixTrie, from a suffix array and LCP array. The
+// positions are added in text order, and every position looks outward from
+// itself in suffix order at the earlier positions, along which the shared
+// prefix only gets shorter, keeping each one closer than the ones before.
+// Blocks holding nothing closer are stepped over whole, as are blocks sharing
+// all of the prefix, whose latest position is the one to keep, so a position
+// mostly visits the blocks its matches are in. Ranks are found for a sixteenth
+// of the text at a time and the LCP array is built in place, so the suffix
+// and LCP arrays and the text are all the memory it needs but for the blocks,
+// 9.5 bytes per input byte.
+void FindMatchesSuffixArray(uint8 *src_in, int src_size, MatchLenStorage *mls, int max_matches_to_consider, int src_offset_start, LRMTable *lrm) {
+  if (src_size < 4)
+    return;
+  // The suffix array is built in the front half, sa[0] being the sentinel,
+  // then spread out over the entries.
+  std::vector<SuffixEntry> sa(src_size + 1);
+  int *sa_buf = &sa[0].pos;
+  SaisBytes text = { src_in, src_size };
+  Sais_Build(text, sa_buf, src_size + 1, 256);
+  for (int i = src_size - 1; i >= 0; i--)
+    sa[i].pos = sa_buf[i + 1];
+  sa.pop_back();
+
+  // sa[i].lcp is the prefix sa[i] shares with sa[i - 1]. It's found in text
+  // order first (Karkkainen et al.), sa[p].lcp standing in for position p, then
+  // moved along the cycles of the permutation.
+  sa[sa[0].pos].lcp = -1;
+  for (int i = 1; i < src_size; i++)
+    sa[sa[i].pos].lcp = sa[i - 1].pos;
+  for (int p = 0, len = 0; p < src_size; p++) {
+    int q = sa[p].lcp;
+    if (q < 0) {
+      sa[p].lcp = len = 0;
+      continue;
+    }
+    while (p + len < src_size && q + len < src_size && src_in[p + len] == src_in[q + len])
+      len++;
+    sa[p].lcp = len;
+    len = std::max(len - 1, 0);
+  }
+  {
+    std::vector<bool> done(src_size);
+    for (int i = 0; i < src_size; i++) {
+      if (done[i])
+        continue;
+      int first = sa[i].lcp, j = i;
+      for (int k; (k = sa[j].pos) != i; j = k) {
+        sa[j].lcp = sa[k].lcp;
+        done[j] = true;
+      }
+      sa[j].lcp = first;
+      done[j] = true;
+    }
+  }
+
+  // Per block the latest position, and the smallest LCP from its first entry
+  // through the one after it, so it can be stepped over either way.
+  std::vector<SuffixEntry> blocks[kSuffixArrayLevels];
+  for (int lv = 0; lv < kSuffixArrayLevels; lv++) {
+    int bits = kSuffixArrayLevelBits[lv];
+    blocks[lv].assign((src_size >> bits) + 1, { -1, INT_MAX });
+    for (int i = 0; i < src_size; i++) {
+      SuffixEntry &b = blocks[lv][i >> bits];
+      b.lcp = std::min(b.lcp, sa[i].lcp);
+      if (i && !(i & ((1 << bits) - 1)))
+        blocks[lv][(i >> bits) - 1].lcp = std::min(blocks[lv][(i >> bits) - 1].lcp, sa[i].lcp);
+    }
+  }
+
+  int chunk_size = std::max((src_size + 15) >> 4, 0x10000);
+  std::vector<int> rank(std::min(chunk_size, src_size));
+  std::vector<LengthAndOffset> match(max_matches_to_consider);
+  for (int p = 0, run = 0; p < src_size; p++) {
+    if (p % chunk_size == 0) {
+      for (int i = 0; i < src_size; i++)
+        if ((uint)(sa[i].pos - p) < (uint)chunk_size)
+          rank[sa[i].pos - p] = i;
+    }
+    int i = rank[p % chunk_size];
+    // The run of the byte before |p| is matched at offset 1, so nothing as
+    // long or shorter is worth looking for.
+    if (run > 0)
+      run--;
+    else if (p > 0)
+      while (p + run < src_size && src_in[p + run] == src_in[p - 1])
+        run++;
+    if (p >= src_offset_start) {
+      // Going away from |p| the shared prefix only gets shorter. Stepping the
+      // side sharing more first, the matches come longest first, and an
+      // earlier position is only worth it if it's closer than the ones before
+      // and close enough for its length. |len| is the prefix shared with sa[j]
+      // on each side.
+      int j[2] = { i - 1, i + 1 };
+      int len[2] = { i > 0 ? sa[i].lcp : 0, i + 1 < src_size ? sa[i + 1].lcp : 0 };
+      int min_len = std::max(run + 1, 3), num_match = 0;
+      for (int closest = -1; num_match < max_matches_to_consider;) {
+        int side = len[0] >= len[1] ? 0 : 1, dir = side ? 1 : -1, cur = j[side], q_len = len[side];
+        if (q_len < min_len)
+          break;
+        int floor = std::max(closest, p - SuffixArrayMaxOffset(q_len) - 1), q = -1, new_len = 0;
+        // Blocks with nothing closer that keep the prefix are passed over, and
+        // one with something closer that keeps it gives its latest position.
+        // Otherwise the block is looked into, down to single entries.
+        int lv = kSuffixArrayLevels - 1;
+        while (lv >= 0 && ((side ? cur : cur + 1) & ((1 << kSuffixArrayLevelBits[lv]) - 1)))
+          lv--;
+        for (; lv >= 0; lv--) {
+          // Up to the end of the block one level up, to go on from there.
+          int bits = kSuffixArrayLevelBits[lv];
+          int up = lv + 1 < kSuffixArrayLevels ? (1 << kSuffixArrayLevelBits[lv + 1]) - 1 : -1;
+          const SuffixEntry *b = &blocks[lv][cur >> bits];
+          int start = cur;
+          while (b->pos <= floor && b->lcp >= q_len && (uint)(cur += dir << bits) < (uint)src_size &&
+                 ((side ? cur : cur + 1) & up))
+            b += dir;
+          if (cur != start) {
+            new_len = q_len;
+            break;
+          }
+          if (b->pos <= floor || b->lcp >= q_len) {
+            q = b->pos;
+            new_len = std::min(q_len, b->lcp);
+            cur += dir << bits;
+            break;
+          }
+        }
+        if (lv < 0) {
+          for (;;) {
+            int pos = sa[cur].pos, edge = sa[side ? std::min(cur + 1, src_size - 1) : cur].lcp;
+            cur += dir;
+            if ((pos > floor && pos < p) || edge < q_len || (uint)cur >= (uint)src_size ||
+                !((side ? cur : cur + 1) & ((1 << kSuffixArrayLevelBits[0]) - 1))) {
+              q = pos;
+              new_len = std::min(q_len, edge);
+              break;
+            }
+          }
+        }
+        j[side] = cur;
+        len[side] = (uint)cur < (uint)src_size ? new_len : 0;
+        if (q > floor && q < p) {
+          // One as long but closer replaces the one before.
+          if (!num_match || match[num_match - 1].length != q_len)
+            num_match++;
+          closest = q;
+          match[num_match - 1].Set(q_len, p - q);
+        }
+      }
+      // The run is shorter than all of them and closer.
+      if (run >= 3 && num_match < max_matches_to_consider)
+        match[num_match++].Set(run, 1);
+      if (num_match)
+        MatchLenStorage_InsertMatches(mls, p - src_offset_start, match.data(), num_match);
+    }
+    for (int lv = 0; lv < kSuffixArrayLevels; lv++)
+      blocks[lv][i >> kSuffixArrayLevelBits[lv]].pos = p;
+  }
+
+  // The long range matcher scans in text order, its matches go in front where
+  // they're longer.
+  if (lrm) {
+    LRMScannerEx lrmscanner;
+    LRMScannerEx_Setup(&lrmscanner, lrm, src_in + src_offset_start, src_in + src_size, INT_MAX);
+    for (int p = src_offset_start; p < src_size - 4; p++) {
+      int lrm_offset, lrm_length = LRMScannerEx_FindMatch(&lrmscanner, src_in + p, src_in + src_size, &lrm_offset);
+      int n = 0;
+      if (mls->offset2pos[p - src_offset_start]) {
+        ExtractLaoFromMls(mls, p - src_offset_start, 1, match.data() + 1, max_matches_to_consider - 1);
+        while (n + 1 < max_matches_to_consider && match[n + 1].length > 0)
+          n++;
+      }
+      if (lrm_length > (n ? match[1].length : 0)) {
+        match[0].Set(lrm_length, lrm_offset);
+        MatchLenStorage_InsertMatches(mls, p - src_offset_start, match.data(), n + 1);
+      }
+    }
+  }
+}
+
+
+
 void LRM_ReduceIdenticalHashes(LRMEnt *lrm) {
   HashPos *arrhashpos = lrm->arrhashpos.data();
   int arrhashpos_count = lrm->arrhashpos.size(), i;
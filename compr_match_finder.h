@@ -57,10 +57,26 @@ struct MatchLenStorage {
 
   static MatchLenStorage *Create(int entries, float avg_bytes);
   static void Destroy(MatchLenStorage *mls);
+  // Empties the storage for |entries| positions, keeping its buffers.
+  void Reset(int entries, float avg_bytes);
 };
 
 void FindMatchesSuffixTrie(uint8 *src_in, int src_size, MatchLenStorage *mls, int max_matches_to_consider, int src_offset_start, LRMTable *lrm);
-void FindMatchesHashBased(uint8 *src_base, int src_size, MatchLenStorage *mls, int max_num_matches, int preload_size, LRMTable *lrm_table);
+// Finds the same kind of matches from a suffix array, in about 9.5 bytes per
+// input byte however repetitive the input.
+void FindMatchesSuffixArray(uint8 *src_in, int src_size, MatchLenStorage *mls, int max_matches_to_consider, int src_offset_start, LRMTable *lrm);
+// Finds matches in binary trees searched to a bounded depth, closer to the
+// suffix trie's than hashing finds and at a fraction of its cost. Takes 8 bytes
+// per position of a window of up to 16 MB.
+void FindMatchesBinaryTree(uint8 *src_base, int src_size, MatchLenStorage *mls, int max_num_matches, int preload_size,
+                           LRMTable *lrm_table);
+template<int _NumHash, bool _DualHash> class MatchHasher;
+
+// Searches on up to |num_threads| threads at once when the positions past
+// |preload_size| span several segments. The first segment is searched with
+// |hasher| if it's not NULL, so its table can be kept between calls.
+void FindMatchesHashBased(uint8 *src_base, int src_size, MatchLenStorage *mls, int max_num_matches, int preload_size,
+                          LRMTable *lrm_table, int num_threads = 1, MatchHasher<16, true> *hasher = NULL);
 
 struct LRMCascade;
 void LRM_FreeCascade(LRMCascade *lrm);
@@ -2,6 +2,7 @@
 #include "stdafx.h"
 #include "compr_mermaid.h"
 #include "compress.h"
+#include "cost_profile.h"
 #include "compr_util.h"
 #include "compr_entropy.h"
 #include <algorithm>
@@ -34,7 +35,7 @@ struct MermaidWriter {
   int off32_count_2;
 };
 
-void MermaidWriter_Init(MermaidWriter *mw, uint src_len, const uint8 *src, bool use_litsub) {
+void MermaidWriter_Init(MermaidWriter *mw, LzTemp *lztemp, uint src_len, const uint8 *src, bool use_litsub) {
 
   mw->src_ptr = src;
   mw->src_len = src_len;
@@ -50,7 +51,7 @@ void MermaidWriter_Init(MermaidWriter *mw, uint src_len, const uint8 *src, bool
   uint total_size = lit_size + token_size + off16_size * 2 + length_size + off32_size * 4 + 256;
   if (use_litsub)
     total_size += lit_size;
-  uint8 *temp = new uint8[total_size];
+  uint8 *temp = (uint8*)lztemp->scratch0.Allocate(total_size);
 
   mw->lit_start = mw->lit_cur = temp;
   temp += lit_size;
@@ -810,7 +811,7 @@ static int MermaidCompressLoop(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *
   int min_match_length = std::max(coder->opts->min_match_length, 4);
 
   MermaidWriter mw;
-  MermaidWriter_Init(&mw, src_size, src, is_mermaid && (Function::Level >= 0));
+  MermaidWriter_Init(&mw, lztemp, src_size, src, is_mermaid && (Function::Level >= 0));
 
   uint min_match_length_table[32];
   MermaidBuildMatchLengths(min_match_length_table, min_match_length, is_mermaid ? 10 : 14);
@@ -915,7 +916,7 @@ static int MermaidCollectStats(float *cost_ptr, int *chunk_type_ptr, MermaidHist
   MermaidBuildMatchLengths(min_match_lens, min_match_len, minmatch_param);
 
   MermaidWriter mw;
-  MermaidWriter_Init(&mw, src_len, src, true);
+  MermaidWriter_Init(&mw, lztemp, src_len, src, true);
   if (!is_mermaid)
     mw.lit_start = mw.lit_cur = dst + 3 + initial_copy_bytes;
 
@@ -1022,7 +1023,7 @@ static int Mermaid_WriteTokens(float *cost_ptr, int *chunk_type_ptr, MermaidHist
                                int start_pos, MermaidTokArray *tok_array, int middle_token_count) {
   MermaidWriter mw;
   bool is_mermaid = coder->codec_id == kCompressorMermaid;
-  MermaidWriter_Init(&mw, src_len, src, is_mermaid);
+  MermaidWriter_Init(&mw, lztemp, src_len, src, is_mermaid);
   int initial_copy_bytes = (start_pos == 0) ? 8 : 0;
   if (!is_mermaid)
     mw.lit_start = mw.lit_cur = dst + 3 + initial_copy_bytes;
@@ -1072,7 +1073,7 @@ static int Mermaid_GetBytesForRaw(float *cost_ptr, int *chunk_type_out, MermaidH
                                   LzCoder *coder, LzTemp *lztemp,
                                   const uint8 *src, int src_len, int start_pos, int initial_copy_bytes) {
   MermaidWriter mw;
-  MermaidWriter_Init(&mw, src_len, src, true);
+  MermaidWriter_Init(&mw, lztemp, src_len, src, true);
   SubtractBytes(mw.litsub_cur, src + initial_copy_bytes, src_len - initial_copy_bytes, -8);
   mw.litsub_cur += src_len - initial_copy_bytes;
   return Mermaid_WriteLzTable(cost_ptr, chunk_type_out, mh, dst, dst_end, coder, lztemp, &mw, start_pos);
@@ -1982,7 +1983,7 @@ void SetupEncoder_Mermaid(LzCoder *coder, int codec_id, int src_len, int level,
   coder->codec_id = codec_id;
   coder->quantum_blocksize = 0x20000;
   coder->check_plain_huffman = is_mermaid && (level >= 4);
-  coder->platforms = 0;
+  coder->platforms = CostProfile_Platforms(copts, codec_id);
   coder->compression_level = level;
   coder->opts = copts;
   coder->speed_tradeoff = (copts->spaceSpeedTradeoffBytes * 0.00390625f) * (is_mermaid ? 0.050000001f : 0.14f);
@@ -2,11 +2,14 @@
 #include "stdafx.h"
 #include "compr_entropy.h"
 #include "compr_util.h"
+#include "cost_profile.h"
 #include "qsort.h"
 #include <algorithm>
 #include <limits.h>
 
 float GetTime_tANS(int platforms, int src_size, int used_syms, int tans_table_size) {
+  if (const float *k = CostProfile_Kernel(platforms, kCostKernel_Tans))
+    return k[0] + src_size * k[1] + used_syms * k[2] + tans_table_size * k[3];
   return CombineCostComponents(
     platforms,
     642.078f + src_size * 3.175f + used_syms * 52.016f + tans_table_size * 1.895f,
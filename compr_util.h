@@ -109,7 +109,21 @@ float CombineCostComponents1A(int platforms, float v, float a, float b, float c,
 float CombineCostComponents1(int platforms, float v, float a, float b, float c, float d);
 float CombineCostComponents(int platforms, float a, float b, float c, float d);
 
+// The decode time models are fitted to four reference machines, and
+// |platforms| selects the ones to average with bits 1, 2, 4 and 8, or all four
+// without any. With kPlatformsProfile it instead holds the index of a cost
+// profile fitted to the host, from bit kPlatformsProfileShift, and the codec
+// compressing picks its slot in that profile at bit kPlatformsCodecShift, see
+// cost_profile.h.
+enum {
+  kPlatformsProfile = 0x10,
+  kPlatformsCodecShift = 5,
+  kPlatformsProfileShift = 7,
+};
+
 int Kraken_GetBlockSize(const uint8 *src, const uint8 *src_end, int *dest_size, int dest_capacity);
+int Kraken_DecodeBytes(byte **output, const byte *src, const byte *src_end, int *decoded_size, size_t output_size,
+                       bool force_memmove, uint8 *scratch, uint8 *scratch_end);
 bool IsProbablyText(const uint8 *p, size_t size);
 
 template<typename T, typename U> static inline T postadd(T &x, U v) { T t = x; x += v; return t; }
@@ -1,7 +1,16 @@
 #include "stdafx.h"
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include "ooz.h"
 #include "compress.h"
+#include "cost_profile.h"
+#include "cpu_dispatch.h"
+#include "preset_dict.h"
 #include "compr_util.h"
 #include "compr_entropy.h"
 #include "qsort.h"
@@ -17,20 +26,69 @@ int ilog2round(uint v) {
   return ((u + 0x257D86) >> 23) - 127;
 }
 
+// Asking for more than the block holds drops its contents.
 void *LzScratchBlock::Allocate(int wanted_size) {
-  if (!ptr) {
+  if (!ptr || wanted_size > size) {
+    delete[](uint8*)ptr;
     size = wanted_size;
     ptr = new uint8[wanted_size];
-  } else {
-    assert(wanted_size <= size);
   }
   return ptr;
 }
 
+void LzScratchBlock::Free() {
+  delete[](uint8*)ptr;
+  ptr = NULL;
+  size = 0;
+}
+
 LzScratchBlock::~LzScratchBlock() {
   delete[](uint8*)ptr;
 }
 
+void LzHasherSlot::Free() {
+  if (ptr)
+    destroy(ptr);
+  ptr = NULL;
+  destroy = NULL;
+  type = NULL;
+  bytes = 0;
+}
+
+LzEncoder::~LzEncoder() {
+  if (mls)
+    MatchLenStorage::Destroy(mls);
+}
+
+static LzScratchBlock LzTemp::*const kLzTempBlocks[] = {
+  &LzTemp::scratch0, &LzTemp::scratch1, &LzTemp::scratch2, &LzTemp::lztoken_scratch, &LzTemp::lztoken2_scratch,
+  &LzTemp::allmatch_scratch, &LzTemp::kraken_states, &LzTemp::states, &LzTemp::scratch8,
+};
+
+size_t LzEncoder::MemoryUsage() const {
+  size_t total = match_finder_hasher.bytes;
+  for (const LzHasherSlot &slot : hashers)
+    total += slot.bytes;
+  for (LzScratchBlock LzTemp::*block : kLzTempBlocks)
+    total += (lztemp.*block).size;
+  if (mls)
+    total += mls->byte_buffer.capacity() + mls->offset2pos.capacity() * sizeof(int);
+  return total;
+}
+
+void LzEncoder::Trim() {
+  if (MemoryUsage() <= memory_limit)
+    return;
+  for (LzHasherSlot &slot : hashers)
+    slot.Free();
+  match_finder_hasher.Free();
+  for (LzScratchBlock LzTemp::*block : kLzTempBlocks)
+    (lztemp.*block).Free();
+  if (mls)
+    MatchLenStorage::Destroy(mls);
+  mls = NULL;
+}
+
 void SetupCompressionOptions(CompressOptions *copts) {
   memset(copts, 0, sizeof(CompressOptions));
   copts->maxLocalDictionarySize = 0x400000;
@@ -60,6 +118,10 @@ int GetCompressedBufferSizeNeeded(int size) {
   return size + 274 * ((size + 0x3FFFF) / 0x40000);
 }
 
+int64 CompressBound(int64 src_size) {
+  return src_size + 274 * (src_size / 0x40000 + 1) + 65536;
+}
+
 #define IS_BYTE_INSIDE(a, b, c) ((uint8)((a) - (b)) <= ((c) - (b)))
 
 bool IsBlockProbablyText(const uint8 *p, const uint8 *p_end) {
@@ -145,7 +207,8 @@ uint8 *WriteBE24(uint8 *dst, uint32 v) {
   return dst;
 }
 
-void SubtractBytesUnsafe(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs) {
+// Writes in 16 and 8 byte steps, up to 15 bytes past |len|.
+static OOZ_ALWAYS_INLINE void SubtractBytesUnsafe_Impl(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs) {
   if (len > 8) {
     size_t loops = (len + 7) / 16;
     do {
@@ -160,7 +223,19 @@ void SubtractBytesUnsafe(uint8 *dst, const uint8 *src, size_t len, size_t neg_of
                                      simde_mm_loadl_epi64((const simde__m128i *)&src[neg_offs])));
 }
 
-void SubtractBytes(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs) {
+OOZ_MULTIVERSION(void, SubtractBytesUnsafe,
+                 (uint8 *dst, const uint8 *src, size_t len, size_t neg_offs),
+                 (dst, src, len, neg_offs))
+
+void SubtractBytesUnsafe(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs) {
+  SubtractBytesUnsafe_Current(dst, src, len, neg_offs);
+}
+
+static OOZ_ALWAYS_INLINE void SubtractBytes_Impl(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs) {
+#if OOZ_HAS_VEC32
+  for (; len >= 32; len -= 32, src += 32, dst += 32)
+    *(OozVec32 *)dst = *(const OozVec32 *)src - *(const OozVec32 *)&src[neg_offs];
+#endif
   for (; len >= 16; len -= 16, src += 16, dst += 16)
     simde_mm_storeu_si128((simde__m128i *)dst,
                      simde_mm_sub_epi8(simde_mm_loadu_si128((const simde__m128i *)src),
@@ -169,6 +244,14 @@ void SubtractBytes(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs) {
     dst[0] = src[0] - src[neg_offs];
 }
 
+OOZ_MULTIVERSION(void, SubtractBytes,
+                 (uint8 *dst, const uint8 *src, size_t len, size_t neg_offs),
+                 (dst, src, len, neg_offs))
+
+void SubtractBytes(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs) {
+  SubtractBytes_Current(dst, src, len, neg_offs);
+}
+
 int CompressQuantum(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *mls,
                                    uint8 *src, int src_size,
                                    uint8 *dst, uint8 *dst_end, int offset, float *cost_ptr) {
@@ -185,7 +268,6 @@ int CompressQuantum(LzCoder *coder, LzTemp *lztemp, MatchLenStorage *mls,
       if (AreAllBytesEqual(src, round_bytes)) {
         float memset_cost = kInvalidCost;
         int n = EncodeArrayU8_Memset(dst, dst_end, src, round_bytes, coder->entropy_opts, coder->speed_tradeoff, coder->platforms, &memset_cost);
-        src += round_bytes;
         dst += n;
         total_cost += memset_cost;
       } else {
@@ -259,12 +341,16 @@ int CompressBlocks(LzCoder *coder, LzTemp *lzcomp,
 
     bool keyframe = (src == dict_base);
 
+    uint8 *dst_start = dst;
     uint8 *dst_blk = WriteBlockHdr(dst, coder->compressor_file_id, coder->opts->makeQHCrc, keyframe, false);
+    // Copying a block out costs about as much as filling it.
+    float time = GetTime_Memset(coder->platforms, round_bytes);
 
     if (AreAllBytesEqual(src, round_bytes)) {
       dst = WriteMemsetQuantumHeader(dst_blk, src[0]);
     } else {
-      uint8 *dst_qh = WriteBE24(dst_blk, round_bytes - 1);
+      // With checksums the quantum header is followed by the payload's CRC.
+      uint8 *dst_qh = dst_blk + (coder->opts->makeQHCrc ? 6 : 3);
       float cost = kInvalidCost;
       int qn = CompressQuantum(coder, lzcomp, mls, src, round_bytes, dst_qh, dst + bufsize_needed, src - window_base, &cost);
 
@@ -275,9 +361,18 @@ int CompressBlocks(LzCoder *coder, LzTemp *lzcomp,
         dst += round_bytes;
       } else {
         WriteBE24(dst_blk, qn - 1);
+        if (coder->opts->makeQHCrc)
+          WriteBE24(dst_blk + 3, Kraken_GetCrc(dst_qh, qn) & 0xFFFFFF);
         dst = dst_qh + qn;
+        // The cost is the size plus the decode time weighted by speed_tradeoff.
+        if (coder->speed_tradeoff > 0)
+          time = std::max(cost - qn, 0.0f) / coder->speed_tradeoff;
       }
     }
+    if (coder->block_stats) {
+      LzBlockStats bs = { (int)(dst - dst_start), time };
+      coder->block_stats->push_back(bs);
+    }
 
     src += round_bytes;
   }
@@ -291,7 +386,7 @@ static const int lrm_hash_lookup_bits_base = 10;
 int Compress(LzCoder *coder, uint8 *src_in, uint8 *dst, int src_size, uint8 *src_window_base, LRMCascade *lrm_org) {
   LRMCascade *lrm = lrm_org;
   uint8 *dst_org = dst;
-  LzTemp lztemp;
+  LzEncoder *enc = coder->encoder;
 
   if (!src_window_base || coder->opts->seekChunkReset)
     src_window_base = src_in;
@@ -337,18 +432,27 @@ int Compress(LzCoder *coder, uint8 *src_in, uint8 *dst, int src_size, uint8 *src
         lrm_table = &lrm_table_buf;
         LRM_GetRanges(lrm, &lrm_table_buf, dict_base, src_cur);
       }
-      MatchLenStorage *mls = MatchLenStorage::Create(round_bytes + 1, 8.0f);
+      if (!enc->mls)
+        enc->mls = MatchLenStorage::Create(round_bytes + 1, 8.0f);
+      else
+        enc->mls->Reset(round_bytes + 1, 8.0f);
+      MatchLenStorage *mls = enc->mls;
       mls->window_base = src_cur;
 
-      if (coder->compression_level >= 6) {
+      if (coder->opts->matchFinder == kMatchFinderSuffixArray) {
+        FindMatchesSuffixArray(dict_base, src_cur - dict_base + round_bytes, mls, 4, src_cur - dict_base, lrm_table);
+      } else if (coder->opts->matchFinder == kMatchFinderBinaryTree) {
+        FindMatchesBinaryTree(dict_base, src_cur - dict_base + round_bytes, mls, 4, src_cur - dict_base, lrm_table);
+      } else if (coder->compression_level >= 6) {
         FindMatchesSuffixTrie(dict_base, src_cur - dict_base + round_bytes, mls, 4, src_cur - dict_base, lrm_table);
       } else {
-        FindMatchesHashBased(dict_base, src_cur - dict_base + round_bytes, mls, 4, src_cur - dict_base, lrm_table);
+        MatchHasher<16, true> *mf_hasher = enc->match_finder_hasher.Get< MatchHasher<16, true> >();
+        FindMatchesHashBased(dict_base, src_cur - dict_base + round_bytes, mls, 4, src_cur - dict_base, lrm_table,
+                             std::max(coder->opts->matchFinderThreads, 1), mf_hasher);
+        enc->match_finder_hasher.bytes = mf_hasher->AllocatedBytes();
       }
 
-      int n = CompressBlocks(coder, &lztemp, src_cur, dst, round_bytes, dict_base, cur_window_base, lrm_table, mls);
-      if (mls)
-        MatchLenStorage::Destroy(mls);
+      int n = CompressBlocks(coder, &enc->lztemp, src_cur, dst, round_bytes, dict_base, cur_window_base, lrm_table, mls);
 
       dst += n;
       src_cur += round_bytes;
@@ -358,21 +462,31 @@ int Compress(LzCoder *coder, uint8 *src_in, uint8 *dst, int src_size, uint8 *src
     if (lrm != lrm_org)
       LRM_FreeCascade(lrm);
   } else {
-    int n = CompressBlocks(coder, &lztemp, src_in, dst, src_size, src_window_base, src_window_base, NULL, NULL);
+    int n = CompressBlocks(coder, &enc->lztemp, src_in, dst, src_size, src_window_base, src_window_base, NULL, NULL);
     dst += n;
   }
   return dst - dst_org;
 }
 
 const CompressOptions *GetDefaultCompressOpts(int level) {
-  static const CompressOptions compress_options_level5 = { 0, 0, 0, 0x40000, 0, 0, 0x100, 4, 0, 0x400000, 1, 0 };
-  static const CompressOptions compress_options_level4 = { 0, 0, 0, 0x40000, 0, 0, 0x100, 2, 0, 0x400000, 1, 0 };
-  static const CompressOptions compress_options_level0 = { 0, 0, 0, 0x40000, 0, 0, 0x100, 1, 0, 0x400000, 0, 0 };
+  static const CompressOptions compress_options_level5 = { 0, 0, 0, 0x40000, 0, 0, 0x100, 4, 0, 0x400000, 1, 0, 0, 0, kMatchFinderDefault };
+  static const CompressOptions compress_options_level4 = { 0, 0, 0, 0x40000, 0, 0, 0x100, 2, 0, 0x400000, 1, 0, 0, 0, kMatchFinderDefault };
+  static const CompressOptions compress_options_level0 = { 0, 0, 0, 0x40000, 0, 0, 0x100, 1, 0, 0x400000, 0, 0, 0, 0, kMatchFinderDefault };
   return (level >= 5) ? &compress_options_level5 : (level >= 4) ? &compress_options_level4 : &compress_options_level0;
 }
 
-int CompressBlock_Leviathan(uint8 *src_in, uint8 *dst_in, int src_size, int level,
-                            const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
+const CompressOptions *GetCompressOpts(int level, bool make_qh_crc, int match_finder, int platforms) {
+  thread_local CompressOptions copts;
+  copts = *GetDefaultCompressOpts(level);
+  copts.makeQHCrc = make_qh_crc;
+  copts.matchFinder = match_finder;
+  copts.platforms = platforms;
+  return &copts;
+}
+
+int CompressBlock_Leviathan(LzEncoder *enc, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                            const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm,
+                            std::vector<LzBlockStats> *block_stats) {
   LzCoder coder = { 0 };
   if (!compressopts)
     compressopts = GetDefaultCompressOpts(level);
@@ -381,13 +495,16 @@ int CompressBlock_Leviathan(uint8 *src_in, uint8 *dst_in, int src_size, int leve
     src_window_base = src_in;
   
   coder.last_chunk_type = -1;
+  coder.encoder = enc;
+  coder.block_stats = block_stats;
   SetupEncoder_Leviathan(&coder, src_size, level, compressopts, src_window_base, src_in);
   int n = Compress(&coder, src_in, dst_in, src_size, src_window_base, lrm);
   return n;
 }
 
-int CompressBlock_Kraken(uint8 *src_in, uint8 *dst_in, int src_size, int level,
-                         const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
+int CompressBlock_Kraken(LzEncoder *enc, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                         const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm,
+                         std::vector<LzBlockStats> *block_stats) {
   LzCoder coder = { 0 };
   if (!compressopts)
     compressopts = GetDefaultCompressOpts(level);
@@ -396,13 +513,16 @@ int CompressBlock_Kraken(uint8 *src_in, uint8 *dst_in, int src_size, int level,
     src_window_base = src_in;
 
   coder.last_chunk_type = -1;
+  coder.encoder = enc;
+  coder.block_stats = block_stats;
   SetupEncoder_Kraken(&coder, src_size, level, compressopts, src_window_base, src_in);
   int n = Compress(&coder, src_in, dst_in, src_size, src_window_base, lrm);
   return n;
 }
 
-int CompressBlock_Mermaid(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
-                          const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
+int CompressBlock_Mermaid(LzEncoder *enc, int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                          const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm,
+                          std::vector<LzBlockStats> *block_stats) {
   LzCoder coder = { 0 };
   if (!compressopts)
     compressopts = GetDefaultCompressOpts(level);
@@ -411,22 +531,287 @@ int CompressBlock_Mermaid(int codec_id, uint8 *src_in, uint8 *dst_in, int src_si
     src_window_base = src_in;
 
   coder.last_chunk_type = -1;
+  coder.encoder = enc;
+  coder.block_stats = block_stats;
   SetupEncoder_Mermaid(&coder, codec_id, src_size, level, compressopts, src_window_base, src_in);
   int n = Compress(&coder, src_in, dst_in, src_size, src_window_base, lrm);
   return n;
 }
 
 
-int CompressBlock(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
-                  const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
+bool CompressLevelSupported(int codec_id, int level) {
+  if (level < -4 || level > 10)
+    return false;
+  switch (codec_id) {
+  case kCompressorKraken: return level != 0 && level != -4;
+  case kCompressorLeviathan: return level >= 1;
+  case kCompressorMermaid:
+  case kCompressorSelkie:
+  case kCompressorHydra: return true;
+  }
+  return false;
+}
+
+// Bytes a unit of decode time is worth when Hydra picks between codecs, per
+// spaceSpeedTradeoffBytes. Leviathan's weight, so Hydra's pick never costs
+// more than Leviathan alone by Leviathan's own measure.
+static const float kHydraSpeedTradeoff = 0.0025f;
+
+// Hydra compresses the input with each codec and keeps the cheapest encoding
+// of every 256k block. A block only depends on the bytes before it, not on how
+// they were coded, so the pieces can be mixed. Each codec splits the input into
+// the same blocks since they share the level and options.
+static int CompressBlock_Hydra(LzEncoder *enc, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                               const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
+  static const int kCodecs[] = { kCompressorKraken, kCompressorMermaid, kCompressorLeviathan };
+  const int kNumCodecs = sizeof(kCodecs) / sizeof(kCodecs[0]);
+  // Only Mermaid has an encoder at every level.
+  int codecs[kNumCodecs], num_codecs = 0;
+  for (int codec : kCodecs)
+    if (CompressLevelSupported(codec, level))
+      codecs[num_codecs++] = codec;
+  if (!compressopts)
+    compressopts = GetDefaultCompressOpts(level);
+  int bound = (int)CompressBound(src_size);
+  std::unique_ptr<uint8[]> out[kNumCodecs];
+  std::vector<LzBlockStats> stats[kNumCodecs];
+  for (int c = 0; c < num_codecs; c++) {
+    out[c].reset(new uint8[bound]);
+    int n = (codecs[c] == kCompressorKraken) ?
+        CompressBlock_Kraken(enc, src_in, out[c].get(), src_size, level, compressopts, src_window_base, lrm, &stats[c]) :
+      (codecs[c] == kCompressorLeviathan) ?
+        CompressBlock_Leviathan(enc, src_in, out[c].get(), src_size, level, compressopts, src_window_base, lrm, &stats[c]) :
+        CompressBlock_Mermaid(enc, codecs[c], src_in, out[c].get(), src_size, level, compressopts, src_window_base, lrm, &stats[c]);
+    if (n < 0 || stats[c].size() != stats[0].size())
+      return -1;
+  }
+
+  float speed_tradeoff = compressopts->spaceSpeedTradeoffBytes * 0.00390625f * kHydraSpeedTradeoff;
+  uint8 *dst = dst_in;
+  int pos[kNumCodecs] = {};
+  for (size_t i = 0; i < stats[0].size(); i++) {
+    int best = 0;
+    float best_cost = kInvalidCost;
+    for (int c = 0; c < num_codecs; c++) {
+      float cost = stats[c][i].size + stats[c][i].time * speed_tradeoff;
+      if (cost < best_cost) {
+        best_cost = cost;
+        best = c;
+      }
+    }
+    memcpy(dst, out[best].get() + pos[best], stats[best][i].size);
+    dst += stats[best][i].size;
+    for (int c = 0; c < num_codecs; c++)
+      pos[c] += stats[c][i].size;
+  }
+  return dst - dst_in;
+}
+
+LzEncoder *LzEncoder_Create(size_t memory_limit) {
+  return new LzEncoder(memory_limit);
+}
+
+void LzEncoder_Destroy(LzEncoder *enc) {
+  delete enc;
+}
+
+int LzEncoder_Compress(LzEncoder *enc, int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                       const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm,
+                       std::vector<LzBlockStats> *block_stats) {
+  if (!CompressLevelSupported(codec_id, level))
+    return -1;
+  int n;
   switch (codec_id) {
-  case kCompressorKraken: return CompressBlock_Kraken(src_in, dst_in, src_size, level, compressopts, src_window_base, lrm);
-  case kCompressorLeviathan: return CompressBlock_Leviathan(src_in, dst_in, src_size, level, compressopts, src_window_base, lrm);
+  case kCompressorKraken: n = CompressBlock_Kraken(enc, src_in, dst_in, src_size, level, compressopts, src_window_base, lrm, block_stats); break;
+  case kCompressorLeviathan: n = CompressBlock_Leviathan(enc, src_in, dst_in, src_size, level, compressopts, src_window_base, lrm, block_stats); break;
   case kCompressorMermaid:
-  case kCompressorSelkie: return CompressBlock_Mermaid(codec_id, src_in, dst_in, src_size, level, compressopts, src_window_base, lrm);
+  case kCompressorSelkie: n = CompressBlock_Mermaid(enc, codec_id, src_in, dst_in, src_size, level, compressopts, src_window_base, lrm, block_stats); break;
+  case kCompressorHydra: n = CompressBlock_Hydra(enc, src_in, dst_in, src_size, level, compressopts, src_window_base, lrm); break;
   default:
     return -1;
   }
+  enc->Trim();
+  return n;
+}
+
+int LzEncoder_Compress(LzEncoder *enc, int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                       const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
+  return LzEncoder_Compress(enc, codec_id, src_in, dst_in, src_size, level, compressopts, src_window_base, lrm, NULL);
+}
+
+int CompressBlock(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                  const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm) {
+  LzEncoder enc(0);
+  return LzEncoder_Compress(&enc, codec_id, src_in, dst_in, src_size, level, compressopts, src_window_base, lrm);
+}
+
+// The units share nothing but the read only input, so they can be compressed in
+// any order. Each thread keeps one unit's output until it is that unit's turn to
+// be written, which bounds memory to a unit per thread.
+bool CompressUnits(int codec_id, uint8 *src, int64 src_size, int level, const CompressOptions *compressopts,
+                   int unit_size, int history, int num_threads, CompressUnitsWriteFunc *write, void *ctx,
+                   LzEncoder *enc) {
+  int64 num_units = (src_size + unit_size - 1) / unit_size;
+  if (num_threads <= 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  // Threads left over when there are fewer units go to the match finder.
+  CompressOptions copts = *compressopts;
+  int unit_threads = (int)std::min<int64>(num_threads, std::max<int64>(num_units, 1));
+  copts.matchFinderThreads = num_threads / unit_threads;
+  num_threads = unit_threads;
+  int dst_size = (int)CompressBound(unit_size);
+
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::atomic<int64> next_unit(0);
+  int64 next_write = 0;
+  std::atomic<bool> failed(false);
+
+  // Threads without an encoder of their own keep one for the length of the call.
+  auto worker = [&](LzEncoder *enc) {
+    std::unique_ptr<LzEncoder> local;
+    if (!enc) {
+      local.reset(new LzEncoder(SIZE_MAX));
+      enc = local.get();
+    }
+    std::unique_ptr<uint8[]> dst(new uint8[dst_size]);
+    for (int64 i; (i = next_unit++) < num_units; ) {
+      int64 pos = i * unit_size;
+      int n = (int)std::min<int64>(src_size - pos, unit_size);
+      uint8 *window_base = src + pos - std::min<int64>(pos, history);
+      int outbytes = -1;
+      if (!failed)
+        outbytes = LzEncoder_Compress(enc, codec_id, src + pos, dst.get(), n, level, &copts, window_base, NULL);
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [&] { return next_write == i; });
+      if (!failed && (outbytes < 0 || !write(ctx, dst.get(), outbytes)))
+        failed = true;
+      next_write++;
+      cond.notify_all();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++)
+    threads.emplace_back(worker, (LzEncoder*)NULL);
+  worker(enc);
+  for (std::thread &t : threads)
+    t.join();
+  return !failed;
+}
+
+struct OozEncoder {
+  LzEncoder enc;
+  // Dictionary and input for Ooz_EncoderCompressDict, see preset_dict.h.
+  PresetDictWindow dict_window;
+  explicit OozEncoder(size_t memory_limit) : enc(memory_limit), dict_window() {}
+  ~OozEncoder() { PresetDict_FreeWindow(&dict_window); }
+};
+
+static void ToCompressOptions(CompressOptions *copts, const OozCompressOptions *opts) {
+  memset(copts, 0, sizeof(CompressOptions));
+  copts->min_match_length = opts->min_match_length;
+  copts->seekChunkReset = opts->seek_chunk_reset;
+  copts->seekChunkLen = opts->seek_chunk_len;
+  copts->dictionarySize = opts->dictionary_size;
+  copts->spaceSpeedTradeoffBytes = opts->space_speed_tradeoff_bytes;
+  copts->makeQHCrc = opts->make_qh_crc;
+  copts->maxLocalDictionarySize = opts->max_local_dictionary_size;
+  copts->makeLongRangeMatcher = opts->make_long_range_matcher;
+  copts->hashBits = opts->hash_bits;
+  copts->matchFinderThreads = opts->match_finder_threads;
+  copts->platforms = opts->cost_profile;
+  copts->matchFinder = opts->match_finder;
+}
 
+// With |dict| the input is copied after it in |dict_window| and compressed
+// there.
+static int Ooz_CompressWith(LzEncoder *enc, int codec, int level, const OozCompressOptions *opts,
+                            const uint8 *src, size_t src_len, uint8 *dst, size_t dst_size,
+                            const OozDictionary *dict = NULL, PresetDictWindow *dict_window = NULL) {
+  if (src_len == 0)
+    return 0;
+  if (!src || !dst || src_len > INT_MAX || (uint64)CompressBound(src_len) > INT_MAX ||
+      dst_size < (uint64)CompressBound(src_len) || !CompressLevelSupported(codec, level))
+    return -1;
+  CompressOptions copts = *GetDefaultCompressOpts(level);
+  if (opts) {
+    int chunk = opts->seek_chunk_len;
+    if ((opts->seek_chunk_reset && (chunk <= 0 || (chunk & (chunk - 1)))) || !CostProfile_IsValid(opts->cost_profile) ||
+        (opts->match_finder != OOZ_MATCH_FINDER_DEFAULT && opts->match_finder != OOZ_MATCH_FINDER_SUFFIX_ARRAY &&
+         opts->match_finder != OOZ_MATCH_FINDER_BINARY_TREE))
+      return -1;
+    ToCompressOptions(&copts, opts);
+  }
+  if (dict) {
+    uint8 *window = copts.seekChunkReset ? NULL : PresetDict_Window(dict_window, dict, src_len);
+    if (!window)
+      return -1;
+    uint8 *src_in = window + PresetDict_DataOffset(dict);
+    memcpy(src_in, src, src_len);
+    int n = LzEncoder_Compress(enc, codec, src_in, dst, (int)src_len, level, &copts,
+                               window + PresetDict_HistoryOffset(dict), NULL);
+    if (dict_window->mem_size > enc->memory_limit)
+      PresetDict_FreeWindow(dict_window);
+    return n;
+  }
+  // The compressors take non-const input but only read it.
+  return LzEncoder_Compress(enc, codec, (uint8*)src, dst, (int)src_len, level, &copts, NULL, NULL);
 }
 
+extern "C" {
+  OOZ_DLL_PUBLIC void Ooz_CompressOptionsDefault(OozCompressOptions *opts, int level) {
+    const CompressOptions *copts = GetDefaultCompressOpts(level);
+    memset(opts, 0, sizeof(OozCompressOptions));
+    opts->min_match_length = copts->min_match_length;
+    opts->seek_chunk_reset = copts->seekChunkReset;
+    opts->seek_chunk_len = copts->seekChunkLen;
+    opts->dictionary_size = copts->dictionarySize;
+    opts->space_speed_tradeoff_bytes = copts->spaceSpeedTradeoffBytes;
+    opts->make_qh_crc = copts->makeQHCrc;
+    opts->max_local_dictionary_size = copts->maxLocalDictionarySize;
+    opts->make_long_range_matcher = copts->makeLongRangeMatcher;
+    opts->hash_bits = copts->hashBits;
+    opts->match_finder_threads = copts->matchFinderThreads;
+    opts->cost_profile = copts->platforms;
+    opts->match_finder = copts->matchFinder;
+  }
+
+  OOZ_DLL_PUBLIC int Ooz_CostProfileLoad(const char *path) {
+    if (path == NULL)
+      return -1;
+    return CostProfile_Read(path);
+  }
+
+  OOZ_DLL_PUBLIC size_t Ooz_CompressBound(size_t src_len) {
+    return (size_t)CompressBound(src_len);
+  }
+
+  OOZ_DLL_PUBLIC int Ooz_Compress(int codec, int level, const OozCompressOptions *opts,
+                                  uint8_t const *src, size_t src_len, uint8_t *dst, size_t dst_size) {
+    LzEncoder enc(0);
+    return Ooz_CompressWith(&enc, codec, level, opts, src, src_len, dst, dst_size);
+  }
+
+  OOZ_DLL_PUBLIC OozEncoder *Ooz_EncoderCreate(size_t memory_limit) {
+    return new OozEncoder(memory_limit);
+  }
+
+  OOZ_DLL_PUBLIC void Ooz_EncoderDestroy(OozEncoder *enc) {
+    delete enc;
+  }
+
+  OOZ_DLL_PUBLIC int Ooz_EncoderCompress(OozEncoder *enc, int codec, int level, const OozCompressOptions *opts,
+                                         uint8_t const *src, size_t src_len, uint8_t *dst, size_t dst_size) {
+    if (enc == NULL)
+      return -1;
+    return Ooz_CompressWith(&enc->enc, codec, level, opts, src, src_len, dst, dst_size);
+  }
+
+  OOZ_DLL_PUBLIC int Ooz_EncoderCompressDict(OozEncoder *enc, const OozDictionary *dict, int codec, int level,
+                                             const OozCompressOptions *opts, uint8_t const *src, size_t src_len,
+                                             uint8_t *dst, size_t dst_size) {
+    if (enc == NULL || dict == NULL)
+      return -1;
+    return Ooz_CompressWith(&enc->enc, codec, level, opts, src, src_len, dst, dst_size, dict, &enc->dict_window);
+  }
+}
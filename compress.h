@@ -31,9 +31,18 @@ enum {
   kCompressorKraken = 8,
   kCompressorMermaid = 9,
   kCompressorSelkie = 11,
+  kCompressorHydra = 12,
   kCompressorLeviathan = 13,
 };
 
+// Match finders for levels 5 and up. The default hashes at level 5 and builds a
+// suffix trie above it.
+enum {
+  kMatchFinderDefault = 0,
+  kMatchFinderSuffixArray = 1,
+  kMatchFinderBinaryTree = 2,
+};
+
 struct CompressOptions {
   int unknown_0;
   int min_match_length;
@@ -47,6 +56,13 @@ struct CompressOptions {
   int maxLocalDictionarySize;
   int makeLongRangeMatcher;
   int hashBits;
+  // Threads searching for matches at levels 5 and up, 0 for one.
+  int matchFinderThreads;
+  // Decode time model for the cost functions, see CombineCostComponents. 0
+  // averages the reference machines, see cost_profile.h for the others.
+  int platforms;
+  // One of the kMatchFinder values, used at levels 5 and up.
+  int matchFinder;
 };
 
 struct LzScratchBlock {
@@ -55,6 +71,7 @@ struct LzScratchBlock {
 
   LzScratchBlock() : ptr(0), size(0) {}
   void *Allocate(int wanted_size);
+  void Free();
   ~LzScratchBlock();
 };
 
@@ -70,6 +87,70 @@ struct LzTemp {
   LzScratchBlock scratch8;
 };
 
+// Owns one hasher at a time and hands it out again while the same type is
+// asked for, so its table can be reused instead of allocated.
+struct LzHasherSlot {
+  void *ptr;
+  void (*destroy)(void *ptr);
+  const void *type;
+  size_t bytes;
+
+  LzHasherSlot() : ptr(0), destroy(0), type(0), bytes(0) {}
+  ~LzHasherSlot() { Free(); }
+  void Free();
+
+  template<typename T> T *Get() {
+    if (type != TypeTag<T>()) {
+      Free();
+      ptr = new T;
+      destroy = &Delete<T>;
+      type = TypeTag<T>();
+    }
+    return (T*)ptr;
+  }
+  // Identical code may be folded by the linker, so the type is told apart by
+  // the address of a writable variable rather than by |destroy|.
+  template<typename T> static const void *TypeTag() { static char tag; return &tag; }
+  template<typename T> static void Delete(void *p) { delete (T*)p; }
+};
+
+// Memory kept from one block compression to the next. Compressing many blocks
+// with the same encoder reuses the hasher table, the LzTemp scratch and the
+// match storage of levels 5 and up instead of allocating them per call. After
+// each call everything is freed if it adds up to more than |memory_limit|.
+// One encoder must not be used by two threads at once.
+struct LzEncoder {
+  LzTemp lztemp;
+  // Codecs use different hasher types, a few are kept so Hydra can go from one
+  // codec to the next without reallocating. The oldest one is replaced first.
+  LzHasherSlot hashers[3];
+  int next_hasher;
+  LzHasherSlot match_finder_hasher;
+  MatchLenStorage *mls;
+  size_t memory_limit;
+
+  explicit LzEncoder(size_t memory_limit) : next_hasher(0), mls(0), memory_limit(memory_limit) {}
+  ~LzEncoder();
+  size_t MemoryUsage() const;
+  void Trim();
+
+  template<typename T> LzHasherSlot *HasherSlot() {
+    for (LzHasherSlot &slot : hashers)
+      if (slot.type == LzHasherSlot::TypeTag<T>())
+        return &slot;
+    LzHasherSlot *slot = &hashers[next_hasher];
+    next_hasher = (next_hasher + 1) % 3;
+    return slot;
+  }
+};
+
+// Output size and estimated decode time of one 256k block, which Hydra uses to
+// pick a codec per block.
+struct LzBlockStats {
+  int size;
+  float time;
+};
+
 struct LzCoder {
   int codec_id;
   int compression_level;
@@ -86,6 +167,9 @@ struct LzCoder {
   int compressor_file_id;
   LzScratchBlock lvsymstats_scratch;
   int last_chunk_type;
+  LzEncoder *encoder;
+  // Gets an entry per block written, if not NULL.
+  std::vector<LzBlockStats> *block_stats;
 };
 
 int EncodeLzOffsets(uint8 *dst, uint8 *dst_end, uint8 *u8_offs, uint32 *u32_offs, int offs_count,
@@ -101,18 +185,56 @@ int WriteLzOffsetBits(uint8 *dst, uint8 *dst_end, uint8 *u8_offs, uint32 *u32_of
 
 int CompressBlock(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
                   const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm);
+// Whether |codec_id| can compress at |level|. Kraken has no encoder at 0 and
+// -4 and Leviathan none below 1. Mermaid and Selkie store the data at 0 and -4.
+bool CompressLevelSupported(int codec_id, int level);
+// The settings for |level|. Copy them to change any.
+const CompressOptions *GetDefaultCompressOpts(int level);
+// The settings for |level| with a checksum, match finder and cost profile, in a
+// copy owned by the thread that stays valid until its next call.
+const CompressOptions *GetCompressOpts(int level, bool make_qh_crc, int match_finder, int platforms);
+
+LzEncoder *LzEncoder_Create(size_t memory_limit);
+void LzEncoder_Destroy(LzEncoder *enc);
+// Same as CompressBlock but keeps its memory in |enc| for the next call.
+int LzEncoder_Compress(LzEncoder *enc, int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                       const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm);
+// Same again, adding an entry per 256k block to |block_stats|. Hydra adds none.
+int LzEncoder_Compress(LzEncoder *enc, int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                       const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm,
+                       std::vector<LzBlockStats> *block_stats);
+
+// Receives the compressed units of CompressUnits in order. Returns false to stop.
+typedef bool CompressUnitsWriteFunc(void *ctx, const uint8 *data, int size);
+
+// Compresses |src| as units of |unit_size| bytes, each its own CompressBlock call
+// with up to |history| bytes before the unit as its dictionary, on |num_threads|
+// threads or one per core if it's 0 or less. The output doesn't depend on the
+// number of threads. The calling thread compresses with |enc| if it's not NULL.
+// Returns false if a unit fails to compress or |write| fails.
+bool CompressUnits(int codec_id, uint8 *src, int64 src_size, int level, const CompressOptions *compressopts,
+                   int unit_size, int history, int num_threads, CompressUnitsWriteFunc *write, void *ctx,
+                   LzEncoder *enc = NULL);
+
+// Output space a CompressBlock call on |src_size| bytes may use.
+int64 CompressBound(int64 src_size);
 
 int GetHashBits(int src_len, int level, const CompressOptions *copts, int A, int B, int C, int D);
 void ConvertHistoToCost(const HistoU8 &src, uint *dst, int extra, int q=255);
 
+// CRC-32C of a quantum's payload, shared with the decoder in kraken.cpp.
+uint32 Kraken_GetCrc(const uint8 *p, size_t p_size);
+
 void SubtractBytes(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs);
 void SubtractBytesUnsafe(uint8 *dst, const uint8 *src, size_t len, size_t neg_offs);
 
 template<typename T, int MaxPreload = 0x4000000>
 void CreateLzHasher(LzCoder *coder, const uint8 *src_base, const uint8 *src_start, int hash_bits, int min_match_len = 0) {
-  T *hasher = new T;
+  LzHasherSlot *slot = coder->encoder->HasherSlot<T>();
+  T *hasher = slot->Get<T>();
   coder->hasher = hasher;
   hasher->AllocateHash(hash_bits, min_match_len);
+  slot->bytes = hasher->AllocatedBytes();
   if (src_start == src_base) {
     hasher->SetBaseWithoutPreload(src_start);
   } else {
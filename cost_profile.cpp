@@ -0,0 +1,540 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "ooz.h"
+#include "compress.h"
+#include "compr_entropy.h"
+#include "compr_util.h"
+#include "cost_profile.h"
+
+// Codecs in the order of CostProfile::scale.
+static const int kProfileCodecs[4] = { kCompressorKraken, kCompressorMermaid, kCompressorSelkie, kCompressorLeviathan };
+
+// Registered profiles never change or go away, so encoders read them without
+// locking once the count they're published with covers them.
+static const int kMaxProfiles = 256;
+static const CostProfile *registered_profiles[kMaxProfiles];
+static std::atomic<int> num_registered_profiles;
+static std::mutex register_mutex;
+
+static bool CostProfile_Equal(const CostProfile &a, const CostProfile &b) {
+  return memcmp(a.weights, b.weights, sizeof(a.weights)) == 0 && memcmp(a.scale, b.scale, sizeof(a.scale)) == 0 &&
+         a.has_kernels == b.has_kernels && memcmp(a.kernels, b.kernels, sizeof(a.kernels)) == 0;
+}
+
+int CostProfile_Register(const CostProfile &profile) {
+  std::lock_guard<std::mutex> lock(register_mutex);
+  int n = num_registered_profiles.load(std::memory_order_relaxed);
+  for (int i = 0; i < n; i++)
+    if (CostProfile_Equal(*registered_profiles[i], profile))
+      return kPlatformsProfile | i << kPlatformsProfileShift;
+  if (n == kMaxProfiles)
+    return -1;
+  registered_profiles[n] = new CostProfile(profile);
+  num_registered_profiles.store(n + 1, std::memory_order_release);
+  return kPlatformsProfile | n << kPlatformsProfileShift;
+}
+
+const CostProfile *CostProfile_Get(int platforms) {
+  if (!(platforms & kPlatformsProfile))
+    return NULL;
+  uint index = (uint)platforms >> kPlatformsProfileShift;
+  return index < (uint)num_registered_profiles.load(std::memory_order_acquire) ? registered_profiles[index] : NULL;
+}
+
+const float *CostProfile_Kernel(int platforms, int kernel) {
+  if (!(platforms & kPlatformsProfile))
+    return NULL;
+  const CostProfile *p = CostProfile_Get(platforms);
+  return p && p->has_kernels ? p->kernels[kernel] : NULL;
+}
+
+bool CostProfile_IsValid(int platforms) {
+  if (!(platforms & kPlatformsProfile))
+    return (platforms & ~0xf) == 0;
+  return (platforms & 0xf) == 0 && ((platforms >> kPlatformsCodecShift) & 3) == 0 && CostProfile_Get(platforms);
+}
+
+int CostProfile_Platforms(const CompressOptions *copts, int codec_id) {
+  int platforms = copts->platforms;
+  if (platforms & kPlatformsProfile) {
+    int slot = (int)(std::find(kProfileCodecs, kProfileCodecs + 4, codec_id) - kProfileCodecs);
+    platforms |= (slot & 3) << kPlatformsCodecShift;
+  }
+  return platforms;
+}
+
+// Inputs each kernel's time model takes, after its constant.
+static const int kKernelInputs[kCostKernel_Count] = { 1, 2, 2, 3 };
+static const char *const kKernelNames[kCostKernel_Count] = { "memset", "huffman", "huffman2", "tans" };
+
+// Scales the weights to sum to 1. False if they don't make a blend.
+static bool NormalizeWeights(float weights[4]) {
+  float sum = 0;
+  for (int i = 0; i < 4; i++) {
+    if (!(weights[i] >= 0))
+      return false;
+    sum += weights[i];
+  }
+  if (!(sum > 0))
+    return false;
+  for (int i = 0; i < 4; i++)
+    weights[i] /= sum;
+  return true;
+}
+
+int CostProfile_Read(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  CostProfile p = {};
+  int version = 0;
+  bool ok = fscanf(f, " ooz-cost-profile %d", &version) == 1 && (version == 1 || version == 2) &&
+            fscanf(f, " weights %f %f %f %f", &p.weights[0], &p.weights[1], &p.weights[2], &p.weights[3]) == 4;
+  for (int i = 0; i < 4; i++)
+    p.scale[i] = 1;
+  if (ok && version >= 2) {
+    ok = fscanf(f, " scale %f %f %f %f", &p.scale[0], &p.scale[1], &p.scale[2], &p.scale[3]) == 4;
+    for (int k = 0; k < kCostKernel_Count && ok; k++) {
+      char name[16];
+      ok = fscanf(f, " %15s", name) == 1 && strcmp(name, kKernelNames[k]) == 0;
+      for (int i = 0; i <= kKernelInputs[k] && ok; i++)
+        ok = fscanf(f, " %f", &p.kernels[k][i]) == 1 && p.kernels[k][i] >= 0 && p.kernels[k][i] < 1e9f;
+    }
+    for (int i = 0; i < 4 && ok; i++)
+      ok = p.scale[i] > 0 && p.scale[i] < 1e3f;
+    p.has_kernels = true;
+  }
+  fclose(f);
+  return ok && NormalizeWeights(p.weights) ? CostProfile_Register(p) : -1;
+}
+
+bool CostProfile_Write(const char *path, int platforms) {
+  const CostProfile *p = CostProfile_Get(platforms);
+  if (!p || !p->has_kernels)
+    return false;
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return false;
+  fprintf(f, "ooz-cost-profile 2\nweights %.4f %.4f %.4f %.4f\nscale %.4f %.4f %.4f %.4f\n",
+          p->weights[0], p->weights[1], p->weights[2], p->weights[3], p->scale[0], p->scale[1], p->scale[2], p->scale[3]);
+  for (int k = 0; k < kCostKernel_Count; k++) {
+    fprintf(f, "%s", kKernelNames[k]);
+    for (int i = 0; i <= kKernelInputs[k]; i++)
+      fprintf(f, " %.6g", p->kernels[k][i]);
+    fprintf(f, "\n");
+  }
+  return fclose(f) == 0;
+}
+
+// Calibration compresses each slice with every codec at these levels, once
+// with each reference machine's model. The time estimate of a block comes out
+// of its cost, so the tradeoff is kept at its lowest where the models barely
+// sway the encoding and the four mostly agree on one stream to time.
+static const int kCalibrateSlice = 0x100000;
+static const int kCalibrateMaxSlices = 16;
+static const int kCalibrateTradeoffBytes = 1;
+static const int kCalibrateLevels[] = { 1, 4 };
+
+// Entropy decoders are timed alone on arrays of these sizes over these many
+// symbols, encoded under a profile that makes every other mode too slow to
+// pick.
+static const int kKernelSizes[] = { 256, 2048, 16384, 65536, 0x20000 };
+static const int kKernelAlphabets[] = { 4, 24, 96, 256 };
+static const float kKernelTooSlow = 1e12f;
+static const float kKernelTradeoff = 1e-4f;
+
+// Time of |kernel| under |platforms| for inputs |x|.
+static float KernelTime(int platforms, int kernel, const int x[3]) {
+  switch (kernel) {
+  case kCostKernel_Memset: return GetTime_Memset(platforms, x[0]);
+  case kCostKernel_SingleHuffman: return GetTime_SingleHuffman(platforms, x[0], x[1]);
+  case kCostKernel_DoubleHuffman: return GetTime_DoubleHuffman(platforms, x[0], x[1]);
+  default: return GetTime_tANS(platforms, x[0], x[1], x[2]);
+  }
+}
+
+// Coefficients of |kernel| in the reference machines' models blended by
+// |weights|, which is what a profile without kernels uses.
+static void BlendKernel(const float weights[4], int kernel, float coefs[4]) {
+  for (int i = 0; i <= kKernelInputs[kernel]; i++) {
+    double sum = 0;
+    for (int m = 0; m < 4; m++) {
+      int zero[3] = {}, unit[3] = {};
+      if (i > 0)
+        unit[i - 1] = 1000;
+      float t0 = KernelTime(1 << m, kernel, zero);
+      sum += weights[m] * (i ? (KernelTime(1 << m, kernel, unit) - t0) / 1000 : t0);
+    }
+    coefs[i] = (float)sum;
+  }
+}
+
+// A profile blending the reference machines by |weights| whose kernels are
+// all too slow to use, except for |fast| which takes no time.
+static CostProfile ProbeProfile(const float weights[4], int fast) {
+  CostProfile p = {};
+  memcpy(p.weights, weights, sizeof(p.weights));
+  for (int i = 0; i < 4; i++)
+    p.scale[i] = 1;
+  p.has_kernels = true;
+  for (int k = 0; k < kCostKernel_Count; k++)
+    p.kernels[k][0] = (k == fast) ? 0 : kKernelTooSlow;
+  return p;
+}
+
+// Fastest of enough decodes of |comp| to cover timer noise, in seconds, or a
+// negative value if it doesn't decode to |raw|.
+static double TimeDecode(OozDecoder *dec, const uint8 *comp, int comp_size, const uint8 *raw, int raw_size, uint8 *out) {
+  double best = 1e30, total = 0;
+  for (int i = 0; i < 5 || total < 0.02; i++) {
+    auto start = std::chrono::steady_clock::now();
+    int n = Ooz_DecoderDecompress(dec, comp, comp_size, out, raw_size);
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (n != raw_size || (i == 0 && memcmp(out, raw, raw_size) != 0))
+      return -1;
+    best = std::min(best, t);
+    total += t;
+  }
+  return best;
+}
+
+// Same for the entropy coded array |comp|, decoded alone. Short arrays are
+// decoded in runs long enough to time.
+static double TimeDecodeArray(const uint8 *comp, int comp_size, const uint8 *raw, int raw_size,
+                              uint8 *out, uint8 *scratch, uint8 *scratch_end) {
+  double best = 1e30, total = 0;
+  int runs = 1;
+  for (int i = 0; i < 6 || total < 0.005; i++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < runs; r++) {
+      uint8 *dst = out;
+      int n = 0;
+      if (Kraken_DecodeBytes(&dst, comp, comp + comp_size, &n, raw_size, false, scratch, scratch_end) != comp_size ||
+          n != raw_size || (i == 0 && memcmp(dst, raw, raw_size) != 0))
+        return -1;
+    }
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    // The first pass only warms up and sizes the runs.
+    if (i == 0) {
+      runs = (int)std::min(std::max(2e-5 / std::max(t, 1e-9), 1.0), 1e4);
+      continue;
+    }
+    best = std::min(best, t / runs);
+    total += t;
+  }
+  return best;
+}
+
+// RMS relative error of |pred| against |actual| once scaled to fit it best.
+static double ScaledError(const std::vector<double> &pred, const std::vector<double> &actual) {
+  double sum_r = 0, sum_rr = 0;
+  for (size_t i = 0; i < pred.size(); i++) {
+    double r = pred[i] / actual[i];
+    sum_r += r;
+    sum_rr += r * r;
+  }
+  double scale = sum_rr > 0 ? sum_r / sum_rr : 0, err = 0;
+  for (size_t i = 0; i < pred.size(); i++) {
+    double e = scale * pred[i] / actual[i] - 1;
+    err += e * e;
+  }
+  return sqrt(err / pred.size());
+}
+
+// Solves |a| x = |b| for x in |b|, with |a| n by n. False if |a| is singular.
+static bool SolveLinear(double a[4][4], double b[4], int n) {
+  for (int c = 0; c < n; c++) {
+    int p = c;
+    for (int r = c + 1; r < n; r++)
+      if (fabs(a[r][c]) > fabs(a[p][c]))
+        p = r;
+    if (fabs(a[p][c]) < 1e-12)
+      return false;
+    std::swap(a[p], a[c]);
+    std::swap(b[p], b[c]);
+    for (int r = 0; r < n; r++) {
+      if (r == c)
+        continue;
+      double f = a[r][c] / a[c][c];
+      for (int k = c; k < n; k++)
+        a[r][k] -= f * a[c][k];
+      b[r] -= f * b[c];
+    }
+  }
+  for (int c = 0; c < n; c++)
+    b[c] /= a[c][c];
+  return true;
+}
+
+// Nonnegative least squares fit of the first |n| columns of |rows| to 1, so
+// rows holding each term divided by a timing fit it by relative error. With
+// at most four unknowns it's cheapest to solve every subset of them and keep
+// the best all positive one.
+static bool FitNonNegative(const std::vector<std::array<double, 4>> &rows, int n, double x[4]) {
+  double best_err = 1e30;
+  for (int set = 1; set < (1 << n); set++) {
+    int idx[4], m = 0;
+    for (int i = 0; i < n; i++)
+      if (set >> i & 1)
+        idx[m++] = i;
+    double a[4][4] = {}, b[4] = {};
+    for (const auto &row : rows) {
+      for (int i = 0; i < m; i++) {
+        for (int j = 0; j < m; j++)
+          a[i][j] += row[idx[i]] * row[idx[j]];
+        b[i] += row[idx[i]];
+      }
+    }
+    if (!SolveLinear(a, b, m) || *std::min_element(b, b + m) <= 0)
+      continue;
+    double err = 0;
+    for (const auto &row : rows) {
+      double e = -1;
+      for (int i = 0; i < m; i++)
+        e += row[idx[i]] * b[i];
+      err += e * e;
+    }
+    if (err < best_err) {
+      best_err = err;
+      for (int i = 0; i < 4; i++)
+        x[i] = 0;
+      for (int i = 0; i < m; i++)
+        x[idx[i]] = b[i];
+    }
+  }
+  return best_err < 1e30;
+}
+
+static uint32 CalibrateRandom(uint64 *state) {
+  *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+  return (uint32)(*state >> 33);
+}
+
+// Times each entropy decoder on generated arrays and fits its model, in
+// seconds, into |kernels|, setting |fitted| for those that had enough arrays
+// encode to them. Returns the number of arrays timed.
+static int FitKernels(double kernels[kCostKernel_Count][4], bool fitted[kCostKernel_Count]) {
+  const int kBufSize = 0x20000;
+  std::unique_ptr<uint8[]> src(new uint8[kBufSize]), comp(new uint8[kBufSize + 0x1000]);
+  std::unique_ptr<uint8[]> out(new uint8[kBufSize + 64]), scratch(new uint8[0x6C000]);
+  static const float kEqualWeights[4] = { 0.25f, 0.25f, 0.25f, 0.25f };
+  static const int kChunkTypes[kCostKernel_Count] = { 3, 2, 4, 1 };
+  int samples = 0;
+  uint64 rng = 1;
+  for (int k = 0; k < kCostKernel_Count; k++) {
+    int platforms = CostProfile_Register(ProbeProfile(kEqualWeights, k));
+    if (platforms < 0)
+      continue;
+    int opts = kEntropyOpt_SupportsNewHuffman | kEntropyOpt_SupportsShortMemset |
+               (k == kCostKernel_DoubleHuffman ? kEntropyOpt_AllowDoubleHuffman : 0) |
+               (k == kCostKernel_Tans ? kEntropyOpt_tANS : 0);
+    std::vector<std::array<double, 4>> rows;
+    for (int size : kKernelSizes) {
+      for (int alphabet : kKernelAlphabets) {
+        if (k == kCostKernel_Memset && alphabet != kKernelAlphabets[0])
+          continue;
+        // Skewed towards the low symbols so that every mode gains on storing
+        // the bytes as they are.
+        HistoU8 histo = {};
+        for (int i = 0; i < size; i++) {
+          uint32 a = CalibrateRandom(&rng) % alphabet, b = CalibrateRandom(&rng) % alphabet;
+          src[i] = (k == kCostKernel_Memset) ? 0x55 : (uint8)std::min(a, b);
+          histo.count[src[i]]++;
+        }
+        int used = 0;
+        for (int i = 0; i < 256; i++)
+          used += histo.count[i] != 0;
+        float cost = kInvalidCost;
+        int n = EncodeArrayU8(comp.get(), comp.get() + kBufSize + 0x1000, src.get(), size, opts, kKernelTradeoff,
+                              platforms, &cost, 4, NULL);
+        if (n <= 0 || ((comp[0] >> 4) & 7) != kChunkTypes[k])
+          continue;
+        double t = TimeDecodeArray(comp.get(), n, src.get(), size, out.get(), scratch.get(), scratch.get() + 0x6C000);
+        if (t <= 0)
+          continue;
+        // The same inputs the encoder hands the model.
+        int x[3] = { size, used, 0 };
+        if (k == kCostKernel_Tans) {
+          x[0] = size - 5;
+          x[2] = 1 << std::max(std::min(ilog2round(size - 5) - 2, 11), 8);
+        }
+        std::array<double, 4> row = { 1 / t };
+        for (int i = 0; i < kKernelInputs[k]; i++)
+          row[i + 1] = x[i] / t;
+        rows.push_back(row);
+      }
+    }
+    fitted[k] = (int)rows.size() >= kKernelInputs[k] + 2 && FitNonNegative(rows, kKernelInputs[k] + 1, kernels[k]);
+    if (fitted[k])
+      samples += (int)rows.size();
+  }
+  return samples;
+}
+
+int CostProfile_Calibrate(const uint8 *const *srcs, const int64 *sizes, int count, CostProfileFit *fit) {
+  struct Slice { const uint8 *src; int size; };
+  std::vector<Slice> slices;
+  for (int i = 0; i < count; i++) {
+    for (int64 pos = 0; pos < sizes[i]; pos += kCalibrateSlice) {
+      Slice s = { srcs[i] + pos, (int)std::min<int64>(sizes[i] - pos, kCalibrateSlice) };
+      slices.push_back(s);
+    }
+  }
+  // Spread the slices used over all of the input.
+  if (slices.size() > kCalibrateMaxSlices) {
+    std::vector<Slice> picked;
+    for (int i = 0; i < kCalibrateMaxSlices; i++)
+      picked.push_back(slices[i * slices.size() / kCalibrateMaxSlices]);
+    slices.swap(picked);
+  }
+
+  // Each reference machine's model carries a factor of its own. The built in
+  // model averages them without it.
+  float factors[4];
+  for (int i = 0; i < 4; i++)
+    factors[i] = CombineCostComponents(1 << i, 1, 1, 1, 1);
+
+  LzEncoder enc(SIZE_MAX);
+  OozDecoder *dec = Ooz_DecoderCreate(NULL, 0);
+  int bound = (int)CompressBound(kCalibrateSlice);
+  std::unique_ptr<uint8[]> comp[4], out(new uint8[kCalibrateSlice]);
+  for (int i = 0; i < 4; i++)
+    comp[i].reset(new uint8[bound]);
+
+  // Compresses |s| under |platforms| into |dst| and times decoding it. Sets
+  // |pred| to the time the model predicted. Returns the size, or -1.
+  auto compress_and_time = [&](const Slice &s, int codec, int level, int platforms, uint8 *dst, double *pred, double *t) {
+    CompressOptions copts = *GetDefaultCompressOpts(level);
+    copts.spaceSpeedTradeoffBytes = kCalibrateTradeoffBytes;
+    copts.platforms = platforms;
+    std::vector<LzBlockStats> stats;
+    int n = LzEncoder_Compress(&enc, codec, (uint8*)s.src, dst, s.size, level, &copts, NULL, NULL, &stats);
+    *pred = 0;
+    for (const LzBlockStats &bs : stats)
+      *pred += bs.time;
+    if (n > 0 && t)
+      *t = TimeDecode(dec, dst, n, s.src, s.size, out.get());
+    return n > 0 && (!t || *t > 0) ? n : -1;
+  };
+
+  // First blend the reference machines, from the streams they agree on.
+  std::vector<std::array<double, 4>> rows;
+  double sum_default = 0, sum_actual = 0;
+  int skipped = 0;
+  bool ok = true;
+  for (const Slice &s : slices) {
+    for (int codec : kProfileCodecs) {
+      for (int level : kCalibrateLevels) {
+        double pred[4];
+        int n[4];
+        bool same = true;
+        for (int i = 0; i < 4 && ok; i++) {
+          n[i] = compress_and_time(s, codec, level, 1 << i, comp[i].get(), &pred[i], NULL);
+          ok = n[i] > 0;
+          if (i > 0 && ok)
+            same = same && n[i] == n[0] && memcmp(comp[i].get(), comp[0].get(), n[0]) == 0;
+        }
+        if (!ok)
+          break;
+        if (!same) {
+          skipped++;
+          continue;
+        }
+        double t = TimeDecode(dec, comp[0].get(), n[0], s.src, s.size, out.get());
+        if (t <= 0) {
+          ok = false;
+          break;
+        }
+        std::array<double, 4> row;
+        for (int i = 0; i < 4; i++) {
+          row[i] = pred[i] / t;
+          sum_default += pred[i] / factors[i] * 0.25;
+        }
+        rows.push_back(row);
+        sum_actual += t;
+      }
+    }
+  }
+
+  CostProfile profile = {};
+  double w[4];
+  if (!ok || rows.size() < 4 || !FitNonNegative(rows, 4, w)) {
+    Ooz_DecoderDestroy(dec);
+    return -1;
+  }
+  for (int i = 0; i < 4; i++)
+    profile.weights[i] = (float)w[i];
+  NormalizeWeights(profile.weights);
+  // Model time units per second here, so that the profile predicts about as
+  // much time in total as the built in model and a tradeoff keeps its weight.
+  double units = sum_default / sum_actual;
+
+  // Then the entropy decoders, alone. Any that couldn't be timed keep the
+  // blend.
+  double kernels[kCostKernel_Count][4];
+  bool fitted[kCostKernel_Count] = {};
+  int kernel_samples = FitKernels(kernels, fitted);
+  for (int k = 0; k < kCostKernel_Count; k++) {
+    BlendKernel(profile.weights, k, profile.kernels[k]);
+    for (int i = 0; i < 4 && fitted[k]; i++)
+      profile.kernels[k][i] = (float)(kernels[k][i] * units);
+  }
+  profile.has_kernels = true;
+
+  // And last the scale of the blend for the rest of each codec's models, on
+  // streams where entropy coding is too slow to use so that the blend is all
+  // there is to the predicted time.
+  CostProfile lz_probe = ProbeProfile(profile.weights, -1);
+  lz_probe.kernels[kCostKernel_Memset][0] = profile.kernels[kCostKernel_Memset][0];
+  lz_probe.kernels[kCostKernel_Memset][1] = profile.kernels[kCostKernel_Memset][1];
+  int lz_platforms = CostProfile_Register(lz_probe);
+  for (int c = 0; c < 4; c++) {
+    double sum_r = 0, sum_rr = 0;
+    for (const Slice &s : slices) {
+      for (int level : kCalibrateLevels) {
+        double pred, t;
+        if (lz_platforms < 0 || compress_and_time(s, kProfileCodecs[c], level, lz_platforms, comp[0].get(), &pred, &t) < 0)
+          continue;
+        double r = pred / (t * units);
+        sum_r += r;
+        sum_rr += r * r;
+      }
+    }
+    profile.scale[c] = sum_r > 0 ? (float)(sum_r / sum_rr) : 1.0f;
+  }
+
+  int platforms = CostProfile_Register(profile);
+  if (platforms >= 0 && fit) {
+    // Every stream the built in model and the profile each choose.
+    std::vector<double> default_pred, default_actual, fitted_pred, fitted_actual;
+    for (const Slice &s : slices) {
+      for (int codec : kProfileCodecs) {
+        for (int level : kCalibrateLevels) {
+          double pred, t;
+          if (compress_and_time(s, codec, level, 0, comp[0].get(), &pred, &t) > 0) {
+            default_pred.push_back(pred);
+            default_actual.push_back(t);
+          }
+          if (compress_and_time(s, codec, level, platforms, comp[0].get(), &pred, &t) > 0) {
+            fitted_pred.push_back(pred);
+            fitted_actual.push_back(t);
+          }
+        }
+      }
+    }
+    fit->samples = (int)rows.size();
+    fit->skipped = skipped;
+    fit->kernel_samples = kernel_samples;
+    fit->default_error = ScaledError(default_pred, default_actual);
+    fit->fitted_error = ScaledError(fitted_pred, fitted_actual);
+  }
+  Ooz_DecoderDestroy(dec);
+  return platforms;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+// Decode cost profiles. The compressor weighs output size against decode time
+// estimated by models timed on four reference machines, see
+// CombineCostComponents. A profile fits those models to decode timings taken
+// on the machine the output is meant for, and is kept in a text file:
+//
+//   ooz-cost-profile 2
+//   weights <w1> <w2> <w4> <w8>
+//   scale <kraken> <mermaid> <selkie> <leviathan>
+//   memset <c0> <c1>
+//   huffman <c0> <c1> <c2>
+//   huffman2 <c0> <c1> <c2>
+//   tans <c0> <c1> <c2> <c3>
+//
+// The weights blend the reference machines and the scale of each codec
+// multiplies that blend, for every model the profile has no terms of its own
+// for. Those are the entropy decoders below, which have the constant and the
+// per input coefficients of GetTime_Memset, GetTime_SingleHuffman,
+// GetTime_DoubleHuffman and GetTime_tANS. Version 1 files have only weights.
+//
+// In memory a profile is registered once and from then on is the |platforms|
+// value of CompressOptions, so encoders on any thread can use it without
+// locking.
+
+struct CompressOptions;
+
+enum {
+  kCostKernel_Memset,
+  kCostKernel_SingleHuffman,
+  kCostKernel_DoubleHuffman,
+  kCostKernel_Tans,
+  kCostKernel_Count,
+};
+
+struct CostProfile {
+  // Reference machines 1, 2, 4 and 8, summing to 1.
+  float weights[4];
+  // Kraken, Mermaid, Selkie and Leviathan.
+  float scale[4];
+  // False to blend the entropy models too, as version 1 profiles do.
+  bool has_kernels;
+  float kernels[kCostKernel_Count][4];
+};
+
+// Registers |profile| and returns the |platforms| value that selects it, or -1
+// if too many different ones were registered. Registering an equal profile
+// again returns the same value. Profiles are kept until the process exits.
+int CostProfile_Register(const CostProfile &profile);
+// The registered profile |platforms| selects, or NULL for a mask of reference
+// machines.
+const CostProfile *CostProfile_Get(int platforms);
+// Coefficients |platforms| has for a kCostKernel, or NULL to use the blend.
+const float *CostProfile_Kernel(int platforms, int kernel);
+// True for 0, a mask of reference machines or a registered profile.
+bool CostProfile_IsValid(int platforms);
+
+// Returns the registered profile in |path|, or -1 if it can't be read or
+// parsed.
+int CostProfile_Read(const char *path);
+bool CostProfile_Write(const char *path, int platforms);
+
+// The model |copts| asks for, with the slot of |codec_id| in it.
+int CostProfile_Platforms(const CompressOptions *copts, int codec_id);
+
+struct CostProfileFit {
+  // Streams timed, and those left out because the reference machines' models
+  // didn't agree on how to encode them.
+  int samples, skipped;
+  // Arrays timed to fit the entropy decoders.
+  int kernel_samples;
+  // RMS relative error of the decode time predicted by the built in model and
+  // by the fitted profile for streams each compressed with, each at its best
+  // overall scale.
+  double default_error, fitted_error;
+};
+
+// Fits a profile to this machine by compressing slices of the |count| buffers
+// in |srcs| with each codec and timing how long they take to decode, and by
+// timing the entropy decoders alone on generated arrays. Returns the
+// registered profile, or -1 if there was too little data to fit it.
+int CostProfile_Calibrate(const uint8 *const *srcs, const int64 *sizes, int count, CostProfileFit *fit);
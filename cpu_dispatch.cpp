@@ -0,0 +1,87 @@
+#include "stdafx.h"
+#include "cpu_dispatch.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+static const struct {
+  const char *name;
+  uint32 features;
+} kCpuLevels[] = {
+  { "sse2", 0 },
+  { "sse4.1", kCpu_SSE41 },
+  { "sse4.2", kCpu_SSE41 | kCpu_SSE42 },
+  { "avx2", kCpu_SSE41 | kCpu_SSE42 | kCpu_BMI2 | kCpu_AVX2 },
+  { "avx512", kCpu_SSE41 | kCpu_SSE42 | kCpu_BMI2 | kCpu_AVX2 | kCpu_AVX512BW },
+};
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+static void CpuId(int leaf, int subleaf, uint32 regs[4]) {
+  __cpuidex((int*)regs, leaf, subleaf);
+}
+static uint64 XGetBv() {
+  return _xgetbv(0);
+}
+#define OOZ_HAVE_CPUID 1
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+static void CpuId(int leaf, int subleaf, uint32 regs[4]) {
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+}
+static uint64 XGetBv() {
+  uint32 lo, hi;
+  __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return lo | (uint64)hi << 32;
+}
+#define OOZ_HAVE_CPUID 1
+#else
+#define OOZ_HAVE_CPUID 0
+#endif
+
+static uint32 CpuDetectFeatures() {
+  uint32 features = 0;
+#if OOZ_HAVE_CPUID
+  uint32 regs[4];
+  CpuId(0, 0, regs);
+  int max_leaf = regs[0];
+  if (max_leaf < 1)
+    return 0;
+  CpuId(1, 0, regs);
+  if (regs[2] & (1 << 19)) features |= kCpu_SSE41;
+  if (regs[2] & (1 << 20)) features |= kCpu_SSE42;
+  // AVX state has to be enabled by the OS as well.
+  bool os_avx = (regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && (XGetBv() & 6) == 6;
+  bool os_avx512 = os_avx && (XGetBv() & 0xE6) == 0xE6;
+  if (max_leaf >= 7) {
+    CpuId(7, 0, regs);
+    if (regs[1] & (1 << 8)) features |= kCpu_BMI2;
+    if (os_avx && (regs[1] & (1 << 5))) features |= kCpu_AVX2;
+    // Foundation and byte/word instructions.
+    if (os_avx512 && (regs[1] & (1 << 16)) && (regs[1] & (1 << 30))) features |= kCpu_AVX512BW;
+  }
+#endif
+  const char *isa = getenv("OOZ_ISA");
+  if (isa != NULL) {
+    for (size_t i = 0; i < sizeof(kCpuLevels) / sizeof(kCpuLevels[0]); i++) {
+      if (!strcmp(isa, kCpuLevels[i].name))
+        features &= kCpuLevels[i].features;
+    }
+  }
+  return features;
+}
+
+uint32 CpuFeatures() {
+  static const uint32 features = CpuDetectFeatures();
+  return features;
+}
+
+const char *CpuFeaturesName(uint32 features) {
+  const char *name = kCpuLevels[0].name;
+  for (size_t i = 0; i < sizeof(kCpuLevels) / sizeof(kCpuLevels[0]); i++) {
+    if ((features & kCpuLevels[i].features) == kCpuLevels[i].features)
+      name = kCpuLevels[i].name;
+  }
+  return name;
+}
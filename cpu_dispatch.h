@@ -0,0 +1,121 @@
+#pragma once
+
+// Runtime detection of instruction set extensions, used to pick between the
+// portable decoder kernels and the ones built for newer CPUs.
+
+enum {
+  kCpu_SSE41 = 1 << 0,
+  kCpu_SSE42 = 1 << 1,
+  kCpu_BMI2 = 1 << 2,
+  kCpu_AVX2 = 1 << 3,
+  kCpu_AVX512BW = 1 << 4,
+};
+
+// Attribute to compile a single function for an instruction set the rest of
+// the file isn't built for. MSVC emits any intrinsic without it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OOZ_TARGET(isa) __attribute__((target(isa)))
+#define OOZ_HAS_TARGET_ATTR 1
+#else
+#define OOZ_TARGET(isa)
+#define OOZ_HAS_TARGET_ATTR 0
+#endif
+
+#if defined(__GNUC__)
+#define OOZ_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define OOZ_ALWAYS_INLINE __forceinline
+#endif
+
+// Set when 64-bit kernels can be built for BMI2, either through the target
+// attribute or because the whole file is built for AVX2.
+#if (defined(__x86_64__) || defined(_M_X64)) && (OOZ_HAS_TARGET_ATTR || defined(__AVX2__))
+#define OOZ_HAS_BMI2_KERNELS 1
+#else
+#define OOZ_HAS_BMI2_KERNELS 0
+#endif
+
+// 32 byte vector for copies and byte arithmetic. The compiler lowers it to
+// whatever the target of the function it ends up in supports, two SSE2
+// registers or one AVX2 register, so the same source serves every variant
+// built by OOZ_MULTIVERSION.
+#if defined(__GNUC__)
+typedef uint8 OozVec32 __attribute__((vector_size(32), aligned(1), may_alias));
+#define OOZ_HAS_VEC32 1
+#else
+#define OOZ_HAS_VEC32 0
+#endif
+
+#define OOZ_AVX512_TARGET "avx512f,avx512bw,avx512vl,avx2,bmi2"
+
+// Features supported by the CPU and the OS, detected once. Setting the OOZ_ISA
+// environment variable to one of sse2, sse4.1, sse4.2, avx2 or avx512 limits
+// the result to that level, which is useful for testing and benchmarking the
+// fallback paths.
+uint32 CpuFeatures();
+
+// Name of the highest level in |features|, as accepted by OOZ_ISA.
+const char *CpuFeaturesName(uint32 features);
+
+// One implementation of a kernel and the features it needs. Tables of these are
+// listed from slowest to fastest.
+template<typename Func>
+struct CpuKernel {
+  const char *name;
+  Func *func;
+  uint32 cpu_features;
+};
+
+// Returns the fastest kernel in |kernels| that the CPU can run.
+template<typename Func, size_t N>
+Func *CpuPickKernel(const CpuKernel<Func> (&kernels)[N]) {
+  Func *func = kernels[0].func;
+  for (size_t i = 0; i < N; i++) {
+    if ((CpuFeatures() & kernels[i].cpu_features) == kernels[i].cpu_features)
+      func = kernels[i].func;
+  }
+  return func;
+}
+
+// Stores kernel |index| in |*current|, fails if there's no such kernel or the
+// CPU can't run it.
+template<typename Func, size_t N>
+bool CpuSelectKernel(const CpuKernel<Func> (&kernels)[N], int index, Func **current) {
+  if (index < 0 || index >= (int)N || (CpuFeatures() & kernels[index].cpu_features) != kernels[index].cpu_features)
+    return false;
+  *current = kernels[index].func;
+  return true;
+}
+
+template<typename Func, size_t N>
+const char *CpuKernelName(const CpuKernel<Func> (&kernels)[N], int index) {
+  return (index >= 0 && index < (int)N) ? kernels[index].name : NULL;
+}
+
+// Builds |name|_Impl, which must be OOZ_ALWAYS_INLINE along with everything it
+// calls, once per instruction set level. Defines the table |name|_Kernels and
+// |name|_Current, the one picked at load. Without the target attribute the one
+// variant gets whatever the build flags allow.
+#if OOZ_HAS_TARGET_ATTR
+#define OOZ_MULTIVERSION(ret, name, params, args)                                    \
+  typedef ret name##_Func params;                                                    \
+  ret name##_SSE2 params { return name##_Impl args; }                                \
+  OOZ_TARGET("sse4.1") ret name##_SSE41 params { return name##_Impl args; }          \
+  OOZ_TARGET("avx2,bmi2") ret name##_AVX2 params { return name##_Impl args; }        \
+  OOZ_TARGET(OOZ_AVX512_TARGET) ret name##_AVX512 params { return name##_Impl args; } \
+  static const CpuKernel<name##_Func> name##_Kernels[] = {                           \
+    { "sse2", name##_SSE2, 0 },                                                      \
+    { "sse4.1", name##_SSE41, kCpu_SSE41 },                                          \
+    { "avx2", name##_AVX2, kCpu_AVX2 | kCpu_BMI2 },                                  \
+    { "avx512", name##_AVX512, kCpu_AVX512BW | kCpu_AVX2 | kCpu_BMI2 },              \
+  };                                                                                 \
+  static name##_Func *name##_Current = CpuPickKernel(name##_Kernels);
+#else
+#define OOZ_MULTIVERSION(ret, name, params, args)                                    \
+  typedef ret name##_Func params;                                                    \
+  ret name##_Default params { return name##_Impl args; }                             \
+  static const CpuKernel<name##_Func> name##_Kernels[] = {                           \
+    { "default", name##_Default, 0 },                                                \
+  };                                                                                 \
+  static name##_Func *name##_Current = CpuPickKernel(name##_Kernels);
+#endif
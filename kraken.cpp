@@ -17,37 +17,31 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "stdafx.h"
-#include <sys/stat.h>
-
-#if defined _WIN32 || defined __CYGWIN__
-#ifdef OOZ_DYNAMIC
-#ifdef OOZ_BUILD_DLL
-#ifdef __GNUC__
-#define OOZ_DLL_PUBLIC __attribute__ ((dllexport))
-#else
-#define OOZ_DLL_PUBLIC __declspec(dllexport) // Note: actually gcc seems to also supports this syntax.
-#endif
-#else
-#ifdef __GNUC__
-#define OOZ_DLL_PUBLIC __attribute__ ((dllimport))
-#else
-#define OOZ_DLL_PUBLIC __declspec(dllimport) // Note: actually gcc seems to also supports this syntax.
-#endif
-#endif
-#define OOZ_DLL_LOCAL
-#else
-#define OOZ_DLL_PUBLIC
-#define OOZ_DLL_LOCAL
-#endif
-#else
-#if __GNUC__ >= 4
-#define OOZ_DLL_PUBLIC __attribute__ ((visibility ("default")))
-#define OOZ_DLL_LOCAL  __attribute__ ((visibility ("hidden")))
-#else
-#define OOZ_DLL_PUBLIC
-#define OOZ_DLL_LOCAL
+#include "ooz.h"
+#include "cpu_dispatch.h"
+#include "seekable.h"
+#include "cost_profile.h"
+#include "preset_dict.h"
+#if defined(__x86_64__) || defined(_M_X64)
+#include <nmmintrin.h>
 #endif
+#include <sys/stat.h>
+#if !defined(_MSC_VER)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
 
 // Header in front of each 256k block
 typedef struct KrakenHeader {
@@ -176,9 +170,62 @@ typedef struct KrakenDecoder {
   byte *scratch;
   size_t scratch_size;
 
+  // Set when the decoder lives in memory supplied by the caller.
+  bool external_memory;
+
+  // Decoder type whose state is in |scratch|. LZNA and Bitknit carry their
+  // state across quantums, so they can only continue from their own.
+  int scratch_owner;
+
   KrakenHeader hdr;
+
+  // Dictionary and output for Ooz_DecoderDecompressDict, allocated on first
+  // use even when the decoder lives in caller memory.
+  PresetDictWindow dict_window;
 } KrakenDecoder;
 
+// Two phase decoding. Phase 1 parses the stream and does the entropy decoding of the
+// Kraken and Leviathan chunks, phase 2 copies the matches in output order. Anything
+// that reads earlier output (whole matches, the other codecs) is deferred to phase 2
+// as a whole step. The phases talk through a ring of jobs that each own one slot of
+// scratch memory, so phase 1 can run up to KRAKEN_PHASE_SLOTS chunks ahead.
+#define KRAKEN_PHASE_SLOTS 4
+
+enum {
+  kPhaseJob_Lz,       // Run the LZ table in the slot.
+  kPhaseJob_Copy,     // Copy |dst_count| bytes from |src|, which may point into the slot.
+  kPhaseJob_Step,     // Run Kraken_DecodeStep on |src|..|src_end|.
+};
+
+typedef struct KrakenPhaseJob {
+  int kind;
+  int decoder_type, mode;
+  int offset, dst_count;
+  const byte *src, *src_end;
+  // Header of the block the job is in, used for deferred steps.
+  KrakenHeader hdr;
+} KrakenPhaseJob;
+
+// Lives at the start of the thread phase memory, followed by the decoder used by
+// phase 2 and the scratch slots. Constructed by Kraken_PhaseRingInit.
+typedef struct KrakenPhaseRing {
+  std::atomic<uint32> produced;
+  std::atomic<uint32> consumed;
+  // Set by either phase on error so the other one stops waiting.
+  std::atomic<int> failed;
+  // Set by phase 1 after the last job was produced.
+  std::atomic<int> finished;
+  // A phase that spun for a while without the ring changing sleeps on |wake|.
+  // |sleepers| counts those, so the other phase only locks when one is asleep.
+  std::atomic<int> sleepers;
+  std::mutex lock;
+  std::condition_variable wake;
+  KrakenPhaseJob jobs[KRAKEN_PHASE_SLOTS];
+} KrakenPhaseRing;
+
+int Kraken_PhaseReadChunk(KrakenPhaseRing *ring, int decoder_type, byte *dst, int dst_count, int offset,
+                          const byte *src, const byte *src_end);
+
 typedef struct BitReader {
   // |p| holds the current byte and |p_end| the end of the buffer.
   const byte *p, *p_end;
@@ -475,30 +522,75 @@ int Log2RoundUp(uint32 v) {
         memcpy(&tmpVal, (s), 8);  \
         memcpy((d), &tmpVal, 8);  \
     }
+#if OOZ_HAS_VEC32
+// Two 32 byte moves, which the AVX2 and AVX-512 kernels do in two instructions.
+#define COPY_64_BYTES(d, s) {                                                 \
+        ((OozVec32*)(d))[0] = ((const OozVec32*)(s))[0];                      \
+        ((OozVec32*)(d))[1] = ((const OozVec32*)(s))[1];                      \
+}
+#else
 #define COPY_64_BYTES(d, s) {                                                 \
         simde_mm_storeu_si128((simde__m128i*)d + 0, simde_mm_loadu_si128((simde__m128i*)s + 0));  \
         simde_mm_storeu_si128((simde__m128i*)d + 1, simde_mm_loadu_si128((simde__m128i*)s + 1));  \
         simde_mm_storeu_si128((simde__m128i*)d + 2, simde_mm_loadu_si128((simde__m128i*)s + 2));  \
         simde_mm_storeu_si128((simde__m128i*)d + 3, simde_mm_loadu_si128((simde__m128i*)s + 3));  \
 }
+#endif
 
 #define COPY_64_ADD(d, s, t) simde_mm_storel_epi64((simde__m128i *)(d), simde_mm_add_epi8(simde_mm_loadl_epi64((simde__m128i *)(s)), simde_mm_loadl_epi64((simde__m128i *)(t))))
 
+// Byte at a time versions of the copies above, for commands that end so close to the
+// end of the output that the wide copies would write past it. Overlapping matches are
+// copied forwards just like the wide copies do for offsets of 8 and up.
+static OOZ_ALWAYS_INLINE void CopyExact(byte *d, const byte *s, size_t n) {
+  for (size_t i = 0; i != n; i++)
+    d[i] = s[i];
+}
+
+static OOZ_ALWAYS_INLINE void CopyExactAdd(byte *d, const byte *s, const byte *t, size_t n) {
+  for (size_t i = 0; i != n; i++)
+    d[i] = s[i] + t[i];
+}
+
+#define KRAKEN_SCRATCH_SIZE 0x6C000
+
+// Bytes of caller memory needed by |Kraken_CreateInPlace|, including slack for alignment.
+size_t Kraken_MemorySize() {
+  return sizeof(KrakenDecoder) + KRAKEN_SCRATCH_SIZE + 15;
+}
+
+KrakenDecoder *Kraken_CreateInPlace(void *memory, size_t memory_size) {
+  if (memory_size < Kraken_MemorySize())
+    return NULL;
+  KrakenDecoder *dec = (KrakenDecoder*)(((uintptr_t)memory + 15) & ~(uintptr_t)15);
+  memset(dec, 0, sizeof(KrakenDecoder));
+  dec->scratch_size = KRAKEN_SCRATCH_SIZE;
+  dec->scratch = (byte*)(dec + 1);
+  dec->external_memory = true;
+  return dec;
+}
+
 KrakenDecoder *Kraken_Create() {
-  size_t scratch_size = 0x6C000;
-  size_t memory_needed = sizeof(KrakenDecoder) + scratch_size;
+  size_t memory_needed = sizeof(KrakenDecoder) + KRAKEN_SCRATCH_SIZE;
   KrakenDecoder *dec = (KrakenDecoder*)MallocAligned(memory_needed, 16);
   memset(dec, 0, sizeof(KrakenDecoder));
-  dec->scratch_size = scratch_size;
+  dec->scratch_size = KRAKEN_SCRATCH_SIZE;
   dec->scratch = (byte*)(dec + 1);
   return dec;
 }
 
 void Kraken_Destroy(KrakenDecoder *kraken) {
-  FreeAligned(kraken);
+  if (kraken)
+    PresetDict_FreeWindow(&kraken->dict_window);
+  if (kraken && !kraken->external_memory)
+    FreeAligned(kraken);
 }
 
-const byte *Kraken_ParseHeader(KrakenHeader *hdr, const byte *p) {
+// The header parsers return NULL on invalid input, or a pointer past |p_end| if the
+// header is cut off there.
+const byte *Kraken_ParseHeader(KrakenHeader *hdr, const byte *p, const byte *p_end) {
+  if (p_end - p < 2)
+    return p + 2;
   int b = p[0];
   if ((b & 0xF) == 0xC) {
     if (((b >> 4) & 3) != 0) return NULL;
@@ -515,7 +607,9 @@ const byte *Kraken_ParseHeader(KrakenHeader *hdr, const byte *p) {
   return NULL;
 }
 
-const byte *Kraken_ParseQuantumHeader(KrakenQuantumHeader *hdr, const byte *p, bool use_checksum) {
+const byte *Kraken_ParseQuantumHeader(KrakenQuantumHeader *hdr, const byte *p, const byte *p_end, bool use_checksum) {
+  if (p_end - p < 3)
+    return p + 3;
   uint32 v = (p[0] << 16) | (p[1] << 8) | p[2];
   uint32 size = v & 0x3FFFF;
   if (size != 0x3ffff) {
@@ -523,6 +617,8 @@ const byte *Kraken_ParseQuantumHeader(KrakenQuantumHeader *hdr, const byte *p, b
     hdr->flag1 = (v >> 18) & 1;
     hdr->flag2 = (v >> 19) & 1;
     if (use_checksum) {
+      if (p_end - p < 6)
+        return p + 6;
       hdr->checksum = (p[3] << 16) | (p[4] << 8) | p[5];
       return p + 6;
     } else {
@@ -532,6 +628,8 @@ const byte *Kraken_ParseQuantumHeader(KrakenQuantumHeader *hdr, const byte *p, b
   v >>= 18;
   if (v == 1) {
     // memset
+    if (p_end - p < 4)
+      return p + 4;
     hdr->checksum = p[3];
     hdr->compressed_size = 0;
     hdr->whole_match_distance = 0;
@@ -541,12 +639,18 @@ const byte *Kraken_ParseQuantumHeader(KrakenQuantumHeader *hdr, const byte *p, b
 
 }
 
-const byte *LZNA_ParseWholeMatchInfo(const byte *p, uint32 *dist) {
+const byte *LZNA_ParseWholeMatchInfo(const byte *p, const byte *p_end, uint32 *dist) {
+  if (p_end - p < 2)
+    return p + 2;
   uint32 v = _byteswap_ushort(*(uint16*)p);
 
   if (v < 0x8000) {
     uint32 x = 0, b, pos = 0;
     for (;;) {
+      if (p_end - p < 3)
+        return p + 3;
+      if (pos > 28)
+        return NULL;
       b = p[2];
       p += 1;
       if (b & 0x80)
@@ -564,7 +668,9 @@ const byte *LZNA_ParseWholeMatchInfo(const byte *p, uint32 *dist) {
   }
 }
 
-const byte *LZNA_ParseQuantumHeader(KrakenQuantumHeader *hdr, const byte *p, bool use_checksum, int raw_len) {
+const byte *LZNA_ParseQuantumHeader(KrakenQuantumHeader *hdr, const byte *p, const byte *p_end, bool use_checksum, int raw_len) {
+  if (p_end - p < 2)
+    return p + 2;
   uint32 v = (p[0] << 8) | p[1];
   uint32 size = v & 0x3FFF;
   if (size != 0x3fff) {
@@ -572,6 +678,8 @@ const byte *LZNA_ParseQuantumHeader(KrakenQuantumHeader *hdr, const byte *p, boo
     hdr->flag1 = (v >> 14) & 1;
     hdr->flag2 = (v >> 15) & 1;
     if (use_checksum) {
+      if (p_end - p < 5)
+        return p + 5;
       hdr->checksum = (p[2] << 16) | (p[3] << 8) | p[4];
       return p + 5;
     } else {
@@ -580,12 +688,14 @@ const byte *LZNA_ParseQuantumHeader(KrakenQuantumHeader *hdr, const byte *p, boo
   }
   v >>= 14;
   if (v == 0) {
-    p = LZNA_ParseWholeMatchInfo(p + 2, &hdr->whole_match_distance);
+    p = LZNA_ParseWholeMatchInfo(p + 2, p_end, &hdr->whole_match_distance);
     hdr->compressed_size = 0;
     return p;
   }
   if (v == 1) {
     // memset
+    if (p_end - p < 3)
+      return p + 3;
     hdr->checksum = p[2];
     hdr->compressed_size = 0;
     hdr->whole_match_distance = 0;
@@ -600,9 +710,123 @@ const byte *LZNA_ParseQuantumHeader(KrakenQuantumHeader *hdr, const byte *p, boo
 }
 
 
+// Quantum checksums are CRC-32C (Castagnoli), the polynomial SSE4.2 has an
+// instruction for, truncated to 24 bits by the caller. Oodle's own checksum is
+// undocumented, so checksummed streams from it fail to verify here and the
+// other way around.
+#define CRC32C_POLY 0x82F63B78
+
+struct Crc32cTables {
+  // Slicing-by-8 tables, |slice[k][b]| is the CRC of byte b followed by k zeros.
+  uint32 slice[8][256];
+  // x^(2^k) modulo the polynomial, for moving a CRC past a run of bytes.
+  uint32 x2n[32];
+
+  Crc32cTables() {
+    for (uint32 b = 0; b < 256; b++) {
+      uint32 c = b;
+      for (int i = 0; i < 8; i++)
+        c = (c >> 1) ^ (CRC32C_POLY & (0 - (c & 1)));
+      slice[0][b] = c;
+    }
+    for (uint32 b = 0; b < 256; b++)
+      for (int k = 1; k < 8; k++)
+        slice[k][b] = (slice[k - 1][b] >> 8) ^ slice[0][slice[k - 1][b] & 0xFF];
+    x2n[0] = 1 << 30;
+    for (int k = 1; k < 32; k++)
+      x2n[k] = MulModP(x2n[k - 1], x2n[k - 1]);
+  }
+
+  // Product of two polynomials in the bit reflected form, modulo the polynomial.
+  static uint32 MulModP(uint32 a, uint32 b) {
+    uint32 p = 0;
+    for (uint32 m = 1u << 31; m; m >>= 1) {
+      if (a & m)
+        p ^= b;
+      b = (b >> 1) ^ (CRC32C_POLY & (0 - (b & 1)));
+    }
+    return p;
+  }
+
+  // Returns what |crc| becomes after |n| more zero bytes.
+  uint32 Shift(uint32 crc, size_t n) const {
+    uint32 p = 1u << 31;
+    for (int k = 3; n; n >>= 1, k++) {
+      if (n & 1)
+        p = MulModP(x2n[k & 31], p);
+    }
+    return MulModP(p, crc);
+  }
+};
+
+static const Crc32cTables crc32c_tables;
+
+static uint32 Crc32c_Table(uint32 crc, const byte *p, size_t n) {
+  const uint32 (*t)[256] = crc32c_tables.slice;
+  for (; n && ((uintptr_t)p & 7); n--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+  for (; n >= 8; n -= 8, p += 8) {
+    uint32 lo = *(const uint32*)p ^ crc, hi = *(const uint32*)(p + 4);
+    crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+          t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+  }
+  for (; n; n--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+  return crc;
+}
+
+#if (defined(__x86_64__) || defined(_M_X64)) && (OOZ_HAS_TARGET_ATTR || defined(_MSC_VER) || defined(__SSE4_2__))
+#define OOZ_HAS_SSE42_CRC 1
+#else
+#define OOZ_HAS_SSE42_CRC 0
+#endif
+
+#if OOZ_HAS_SSE42_CRC
+// The crc32 instruction has a latency of 3 cycles but issues every cycle, so
+// long inputs are split into three interleaved streams whose CRCs are joined
+// afterwards.
+static const size_t kCrc32cStride = 4096;
+
+OOZ_TARGET("sse4.2") static uint32 Crc32c_SSE42(uint32 crc, const byte *p, size_t n) {
+  static const uint32 shift_stride = crc32c_tables.Shift(1u << 31, kCrc32cStride);
+  uint64 c0 = crc;
+  for (; n && ((uintptr_t)p & 7); n--)
+    c0 = _mm_crc32_u8((uint32)c0, *p++);
+  for (; n >= 3 * kCrc32cStride; n -= 3 * kCrc32cStride, p += 3 * kCrc32cStride) {
+    uint64 c1 = 0, c2 = 0;
+    for (size_t i = 0; i < kCrc32cStride; i += 8) {
+      c0 = _mm_crc32_u64(c0, *(const uint64*)(p + i));
+      c1 = _mm_crc32_u64(c1, *(const uint64*)(p + kCrc32cStride + i));
+      c2 = _mm_crc32_u64(c2, *(const uint64*)(p + 2 * kCrc32cStride + i));
+    }
+    c0 = Crc32cTables::MulModP(shift_stride, (uint32)c0) ^ (uint32)c1;
+    c0 = Crc32cTables::MulModP(shift_stride, (uint32)c0) ^ (uint32)c2;
+  }
+  for (; n >= 8; n -= 8, p += 8)
+    c0 = _mm_crc32_u64(c0, *(const uint64*)p);
+  for (; n; n--)
+    c0 = _mm_crc32_u8((uint32)c0, *p++);
+  return (uint32)c0;
+}
+#endif
+
+typedef uint32 Crc32cFunc(uint32 crc, const byte *p, size_t n);
+
+static const CpuKernel<Crc32cFunc> kCrc32cKernels[] = {
+  { "table", Crc32c_Table, 0 },
+#if OOZ_HAS_SSE42_CRC
+  { "sse4.2", Crc32c_SSE42, kCpu_SSE42 },
+#endif
+};
+
+static Crc32cFunc *crc32c_update = CpuPickKernel(kCrc32cKernels);
+
+const char *Crc_KernelName(int index) { return CpuKernelName(kCrc32cKernels, index); }
+bool Crc_SelectKernel(int index) { return CpuSelectKernel(kCrc32cKernels, index, &crc32c_update); }
+void Crc_SelectDefaultKernel() { crc32c_update = CpuPickKernel(kCrc32cKernels); }
+
 uint32 Kraken_GetCrc(const byte *p, size_t p_size) {
-  // TODO: implement
-  return 0;
+  return ~crc32c_update(~0u, p, p_size);
 }
 
 // Rearranges elements in the input array so that bits in the index
@@ -786,6 +1010,118 @@ bool Kraken_DecodeBytesCore(HuffReader *hr, HuffRevLut *lut) {
   return true;
 }
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define HUFF_DECODE_SYM(bits, bitpos, out) \
+  k = bits & 0x7FF; n = lut->bits2len[k]; bits >>= n; bitpos -= n; out = lut->bits2sym[k];
+
+// Same as |Kraken_DecodeBytesCore| but refills 64 bits at a time, which leaves
+// at least 56 bits in each stream, enough for 5 symbols of at most 11 bits.
+// It handles the bulk of the output and then hands the reader state over to
+// |Kraken_DecodeBytesCore| for the tail and the final checks.
+static OOZ_ALWAYS_INLINE bool Kraken_DecodeBytesCore64(HuffReader *hr, HuffRevLut *lut) {
+  const byte *src = hr->src;
+  uint64 src_bits = hr->src_bits;
+  int src_bitpos = hr->src_bitpos;
+
+  const byte *src_mid = hr->src_mid;
+  uint64 src_mid_bits = hr->src_mid_bits;
+  int src_mid_bitpos = hr->src_mid_bitpos;
+
+  const byte *src_end = hr->src_end;
+  uint64 src_end_bits = hr->src_end_bits;
+  int src_end_bitpos = hr->src_end_bitpos;
+
+  int k, n;
+
+  byte *dst = hr->output;
+  byte *dst_end = hr->output_end;
+
+  if (src > src_mid)
+    return false;
+
+  if (src_end - src_mid >= 8 && dst_end - dst >= 16) {
+    dst_end -= 14;
+    src_end -= 8;
+
+    while (dst < dst_end && src <= src_mid && src_mid <= src_end) {
+      src_bits |= *(uint64*)src << src_bitpos;
+      src += (63 - src_bitpos) >> 3;
+
+      src_end_bits |= _byteswap_uint64(*(uint64*)src_end) << src_end_bitpos;
+      src_end -= (63 - src_end_bitpos) >> 3;
+
+      src_mid_bits |= *(uint64*)src_mid << src_mid_bitpos;
+      src_mid += (63 - src_mid_bitpos) >> 3;
+
+      src_bitpos |= 0x38;
+      src_end_bitpos |= 0x38;
+      src_mid_bitpos |= 0x38;
+
+      for (int i = 0; i < 15; i += 3) {
+        HUFF_DECODE_SYM(src_bits, src_bitpos, dst[i + 0]);
+        HUFF_DECODE_SYM(src_end_bits, src_end_bitpos, dst[i + 1]);
+        HUFF_DECODE_SYM(src_mid_bits, src_mid_bitpos, dst[i + 2]);
+      }
+      dst += 15;
+    }
+
+    src -= src_bitpos >> 3;
+    src_bitpos &= 7;
+
+    src_end += 8 + (src_end_bitpos >> 3);
+    src_end_bitpos &= 7;
+
+    src_mid -= src_mid_bitpos >> 3;
+    src_mid_bitpos &= 7;
+  }
+
+  hr->output = dst;
+  hr->src = src;
+  hr->src_bits = (uint32)src_bits;
+  hr->src_bitpos = src_bitpos;
+  hr->src_mid = src_mid;
+  hr->src_mid_bits = (uint32)src_mid_bits;
+  hr->src_mid_bitpos = src_mid_bitpos;
+  hr->src_end = src_end;
+  hr->src_end_bits = (uint32)src_end_bits;
+  hr->src_end_bitpos = src_end_bitpos;
+  return Kraken_DecodeBytesCore(hr, lut);
+}
+
+#undef HUFF_DECODE_SYM
+
+bool Kraken_DecodeBytesCore_64(HuffReader *hr, HuffRevLut *lut) {
+  return Kraken_DecodeBytesCore64(hr, lut);
+}
+
+#if OOZ_HAS_BMI2_KERNELS
+// Built with BMI2 the variable shifts become shrx, which doesn't go through
+// the flags register and frees up rcx.
+OOZ_TARGET("bmi2") bool Kraken_DecodeBytesCore_BMI2(HuffReader *hr, HuffRevLut *lut) {
+  return Kraken_DecodeBytesCore64(hr, lut);
+}
+#endif
+#endif
+
+typedef bool HuffDecodeCoreFunc(HuffReader *hr, HuffRevLut *lut);
+
+static const CpuKernel<HuffDecodeCoreFunc> kHuffKernels[] = {
+  { "scalar32", Kraken_DecodeBytesCore, 0 },
+#if defined(__x86_64__) || defined(_M_X64)
+  { "scalar64", Kraken_DecodeBytesCore_64, 0 },
+#if OOZ_HAS_BMI2_KERNELS
+  { "bmi2", Kraken_DecodeBytesCore_BMI2, kCpu_BMI2 },
+#endif
+#endif
+};
+
+static HuffDecodeCoreFunc *huff_decode_core = CpuPickKernel(kHuffKernels);
+
+// Used by the benchmark to time each kernel.
+const char *Huff_KernelName(int index) { return CpuKernelName(kHuffKernels, index); }
+bool Huff_SelectKernel(int index) { return CpuSelectKernel(kHuffKernels, index, &huff_decode_core); }
+void Huff_SelectDefaultKernel() { huff_decode_core = CpuPickKernel(kHuffKernels); }
+
 int Huff_ReadCodeLengthsOld(BitReader *bits, uint8 *syms, uint32 *code_prefix) {
   if (BitReader_ReadBitNoRefill(bits)) {
     int n, sym = 0, codelen, num_symbols = 0;
@@ -990,6 +1326,17 @@ bool DecodeGolombRiceBits(uint8 *dst, uint size, uint bitcount, BitReader2 *br)
   br->p = p + (bits_required >> 3);
   br->bitpos = bits_required & 7;
 
+  // The loops below load a few bytes past the last one they use. Near the end
+  // of the input read from a padded copy instead.
+  uint8 padded[128];
+  if (br->p_end - p < bytes_required + 8) {
+    if (bytes_required + 8 > sizeof(padded))
+      return false;
+    memset(padded, 0, sizeof(padded));
+    memcpy(padded, p, bytes_required);
+    p = padded;
+  }
+
   // todo. handle r/w outside of range
   uint64 bak = *(uint64*)dst_end;
 
@@ -1276,7 +1623,7 @@ int Kraken_DecodeBytes_Type12(const byte *src, size_t src_size, byte *output, in
     hr.src_mid_bits = 0;
     hr.src_end_bitpos = 0;
     hr.src_end_bits = 0;
-    if (!Kraken_DecodeBytesCore(&hr, &rev_lut))
+    if (!huff_decode_core(&hr, &rev_lut))
       return -1;
   } else {
     if (src + 6 > src_end)
@@ -1307,7 +1654,7 @@ int Kraken_DecodeBytes_Type12(const byte *src, size_t src_size, byte *output, in
     hr.src_mid_bits = 0;
     hr.src_end_bitpos = 0;
     hr.src_end_bits = 0;
-    if (!Kraken_DecodeBytesCore(&hr, &rev_lut))
+    if (!huff_decode_core(&hr, &rev_lut))
       return -1;
 
     hr.output = output + half_output_size;
@@ -1321,7 +1668,7 @@ int Kraken_DecodeBytes_Type12(const byte *src, size_t src_size, byte *output, in
     hr.src_mid_bits = 0;
     hr.src_end_bitpos = 0;
     hr.src_end_bits = 0;
-    if (!Kraken_DecodeBytesCore(&hr, &rev_lut))
+    if (!huff_decode_core(&hr, &rev_lut))
       return -1;
   }
   return (int)src_size;
@@ -1812,7 +2159,8 @@ bool Tans_DecodeTable(BitReader *bits, int L_bits, TansData *tans_data) {
     if (seen[sym])
       return false;
 
-    if (L - total_weights < weight || L - total_weights <= 1)
+    // Signed, weights summing past L would wrap around otherwise.
+    if ((int)L - total_weights < weight || (int)L - total_weights <= 1)
       return false;
 
     *tanstable_B++ = (sym << 16) + (L - total_weights);
@@ -1963,7 +2311,12 @@ bool Tans_Decode(TansDecoderParams *params) {
     if (dst >= dst_end)                         \
       break;
 
+// A valid stream ends with the pointers at most 6 bytes crossed, and they
+// only move closer, so a stream crossed further is rejected before reading
+// out of it.
 #define TANS_BACKWARD_BITS()                    \
+    if (ptr_b - ptr_f < -8)                     \
+      return false;                             \
     bits_b |= _byteswap_ulong(((uint32 *)ptr_b)[-1]) << bitpos_b;     \
     ptr_b -= (31 - bitpos_b) >> 3;              \
     bitpos_b |= 24;
@@ -2013,6 +2366,101 @@ bool Tans_Decode(TansDecoderParams *params) {
   return true;
 }
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define TANS_ROUND64(bits, bitpos, state, i)   \
+    e = &lut[state];                            \
+    dst[i] = e->symbol;                         \
+    bitpos -= e->bits_x;                        \
+    state = (uint32)(bits & e->x) + e->w;       \
+    bits >>= e->bits_x;
+
+// Bulk of |Tans_Decode| with 64-bit refills. A refill leaves at least 56 bits,
+// enough for a round of all five states at up to 11 bits each, so each stream
+// is refilled once per five symbols instead of every two. It runs while both
+// 8 byte reads stay between the two stream pointers and then leaves the state
+// normalized the way |Tans_Decode| expects for the tail.
+static OOZ_ALWAYS_INLINE void Tans_DecodeBulk64(TansDecoderParams *params) {
+  TansLutEnt *lut = params->lut, *e;
+  uint8 *dst = params->dst, *dst_end = params->dst_end;
+  const uint8 *ptr_f = params->ptr_f, *ptr_b = params->ptr_b;
+  uint64 bits_f = params->bits_f, bits_b = params->bits_b;
+  int bitpos_f = params->bitpos_f, bitpos_b = params->bitpos_b;
+  uint32 state_0 = params->state_0, state_1 = params->state_1;
+  uint32 state_2 = params->state_2, state_3 = params->state_3;
+  uint32 state_4 = params->state_4;
+
+  while (dst_end - dst >= 10 && ptr_b - ptr_f >= 8) {
+    bits_f |= *(uint64 *)ptr_f << bitpos_f;
+    ptr_f += (63 - bitpos_f) >> 3;
+    bitpos_f |= 56;
+    TANS_ROUND64(bits_f, bitpos_f, state_0, 0);
+    TANS_ROUND64(bits_f, bitpos_f, state_1, 1);
+    TANS_ROUND64(bits_f, bitpos_f, state_2, 2);
+    TANS_ROUND64(bits_f, bitpos_f, state_3, 3);
+    TANS_ROUND64(bits_f, bitpos_f, state_4, 4);
+
+    bits_b |= _byteswap_uint64(((uint64 *)ptr_b)[-1]) << bitpos_b;
+    ptr_b -= (63 - bitpos_b) >> 3;
+    bitpos_b |= 56;
+    TANS_ROUND64(bits_b, bitpos_b, state_0, 5);
+    TANS_ROUND64(bits_b, bitpos_b, state_1, 6);
+    TANS_ROUND64(bits_b, bitpos_b, state_2, 7);
+    TANS_ROUND64(bits_b, bitpos_b, state_3, 8);
+    TANS_ROUND64(bits_b, bitpos_b, state_4, 9);
+    dst += 10;
+  }
+
+  params->dst = dst;
+  params->ptr_f = ptr_f - (bitpos_f >> 3);
+  params->bits_f = (uint32)bits_f;
+  params->bitpos_f = bitpos_f & 7;
+  params->ptr_b = ptr_b + (bitpos_b >> 3);
+  params->bits_b = (uint32)bits_b;
+  params->bitpos_b = bitpos_b & 7;
+  params->state_0 = state_0;
+  params->state_1 = state_1;
+  params->state_2 = state_2;
+  params->state_3 = state_3;
+  params->state_4 = state_4;
+}
+
+#undef TANS_ROUND64
+
+bool Tans_Decode_64(TansDecoderParams *params) {
+  if (params->ptr_f > params->ptr_b)
+    return false;
+  Tans_DecodeBulk64(params);
+  return Tans_Decode(params);
+}
+
+#if OOZ_HAS_BMI2_KERNELS
+OOZ_TARGET("bmi2") bool Tans_Decode_BMI2(TansDecoderParams *params) {
+  if (params->ptr_f > params->ptr_b)
+    return false;
+  Tans_DecodeBulk64(params);
+  return Tans_Decode(params);
+}
+#endif
+#endif
+
+typedef bool TansDecodeFunc(TansDecoderParams *params);
+
+static const CpuKernel<TansDecodeFunc> kTansKernels[] = {
+  { "scalar32", Tans_Decode, 0 },
+#if defined(__x86_64__) || defined(_M_X64)
+  { "scalar64", Tans_Decode_64, 0 },
+#if OOZ_HAS_BMI2_KERNELS
+  { "bmi2", Tans_Decode_BMI2, kCpu_BMI2 },
+#endif
+#endif
+};
+
+static TansDecodeFunc *tans_decode = CpuPickKernel(kTansKernels);
+
+const char *Tans_KernelName(int index) { return CpuKernelName(kTansKernels, index); }
+bool Tans_SelectKernel(int index) { return CpuSelectKernel(kTansKernels, index, &tans_decode); }
+void Tans_SelectDefaultKernel() { tans_decode = CpuPickKernel(kTansKernels); }
+
 int Krak_DecodeTans(const byte *src, size_t src_size, byte *dst, int dst_size, uint8 *scratch, uint8 *scratch_end) {
   if (src_size < 8 || dst_size < 5)
     return -1;
@@ -2090,7 +2538,7 @@ int Krak_DecodeTans(const byte *src, size_t src_size, byte *dst, int dst_size, u
   params.ptr_b = src_end + (bitpos_b >> 3);
   params.bitpos_b = bitpos_b & 7;
 
-  if (!Tans_Decode(&params))
+  if (!tans_decode(&params))
     return -1;
 
   return src_size;
@@ -2367,6 +2815,8 @@ bool Kraken_ReadLzTable(int mode,
     return false;
 
   if (offset == 0) {
+    if (dst_size < 8)
+      return false;
     COPY_64(dst, src);
     dst += 8;
     src += 8;
@@ -2474,8 +2924,7 @@ bool Kraken_ReadLzTable(int mode,
 }
 
 
-// Note: may access memory out of bounds on invalid input.
-bool Kraken_ProcessLzRuns_Type0(KrakenLzTable *lzt, byte *dst, byte *dst_end, byte *dst_start) {
+static OOZ_ALWAYS_INLINE bool Kraken_ProcessLzRuns_Type0(KrakenLzTable *lzt, byte *dst, byte *dst_end, byte *dst_start) {
   const byte *cmd_stream = lzt->cmd_stream,
              *cmd_stream_end = cmd_stream + lzt->cmd_stream_size;
   const int *len_stream = lzt->len_stream;
@@ -2509,18 +2958,28 @@ bool Kraken_ProcessLzRuns_Type0(KrakenLzTable *lzt, byte *dst, byte *dst_end, by
     litlen = (litlen == 3) ? next_long_length : litlen;
     recent_offs[6] = *offs_stream;
 
-    COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
-    if (litlen > 8) {
-      COPY_64_ADD(dst + 8, lit_stream + 8, &dst[last_offset + 8]);
-      if (litlen > 16) {
-        COPY_64_ADD(dst + 16, lit_stream + 16, &dst[last_offset + 16]);
-        if (litlen > 24) {
-          do {
-            COPY_64_ADD(dst + 24, lit_stream + 24, &dst[last_offset + 24]);
-            litlen -= 8;
-            dst += 8;
-            lit_stream += 8;
-          } while (litlen > 24);
+    if (litlen > (uintptr_t)(lit_stream_end - lit_stream))
+      return false; // literal run out of bounds
+
+    // The wide copies write up to 8 bytes past the run.
+    if ((intptr_t)litlen + 8 > dst_end - dst) {
+      if (litlen > (uintptr_t)(dst_end - dst))
+        return false; // literal run out of bounds
+      CopyExactAdd(dst, lit_stream, &dst[last_offset], litlen);
+    } else {
+      COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
+      if (litlen > 8) {
+        COPY_64_ADD(dst + 8, lit_stream + 8, &dst[last_offset + 8]);
+        if (litlen > 16) {
+          COPY_64_ADD(dst + 16, lit_stream + 16, &dst[last_offset + 16]);
+          if (litlen > 24) {
+            do {
+              COPY_64_ADD(dst + 24, lit_stream + 24, &dst[last_offset + 24]);
+              litlen -= 8;
+              dst += 8;
+              lit_stream += 8;
+            } while (litlen > 24);
+          }
         }
       }
     }
@@ -2541,24 +3000,37 @@ bool Kraken_ProcessLzRuns_Type0(KrakenLzTable *lzt, byte *dst, byte *dst_end, by
 
     copyfrom = dst + offset;
     if (matchlen != 15) {
-      COPY_64(dst, copyfrom);
-      COPY_64(dst + 8, copyfrom + 8);
+      if (dst_end - dst < 16) {
+        if (matchlen + 2 > (uintptr_t)(dst_end - dst))
+          return false; // copy length out of bounds
+        CopyExact(dst, copyfrom, matchlen + 2);
+      } else {
+        COPY_64(dst, copyfrom);
+        COPY_64(dst + 8, copyfrom + 8);
+      }
       dst += matchlen + 2;
     } else {
       matchlen = 14 + *len_stream++; // why is the value not 16 here, the above case copies up to 16 bytes.
-      if ((uintptr_t)matchlen >(uintptr_t)(dst_end - dst))
-        return false; // copy length out of bounds
-      COPY_64(dst, copyfrom);
-      COPY_64(dst + 8, copyfrom + 8);
-      COPY_64(dst + 16, copyfrom + 16);
-      do {
-        COPY_64(dst + 24, copyfrom + 24);
-        matchlen -= 8;
-        dst += 8;
-        copyfrom += 8;
-      } while (matchlen > 24);
+      // The wide copies write up to 18 bytes past the match.
+      if ((intptr_t)matchlen + 18 > dst_end - dst) {
+        if ((uintptr_t)matchlen > (uintptr_t)(dst_end - dst))
+          return false; // copy length out of bounds
+        CopyExact(dst, copyfrom, matchlen);
+      } else {
+        COPY_64(dst, copyfrom);
+        COPY_64(dst + 8, copyfrom + 8);
+        COPY_64(dst + 16, copyfrom + 16);
+        do {
+          COPY_64(dst + 24, copyfrom + 24);
+          matchlen -= 8;
+          dst += 8;
+          copyfrom += 8;
+        } while (matchlen > 24);
+      }
       dst += matchlen;
     }
+    if (offs_stream > offs_stream_end || len_stream > len_stream_end)
+      return false; // ran past the end of a stream
   }
 
   // check for incorrect input
@@ -2584,8 +3056,7 @@ bool Kraken_ProcessLzRuns_Type0(KrakenLzTable *lzt, byte *dst, byte *dst_end, by
 }
 
 
-// Note: may access memory out of bounds on invalid input.
-bool Kraken_ProcessLzRuns_Type1(KrakenLzTable *lzt, byte *dst, byte *dst_end, byte *dst_start) {
+static OOZ_ALWAYS_INLINE bool Kraken_ProcessLzRuns_Type1(KrakenLzTable *lzt, byte *dst, byte *dst_end, byte *dst_start) {
   const byte *cmd_stream = lzt->cmd_stream, 
              *cmd_stream_end = cmd_stream + lzt->cmd_stream_size;
   const int *len_stream = lzt->len_stream;
@@ -2617,18 +3088,28 @@ bool Kraken_ProcessLzRuns_Type1(KrakenLzTable *lzt, byte *dst, byte *dst_end, by
     litlen = (litlen == 3) ? next_long_length : litlen;
     recent_offs[6] = *offs_stream;
 
-    COPY_64(dst, lit_stream);
-    if (litlen > 8) {
-      COPY_64(dst + 8, lit_stream + 8);
-      if (litlen > 16) {
-        COPY_64(dst + 16, lit_stream + 16);
-        if (litlen > 24) {
-          do {
-            COPY_64(dst + 24, lit_stream + 24);
-            litlen -= 8;
-            dst += 8;
-            lit_stream += 8;
-          } while (litlen > 24);
+    if (litlen > (uintptr_t)(lit_stream_end - lit_stream))
+      return false; // literal run out of bounds
+
+    // The wide copies write up to 8 bytes past the run.
+    if ((intptr_t)litlen + 8 > dst_end - dst) {
+      if (litlen > (uintptr_t)(dst_end - dst))
+        return false; // literal run out of bounds
+      CopyExact(dst, lit_stream, litlen);
+    } else {
+      COPY_64(dst, lit_stream);
+      if (litlen > 8) {
+        COPY_64(dst + 8, lit_stream + 8);
+        if (litlen > 16) {
+          COPY_64(dst + 16, lit_stream + 16);
+          if (litlen > 24) {
+            do {
+              COPY_64(dst + 24, lit_stream + 24);
+              litlen -= 8;
+              dst += 8;
+              lit_stream += 8;
+            } while (litlen > 24);
+          }
         }
       }
     }
@@ -2648,24 +3129,37 @@ bool Kraken_ProcessLzRuns_Type1(KrakenLzTable *lzt, byte *dst, byte *dst_end, by
 
     copyfrom = dst + offset;
     if (matchlen != 15) {
-      COPY_64(dst, copyfrom);
-      COPY_64(dst + 8, copyfrom + 8);
+      if (dst_end - dst < 16) {
+        if (matchlen + 2 > (uintptr_t)(dst_end - dst))
+          return false; // copy length out of bounds
+        CopyExact(dst, copyfrom, matchlen + 2);
+      } else {
+        COPY_64(dst, copyfrom);
+        COPY_64(dst + 8, copyfrom + 8);
+      }
       dst += matchlen + 2;
     } else {
       matchlen = 14 + *len_stream++; // why is the value not 16 here, the above case copies up to 16 bytes.
-      if ((uintptr_t)matchlen > (uintptr_t)(dst_end - dst))
-        return false; // copy length out of bounds
-      COPY_64(dst, copyfrom);
-      COPY_64(dst + 8, copyfrom + 8);
-      COPY_64(dst + 16, copyfrom + 16);
-      do {
-        COPY_64(dst + 24, copyfrom + 24);
-        matchlen -= 8;
-        dst += 8;
-        copyfrom += 8;
-      } while (matchlen > 24);
+      // The wide copies write up to 18 bytes past the match.
+      if ((intptr_t)matchlen + 18 > dst_end - dst) {
+        if ((uintptr_t)matchlen > (uintptr_t)(dst_end - dst))
+          return false; // copy length out of bounds
+        CopyExact(dst, copyfrom, matchlen);
+      } else {
+        COPY_64(dst, copyfrom);
+        COPY_64(dst + 8, copyfrom + 8);
+        COPY_64(dst + 16, copyfrom + 16);
+        do {
+          COPY_64(dst + 24, copyfrom + 24);
+          matchlen -= 8;
+          dst += 8;
+          copyfrom += 8;
+        } while (matchlen > 24);
+      }
       dst += matchlen;
     }
+    if (offs_stream > offs_stream_end || len_stream > len_stream_end)
+      return false; // ran past the end of a stream
   }
 
   // check for incorrect input
@@ -2696,24 +3190,36 @@ bool Kraken_ProcessLzRuns_Type1(KrakenLzTable *lzt, byte *dst, byte *dst_end, by
   return true;
 }
 
-bool Kraken_ProcessLzRuns(int mode, byte *dst, int dst_size, int offset, KrakenLzTable *lztable) {
+static OOZ_ALWAYS_INLINE bool Kraken_ProcessLzRuns_Impl(int mode, byte *dst, int dst_size, int offset, KrakenLzTable *lztable) {
   byte *dst_end = dst + dst_size;
+  byte *dst_cur = dst + (offset == 0 ? 8 : 0);
+  if (dst_cur > dst_end)
+    return false;
 
   if (mode == 1)
-    return Kraken_ProcessLzRuns_Type1(lztable, dst + (offset == 0 ? 8 : 0), dst_end, dst - offset);
+    return Kraken_ProcessLzRuns_Type1(lztable, dst_cur, dst_end, dst - offset);
 
   if (mode == 0)
-    return Kraken_ProcessLzRuns_Type0(lztable, dst + (offset == 0 ? 8 : 0), dst_end, dst - offset);
+    return Kraken_ProcessLzRuns_Type0(lztable, dst_cur, dst_end, dst - offset);
 
 
   return false;
 }
 
+// The LZ run processors are built for each instruction set level and picked at load.
+OOZ_MULTIVERSION(bool, Kraken_ProcessLzRuns,
+                 (int mode, byte *dst, int dst_size, int offset, KrakenLzTable *lztable),
+                 (mode, dst, dst_size, offset, lztable))
+
+bool Kraken_ProcessLzRuns(int mode, byte *dst, int dst_size, int offset, KrakenLzTable *lztable) {
+  return Kraken_ProcessLzRuns_Current(mode, dst, dst_size, offset, lztable);
+}
+
 // Decode one 256kb big quantum block. It's divided into two 128k blocks
 // internally that are compressed separately but with a shared history.
 int Kraken_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                          const byte *src, const byte *src_end,
-                         byte *scratch, byte *scratch_end) {
+                         byte *scratch, byte *scratch_end, KrakenPhaseRing *ring) {
   const byte *src_in = src;
   int mode, chunkhdr, dst_count, src_used, written_bytes;
 
@@ -2723,7 +3229,12 @@ int Kraken_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
     if (src_end - src < 4)
       return -1;
     chunkhdr = src[2] | src[1] << 8 | src[0] << 16;
-    if (!(chunkhdr & 0x800000)) {
+    if (ring) {
+      // Phase 1, the chunk is read into a slot and finished by phase 2.
+      src_used = Kraken_PhaseReadChunk(ring, 6, dst, dst_count, dst - dst_start, src, src_end);
+      if (src_used < 0)
+        return -1;
+    } else if (!(chunkhdr & 0x800000)) {
       // Stored as entropy without any match copying.
       byte *out = dst;
       src_used = Kraken_DecodeBytes(&out, src, src_end, &written_bytes, dst_count, false, scratch, scratch_end);
@@ -2788,6 +3299,8 @@ bool Leviathan_ReadLzTable(int chunk_type,
     return false;
 
   if (offset == 0) {
+    if (dst_size < 8)
+      return false;
     COPY_64(dst, src);
     dst += 8;
     src += 8;
@@ -2920,7 +3433,7 @@ bool Leviathan_ReadLzTable(int chunk_type,
                               lztable->offs_stream, lztable->len_stream, 0, 0);
 }
 
-#define finline __forceinline
+#define finline OOZ_ALWAYS_INLINE
 
 struct LeviathanModeRaw {
   const uint8 *lit_stream;
@@ -2928,25 +3441,32 @@ struct LeviathanModeRaw {
   finline LeviathanModeRaw(LeviathanLzTable *lzt, uint8 *dst_start) : lit_stream(lzt->lit_stream[0]) {
   }
   
-  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, size_t last_offset) {
+  template<bool Exact>
+  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, uint8 *dst_end, size_t last_offset) {
     uint32 litlen = (cmd >> 3) & 3;
     // use cmov
     uint32 len_stream_value = *len_stream & 0xffffff;
     const int *next_len_stream = len_stream + 1;
     len_stream = (litlen == 3) ? next_len_stream : len_stream;
     litlen = (litlen == 3) ? len_stream_value : litlen;
-    COPY_64(dst, lit_stream);
-    if (litlen > 8) {
-      COPY_64(dst + 8, lit_stream + 8);
-      if (litlen > 16) {
-        COPY_64(dst + 16, lit_stream + 16);
-        if (litlen > 24) {
-          if (litlen > match_zone_end - dst)
-            return false;  // out of bounds
-          do {
-            COPY_64(dst + 24, lit_stream + 24);
-            litlen -= 8, dst += 8, lit_stream += 8;
-          } while (litlen > 24);
+    if (Exact) {
+      if (litlen > (litlen > 24 ? match_zone_end : dst_end) - dst)
+        return false;  // out of bounds
+      CopyExact(dst, lit_stream, litlen);
+    } else {
+      COPY_64(dst, lit_stream);
+      if (litlen > 8) {
+        COPY_64(dst + 8, lit_stream + 8);
+        if (litlen > 16) {
+          COPY_64(dst + 16, lit_stream + 16);
+          if (litlen > 24) {
+            if (litlen > match_zone_end - dst)
+              return false;  // out of bounds
+            do {
+              COPY_64(dst + 24, lit_stream + 24);
+              litlen -= 8, dst += 8, lit_stream += 8;
+            } while (litlen > 24);
+          }
         }
       }
     }
@@ -2982,25 +3502,32 @@ struct LeviathanModeSub {
   finline LeviathanModeSub(LeviathanLzTable *lzt, uint8 *dst_start) : lit_stream(lzt->lit_stream[0]) {
   }
 
-  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, size_t last_offset) {
+  template<bool Exact>
+  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, uint8 *dst_end, size_t last_offset) {
     uint32 litlen = (cmd >> 3) & 3;
     // use cmov
     uint32 len_stream_value = *len_stream & 0xffffff;
     const int *next_len_stream = len_stream + 1;
     len_stream = (litlen == 3) ? next_len_stream : len_stream;
     litlen = (litlen == 3) ? len_stream_value : litlen;
-    COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
-    if (litlen > 8) {
-      COPY_64_ADD(dst + 8, lit_stream + 8, &dst[last_offset + 8]);
-      if (litlen > 16) {
-        COPY_64_ADD(dst + 16, lit_stream + 16, &dst[last_offset + 16]);
-        if (litlen > 24) {
-          if (litlen > match_zone_end - dst)
-            return false;  // out of bounds
-          do {
-            COPY_64_ADD(dst + 24, lit_stream + 24, &dst[last_offset + 24]);
-            litlen -= 8, dst += 8, lit_stream += 8;
-          } while (litlen > 24);
+    if (Exact) {
+      if (litlen > (litlen > 24 ? match_zone_end : dst_end) - dst)
+        return false;  // out of bounds
+      CopyExactAdd(dst, lit_stream, &dst[last_offset], litlen);
+    } else {
+      COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
+      if (litlen > 8) {
+        COPY_64_ADD(dst + 8, lit_stream + 8, &dst[last_offset + 8]);
+        if (litlen > 16) {
+          COPY_64_ADD(dst + 16, lit_stream + 16, &dst[last_offset + 16]);
+          if (litlen > 24) {
+            if (litlen > match_zone_end - dst)
+              return false;  // out of bounds
+            do {
+              COPY_64_ADD(dst + 24, lit_stream + 24, &dst[last_offset + 24]);
+              litlen -= 8, dst += 8, lit_stream += 8;
+            } while (litlen > 24);
+          }
         }
       }
     }
@@ -3032,7 +3559,8 @@ struct LeviathanModeLamSub {
       lam_lit_stream(lzt->lit_stream[1]) {
   }
 
-  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, size_t last_offset) {
+  template<bool Exact>
+  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, uint8 *dst_end, size_t last_offset) {
     uint32 lit_cmd = cmd & 0x18;
     if (!lit_cmd)
       return true;
@@ -3047,20 +3575,27 @@ struct LeviathanModeLamSub {
     if (litlen-- == 0)
       return false; // lamsub mode requires one literal
 
+    if (Exact && litlen >= (litlen > 24 ? match_zone_end : dst_end) - dst)
+      return false;  // out of bounds
+
     dst[0] = *lam_lit_stream++ + dst[last_offset], dst++;
 
-    COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
-    if (litlen > 8) {
-      COPY_64_ADD(dst + 8, lit_stream + 8, &dst[last_offset + 8]);
-      if (litlen > 16) {
-        COPY_64_ADD(dst + 16, lit_stream + 16, &dst[last_offset + 16]);
-        if (litlen > 24) {
-          if (litlen > match_zone_end - dst)
-            return false;  // out of bounds
-          do {
-            COPY_64_ADD(dst + 24, lit_stream + 24, &dst[last_offset + 24]);
-            litlen -= 8, dst += 8, lit_stream += 8;
-          } while (litlen > 24);
+    if (Exact) {
+      CopyExactAdd(dst, lit_stream, &dst[last_offset], litlen);
+    } else {
+      COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
+      if (litlen > 8) {
+        COPY_64_ADD(dst + 8, lit_stream + 8, &dst[last_offset + 8]);
+        if (litlen > 16) {
+          COPY_64_ADD(dst + 16, lit_stream + 16, &dst[last_offset + 16]);
+          if (litlen > 24) {
+            if (litlen > match_zone_end - dst)
+              return false;  // out of bounds
+            do {
+              COPY_64_ADD(dst + 24, lit_stream + 24, &dst[last_offset + 24]);
+              litlen -= 8, dst += 8, lit_stream += 8;
+            } while (litlen > 24);
+          }
         }
       }
     }
@@ -3095,7 +3630,8 @@ struct LeviathanModeSubAnd3 {
     for (size_t i = 0; i != NUM; i++)
       lit_stream[i] = lzt->lit_stream[(-(intptr_t)dst_start + i) & MASK];
   }
-  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, size_t last_offset) {
+  template<bool Exact>
+  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, uint8 *dst_end, size_t last_offset) {
     uint32 lit_cmd = cmd & 0x18;
 
     if (lit_cmd == 0x18) {
@@ -3107,6 +3643,8 @@ struct LeviathanModeSubAnd3 {
         dst++, litlen--;
       }
     } else if (lit_cmd) {
+      if (Exact && (intptr_t)(lit_cmd >> 3) > dst_end - dst)
+        return false;
       *dst = *lit_stream[(uintptr_t)dst & MASK]++ + dst[last_offset];
       dst++;
       if (lit_cmd == 0x10) {
@@ -3134,7 +3672,8 @@ struct LeviathanModeSubAndF {
     for(size_t i = 0; i != NUM; i++)
       lit_stream[i] = lzt->lit_stream[(-(intptr_t)dst_start + i) & MASK];
   }
-  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, size_t last_offset) {
+  template<bool Exact>
+  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, uint8 *dst_end, size_t last_offset) {
     uint32 lit_cmd = cmd & 0x18;
 
     if (lit_cmd == 0x18) {
@@ -3146,6 +3685,8 @@ struct LeviathanModeSubAndF {
         dst++, litlen--;
       }
     } else if (lit_cmd) {
+      if (Exact && (intptr_t)(lit_cmd >> 3) > dst_end - dst)
+        return false;
       *dst = *lit_stream[(uintptr_t)dst & MASK]++ + dst[last_offset];
       dst++;
       if (lit_cmd == 0x10) {
@@ -3177,12 +3718,13 @@ struct LeviathanModeO1 {
     }
   }
 
-  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, size_t last_offset) {
+  template<bool Exact>
+  finline bool CopyLiterals(uint32 cmd, uint8 *&dst, const int *&len_stream, uint8 *match_zone_end, uint8 *dst_end, size_t last_offset) {
     uint32 lit_cmd = cmd & 0x18;
 
     if (lit_cmd == 0x18) {
       uint32 litlen = *len_stream++;
-      if ((int32)litlen <= 0)
+      if ((int32)litlen <= 0 || (intptr_t)litlen > match_zone_end - dst)
         return false;
       uint context = dst[-1];
       do {
@@ -3192,6 +3734,8 @@ struct LeviathanModeO1 {
       } while (--litlen);
     } else if (lit_cmd) {
       // either 1 or 2
+      if (Exact && (intptr_t)(lit_cmd >> 3) > dst_end - dst)
+        return false;
       uint context = dst[-1];
       size_t slot = context >> 4;
       *dst++ = (context = next_lit[slot]);
@@ -3217,7 +3761,7 @@ struct LeviathanModeO1 {
 };
 
 template<typename Mode, bool MultiCmd>
-bool Leviathan_ProcessLz(LeviathanLzTable *lzt, uint8 *dst,
+OOZ_ALWAYS_INLINE bool Leviathan_ProcessLz(LeviathanLzTable *lzt, uint8 *dst,
                          uint8 *dst_start, uint8 *dst_end, uint8 *window_base) {
   const uint8 *cmd_stream = lzt->cmd_stream,
               *cmd_stream_end = cmd_stream + lzt->cmd_stream_size;
@@ -3267,8 +3811,15 @@ bool Leviathan_ProcessLz(LeviathanLzTable *lzt, uint8 *dst,
 
     recent_offs[15] = *offs_stream;
 
-    if (!mode.CopyLiterals(cmd, dst, len_stream, match_zone_end, offset))
-      return false;
+    // The wide literal and match copies of a command starting this far from the end
+    // stay inside the output, closer to it they're copied exactly.
+    if (dst_end - dst >= 64) {
+      if (!mode.template CopyLiterals<false>(cmd, dst, len_stream, match_zone_end, dst_end, offset))
+        return false;
+    } else {
+      if (!mode.template CopyLiterals<true>(cmd, dst, len_stream, match_zone_end, dst_end, offset))
+        return false;
+    }
 
     offset = recent_offs[(size_t)offs_index + 8];
 
@@ -3287,29 +3838,45 @@ bool Leviathan_ProcessLz(LeviathanLzTable *lzt, uint8 *dst,
       if (len_stream >= len_stream_end)
         return false;  // len stream empty
       matchlen = *--len_stream_end + 6;
-      COPY_64(dst, copyfrom);
-      COPY_64(dst + 8, copyfrom + 8);
       uint8 *next_dst = dst + matchlen;
       if (MultiCmd)
         cmd_stream = *(cmd_stream_ptr = &multi_cmd_stream[(uintptr_t)next_dst & 7]);
-      if (matchlen > 16) {
-        if (matchlen > (uintptr_t)(dst_end - 8 - dst))
+      if (matchlen > 16 && (intptr_t)matchlen > dst_end - 8 - dst)
+        return false;  // no space in buf
+      // The wide copies write up to 16 bytes past the match.
+      if ((intptr_t)matchlen + 16 > dst_end - dst) {
+        if ((intptr_t)matchlen > dst_end - dst)
           return false;  // no space in buf
-        COPY_64(dst + 16, copyfrom + 16);
-        do {
-          COPY_64(dst + 24, copyfrom + 24);
-          matchlen -= 8;
-          dst += 8;
-          copyfrom += 8;
-        } while (matchlen > 24);
+        CopyExact(dst, copyfrom, matchlen);
+      } else {
+        COPY_64(dst, copyfrom);
+        COPY_64(dst + 8, copyfrom + 8);
+        if (matchlen > 16) {
+          COPY_64(dst + 16, copyfrom + 16);
+          do {
+            COPY_64(dst + 24, copyfrom + 24);
+            matchlen -= 8;
+            dst += 8;
+            copyfrom += 8;
+          } while (matchlen > 24);
+        }
       }
       dst = next_dst;
     } else {
-      COPY_64(dst, copyfrom);
+      if (dst_end - dst < 8) {
+        if ((intptr_t)matchlen > dst_end - dst)
+          return false;  // no space in buf
+        CopyExact(dst, copyfrom, matchlen);
+      } else {
+        COPY_64(dst, copyfrom);
+      }
       dst += matchlen;
       if (MultiCmd)
         cmd_stream = *(cmd_stream_ptr = &multi_cmd_stream[(uintptr_t)dst & 7]);
     }
+
+    if (offs_stream > offs_stream_end || len_stream > len_stream_end)
+      return false;
   }
 
   // check for incorrect input
@@ -3325,7 +3892,7 @@ bool Leviathan_ProcessLz(LeviathanLzTable *lzt, uint8 *dst,
   return true;
 }
 
-bool Leviathan_ProcessLzRuns(int chunk_type, byte *dst, int dst_size, int offset, LeviathanLzTable *lzt) {
+static OOZ_ALWAYS_INLINE bool Leviathan_ProcessLzRuns_Impl(int chunk_type, byte *dst, int dst_size, int offset, LeviathanLzTable *lzt) {
   uint8 *dst_cur = dst + (offset == 0 ? 8 : 0);
   uint8 *dst_end = dst + dst_size;
   uint8 *dst_start = dst - offset;
@@ -3367,13 +3934,21 @@ bool Leviathan_ProcessLzRuns(int chunk_type, byte *dst, int dst_size, int offset
   return false;
 }
 
+OOZ_MULTIVERSION(bool, Leviathan_ProcessLzRuns,
+                 (int chunk_type, byte *dst, int dst_size, int offset, LeviathanLzTable *lzt),
+                 (chunk_type, dst, dst_size, offset, lzt))
+
+bool Leviathan_ProcessLzRuns(int chunk_type, byte *dst, int dst_size, int offset, LeviathanLzTable *lzt) {
+  return Leviathan_ProcessLzRuns_Current(chunk_type, dst, dst_size, offset, lzt);
+}
+
 
 
 // Decode one 256kb big quantum block. It's divided into two 128k blocks
 // internally that are compressed separately but with a shared history.
 int Leviathan_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                             const byte *src, const byte *src_end,
-                            byte *scratch, byte *scratch_end) {
+                            byte *scratch, byte *scratch_end, KrakenPhaseRing *ring) {
   const byte *src_in = src;
   int mode, chunkhdr, dst_count, src_used, written_bytes;
 
@@ -3383,7 +3958,12 @@ int Leviathan_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
     if (src_end - src < 4)
       return -1;
     chunkhdr = src[2] | src[1] << 8 | src[0] << 16;
-    if (!(chunkhdr & 0x800000)) {
+    if (ring) {
+      // Phase 1, the chunk is read into a slot and finished by phase 2.
+      src_used = Kraken_PhaseReadChunk(ring, 12, dst, dst_count, dst - dst_start, src, src_end);
+      if (src_used < 0)
+        return -1;
+    } else if (!(chunkhdr & 0x800000)) {
       // Stored as entropy without any match copying.
       byte *out = dst;
       src_used = Kraken_DecodeBytes(&out, src, src_end, &written_bytes, dst_count, false, scratch, scratch_end);
@@ -3478,6 +4058,8 @@ bool Mermaid_ReadLzTable(int mode,
     return false;
 
   if (offset == 0) {
+    if (dst_size < 8)
+      return false;
     COPY_64(dst, src);
     dst += 8;
     src += 8;
@@ -3625,7 +4207,7 @@ bool Mermaid_ReadLzTable(int mode,
   return true;
 }
 
-const byte *Mermaid_Mode0(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *dst_start,
+static OOZ_ALWAYS_INLINE const byte *Mermaid_Mode0(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *dst_start,
                           const byte *src_end, MermaidLzTable *lz, int32 *saved_dist, size_t startoff) {
   const byte *dst_end = dst + dst_size;
   const byte *cmd_stream = lz->cmd_stream;
@@ -3645,34 +4227,100 @@ const byte *Mermaid_Mode0(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
   dst += startoff;
 
   while (cmd_stream < cmd_stream_end) {
-    uintptr_t cmd = *cmd_stream++;
-    if (cmd >= 24) {
-      intptr_t new_dist = *off16_stream;
-      uintptr_t use_distance = (uintptr_t)(cmd >> 7) - 1;
-      uintptr_t litlen = (cmd & 7);
-      COPY_64_ADD(dst, lit_stream, &dst[recent_offs]);
-      dst += litlen;
-      lit_stream += litlen;
-      recent_offs ^= use_distance & (recent_offs ^ -new_dist);
-      off16_stream = (uint16*)((uintptr_t)off16_stream + (use_distance & 2));
-      match = dst + recent_offs;
-      COPY_64(dst, match);
-      COPY_64(dst + 8, match + 8);
-      dst += (cmd >> 3) & 0xF;
-    } else if (cmd > 2) {
-      length = cmd + 5;
-
-      if (off32_stream == off32_stream_end)
+    // A short command writes at most 32 bytes and reads at most 8 literals and
+    // one near offset, so this many of them can run without the end checks.
+    // Near offsets reach back at most 64k and far offsets are checked when
+    // they are read, so past the first 64k of the window the offset check can
+    // go too. Long commands and the last few short ones take the checked path
+    // below.
+    const byte *cmd_stream_fast_end = cmd_stream;
+    if (dst - dst_start >= 0x10000) {
+      size_t n = Min(cmd_stream_end - cmd_stream, (dst_end - dst) >> 5);
+      n = Min(n, (lit_stream_end - lit_stream) >> 3);
+      n = Min(n, off16_stream_end - off16_stream);
+      cmd_stream_fast_end += n;
+    }
+    while (cmd_stream < cmd_stream_fast_end && *cmd_stream > 2) {
+      uintptr_t cmd = *cmd_stream++;
+      if (cmd >= 24) {
+        intptr_t new_dist = *off16_stream;
+        uintptr_t use_distance = (uintptr_t)(cmd >> 7) - 1;
+        uintptr_t litlen = (cmd & 7);
+        COPY_64_ADD(dst, lit_stream, &dst[recent_offs]);
+        dst += litlen;
+        lit_stream += litlen;
+        recent_offs ^= use_distance & (recent_offs ^ -new_dist);
+        off16_stream = (uint16*)((uintptr_t)off16_stream + (use_distance & 2));
+        match = dst + recent_offs;
+        COPY_64(dst, match);
+        COPY_64(dst + 8, match + 8);
+        dst += (cmd >> 3) & 0xF;
+      } else {
+        if (off32_stream == off32_stream_end)
+          return NULL;
+        match = dst_begin - *off32_stream++;
+        recent_offs = (match - dst);
+        COPY_64(dst, match);
+        COPY_64(dst + 8, match + 8);
+        COPY_64(dst + 16, match + 16);
+        COPY_64(dst + 24, match + 24);
+        dst += cmd + 5;
+        simde_mm_prefetch((char*)dst_begin - off32_stream[3], SIMDE_MM_HINT_T0);
+      }
+    }
+    if (cmd_stream == cmd_stream_end)
+      break;
+    uintptr_t cmd = *cmd_stream++;
+    if (cmd >= 24) {
+      intptr_t new_dist = *off16_stream;
+      uintptr_t use_distance = (uintptr_t)(cmd >> 7) - 1;
+      uintptr_t litlen = (cmd & 7);
+      if (dst_end - dst < 23) {
+        // The wide copies below write up to 23 bytes, this close to the end copy exactly.
+        uintptr_t matchlen = (cmd >> 3) & 0xF;
+        if (litlen + matchlen > (uintptr_t)(dst_end - dst))
+          return NULL;
+        CopyExactAdd(dst, lit_stream, &dst[recent_offs], litlen);
+        dst += litlen;
+        lit_stream += litlen;
+        recent_offs ^= use_distance & (recent_offs ^ -new_dist);
+        off16_stream = (uint16*)((uintptr_t)off16_stream + (use_distance & 2));
+        match = dst + recent_offs;
+        if ((uintptr_t)recent_offs < (uintptr_t)(dst_start - dst))
+          return NULL;  // offset out of bounds
+        CopyExact(dst, match, matchlen);
+        dst += matchlen;
+      } else {
+        COPY_64_ADD(dst, lit_stream, &dst[recent_offs]);
+        dst += litlen;
+        lit_stream += litlen;
+        recent_offs ^= use_distance & (recent_offs ^ -new_dist);
+        off16_stream = (uint16*)((uintptr_t)off16_stream + (use_distance & 2));
+        match = dst + recent_offs;
+        if ((uintptr_t)recent_offs < (uintptr_t)(dst_start - dst))
+          return NULL;  // offset out of bounds
+        COPY_64(dst, match);
+        COPY_64(dst + 8, match + 8);
+        dst += (cmd >> 3) & 0xF;
+      }
+    } else if (cmd > 2) {
+      length = cmd + 5;
+
+      if (off32_stream == off32_stream_end)
         return NULL;
       match = dst_begin - *off32_stream++;
       recent_offs = (match - dst);
 
-      if (dst_end - dst < length)
-        return NULL;
-      COPY_64(dst, match);
-      COPY_64(dst + 8, match + 8);
-      COPY_64(dst + 16, match + 16);
-      COPY_64(dst + 24, match + 24);
+      if (dst_end - dst < 32) {
+        if (dst_end - dst < length)
+          return NULL;
+        CopyExact(dst, match, length);
+      } else {
+        COPY_64(dst, match);
+        COPY_64(dst + 8, match + 8);
+        COPY_64(dst + 16, match + 16);
+        COPY_64(dst + 24, match + 24);
+      }
       dst += length;
       simde_mm_prefetch((char*)dst_begin - off32_stream[3], SIMDE_MM_HINT_T0);
     } else if (cmd == 0) {
@@ -3688,17 +4336,22 @@ const byte *Mermaid_Mode0(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
       length_stream += 1;
 
       length += 64;
-      if (dst_end - dst < length ||
-          lit_stream_end - lit_stream < length)
+      if (lit_stream_end - lit_stream < length)
         return NULL;
-
-      do {
-        COPY_64_ADD(dst, lit_stream, &dst[recent_offs]);
-        COPY_64_ADD(dst + 8, lit_stream + 8, &dst[recent_offs + 8]);
-        dst += 16;
-        lit_stream += 16;
-        length -= 16;
-      } while (length > 0);
+      // The wide copies write up to 15 bytes past the run.
+      if (dst_end - dst < length + 15) {
+        if (dst_end - dst < length)
+          return NULL;
+        CopyExactAdd(dst, lit_stream, &dst[recent_offs], length);
+      } else {
+        do {
+          COPY_64_ADD(dst, lit_stream, &dst[recent_offs]);
+          COPY_64_ADD(dst + 8, lit_stream + 8, &dst[recent_offs + 8]);
+          dst += 16;
+          lit_stream += 16;
+          length -= 16;
+        } while (length > 0);
+      }
       dst += length;
       lit_stream += length;
     } else if (cmd == 1) {
@@ -3718,13 +4371,20 @@ const byte *Mermaid_Mode0(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
         return NULL;
       match = dst - *off16_stream++;
       recent_offs = (match - dst);
-      do {
-        COPY_64(dst, match);
-        COPY_64(dst + 8, match + 8);
-        dst += 16;
-        match += 16;
-        length -= 16;
-      } while (length > 0);
+      if (dst_end - dst < length || match < dst_start)
+        return NULL;
+      // The wide copies write up to 15 bytes past the match.
+      if (dst_end - dst < length + 15) {
+        CopyExact(dst, match, length);
+      } else {
+        do {
+          COPY_64(dst, match);
+          COPY_64(dst + 8, match + 8);
+          dst += 16;
+          match += 16;
+          length -= 16;
+        } while (length > 0);
+      }
       dst += length;
     } else /* flag == 2 */ {
       if (src_end - length_stream == 0)
@@ -3742,19 +4402,30 @@ const byte *Mermaid_Mode0(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
         return NULL;
       match = dst_begin - *off32_stream++;
       recent_offs = (match - dst);
-      do {
-        COPY_64(dst, match);
-        COPY_64(dst + 8, match + 8);
-        dst += 16;
-        match += 16;
-        length -= 16;
-      } while (length > 0);
+      if (dst_end - dst < length)
+        return NULL;
+      // The wide copies write up to 15 bytes past the match.
+      if (dst_end - dst < length + 15) {
+        CopyExact(dst, match, length);
+      } else {
+        do {
+          COPY_64(dst, match);
+          COPY_64(dst + 8, match + 8);
+          dst += 16;
+          match += 16;
+          length -= 16;
+        } while (length > 0);
+      }
       dst += length;
       simde_mm_prefetch((char*)dst_begin - off32_stream[3], SIMDE_MM_HINT_T0);
     }
+    if (lit_stream > lit_stream_end || off16_stream > off16_stream_end)
+      return NULL;
   }
 
   length = dst_end - dst;
+  if (lit_stream_end - lit_stream < length)
+    return NULL;
   if (length >= 8) {
     do {
       COPY_64_ADD(dst, lit_stream, &dst[recent_offs]);
@@ -3777,7 +4448,7 @@ const byte *Mermaid_Mode0(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
   return length_stream;
 }
 
-const byte *Mermaid_Mode1(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *dst_start,
+static OOZ_ALWAYS_INLINE const byte *Mermaid_Mode1(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *dst_start,
                          const byte *src_end, MermaidLzTable *lz, int32 *saved_dist, size_t startoff) {
   const byte *dst_end = dst + dst_size;
   const byte *cmd_stream = lz->cmd_stream;
@@ -3797,20 +4468,82 @@ const byte *Mermaid_Mode1(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
   dst += startoff;
 
   while (cmd_stream < cmd_stream_end) {
+    // A short command writes at most 32 bytes and reads at most 8 literals and
+    // one near offset, so this many of them can run without the end checks.
+    // Near offsets reach back at most 64k and far offsets are checked when
+    // they are read, so past the first 64k of the window the offset check can
+    // go too. Long commands and the last few short ones take the checked path
+    // below.
+    const byte *cmd_stream_fast_end = cmd_stream;
+    if (dst - dst_start >= 0x10000) {
+      size_t n = Min(cmd_stream_end - cmd_stream, (dst_end - dst) >> 5);
+      n = Min(n, (lit_stream_end - lit_stream) >> 3);
+      n = Min(n, off16_stream_end - off16_stream);
+      cmd_stream_fast_end += n;
+    }
+    while (cmd_stream < cmd_stream_fast_end && *cmd_stream > 2) {
+      uintptr_t flag = *cmd_stream++;
+      if (flag >= 24) {
+        intptr_t new_dist = *off16_stream;
+        uintptr_t use_distance = (uintptr_t)(flag >> 7) - 1;
+        uintptr_t litlen = (flag & 7);
+        COPY_64(dst, lit_stream);
+        dst += litlen;
+        lit_stream += litlen;
+        recent_offs ^= use_distance & (recent_offs ^ -new_dist);
+        off16_stream = (uint16*)((uintptr_t)off16_stream + (use_distance & 2));
+        match = dst + recent_offs;
+        COPY_64(dst, match);
+        COPY_64(dst + 8, match + 8);
+        dst += (flag >> 3) & 0xF;
+      } else {
+        if (off32_stream == off32_stream_end)
+          return NULL;
+        match = dst_begin - *off32_stream++;
+        recent_offs = (match - dst);
+        COPY_64(dst, match);
+        COPY_64(dst + 8, match + 8);
+        COPY_64(dst + 16, match + 16);
+        COPY_64(dst + 24, match + 24);
+        dst += flag + 5;
+        simde_mm_prefetch((char*)dst_begin - off32_stream[3], SIMDE_MM_HINT_T0);
+      }
+    }
+    if (cmd_stream == cmd_stream_end)
+      break;
     uintptr_t flag = *cmd_stream++;
     if (flag >= 24) {
       intptr_t new_dist = *off16_stream;
       uintptr_t use_distance = (uintptr_t)(flag >> 7) - 1;
       uintptr_t litlen = (flag & 7);
-      COPY_64(dst, lit_stream);
-      dst += litlen;
-      lit_stream += litlen;
-      recent_offs ^= use_distance & (recent_offs ^ -new_dist);
-      off16_stream = (uint16*)((uintptr_t)off16_stream + (use_distance & 2));
-      match = dst + recent_offs;
-      COPY_64(dst, match);
-      COPY_64(dst + 8, match + 8);
-      dst += (flag >> 3) & 0xF;
+      if (dst_end - dst < 23) {
+        // The wide copies below write up to 23 bytes, this close to the end copy exactly.
+        uintptr_t matchlen = (flag >> 3) & 0xF;
+        if (litlen + matchlen > (uintptr_t)(dst_end - dst))
+          return NULL;
+        CopyExact(dst, lit_stream, litlen);
+        dst += litlen;
+        lit_stream += litlen;
+        recent_offs ^= use_distance & (recent_offs ^ -new_dist);
+        off16_stream = (uint16*)((uintptr_t)off16_stream + (use_distance & 2));
+        match = dst + recent_offs;
+        if ((uintptr_t)recent_offs < (uintptr_t)(dst_start - dst))
+          return NULL;  // offset out of bounds
+        CopyExact(dst, match, matchlen);
+        dst += matchlen;
+      } else {
+        COPY_64(dst, lit_stream);
+        dst += litlen;
+        lit_stream += litlen;
+        recent_offs ^= use_distance & (recent_offs ^ -new_dist);
+        off16_stream = (uint16*)((uintptr_t)off16_stream + (use_distance & 2));
+        match = dst + recent_offs;
+        if ((uintptr_t)recent_offs < (uintptr_t)(dst_start - dst))
+          return NULL;  // offset out of bounds
+        COPY_64(dst, match);
+        COPY_64(dst + 8, match + 8);
+        dst += (flag >> 3) & 0xF;
+      }
     } else if (flag > 2) {
       length = flag + 5;
 
@@ -3819,12 +4552,16 @@ const byte *Mermaid_Mode1(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
       match = dst_begin - *off32_stream++;
       recent_offs = (match - dst);
       
-      if (dst_end - dst < length)
-        return NULL;
-      COPY_64(dst, match);
-      COPY_64(dst + 8, match + 8);
-      COPY_64(dst + 16, match + 16);
-      COPY_64(dst + 24, match + 24);
+      if (dst_end - dst < 32) {
+        if (dst_end - dst < length)
+          return NULL;
+        CopyExact(dst, match, length);
+      } else {
+        COPY_64(dst, match);
+        COPY_64(dst + 8, match + 8);
+        COPY_64(dst + 16, match + 16);
+        COPY_64(dst + 24, match + 24);
+      }
       dst += length;
       simde_mm_prefetch((char*)dst_begin - off32_stream[3], SIMDE_MM_HINT_T0);
     } else if (flag == 0) {
@@ -3840,17 +4577,22 @@ const byte *Mermaid_Mode1(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
       length_stream += 1;
 
       length += 64;
-      if (dst_end - dst < length ||
-          lit_stream_end - lit_stream < length)
+      if (lit_stream_end - lit_stream < length)
         return NULL;
-
-      do {
-        COPY_64(dst, lit_stream);
-        COPY_64(dst + 8, lit_stream + 8);
-        dst += 16;
-        lit_stream += 16;
-        length -= 16;
-      } while (length > 0);
+      // The wide copies write up to 15 bytes past the run.
+      if (dst_end - dst < length + 15) {
+        if (dst_end - dst < length)
+          return NULL;
+        CopyExact(dst, lit_stream, length);
+      } else {
+        do {
+          COPY_64(dst, lit_stream);
+          COPY_64(dst + 8, lit_stream + 8);
+          dst += 16;
+          lit_stream += 16;
+          length -= 16;
+        } while (length > 0);
+      }
       dst += length;
       lit_stream += length;
     } else if (flag == 1) {
@@ -3870,13 +4612,20 @@ const byte *Mermaid_Mode1(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
         return NULL;
       match = dst - *off16_stream++;
       recent_offs = (match - dst);
-      do {
-        COPY_64(dst, match);
-        COPY_64(dst + 8, match + 8);
-        dst += 16;
-        match += 16;
-        length -= 16;
-      } while (length > 0);
+      if (dst_end - dst < length || match < dst_start)
+        return NULL;
+      // The wide copies write up to 15 bytes past the match.
+      if (dst_end - dst < length + 15) {
+        CopyExact(dst, match, length);
+      } else {
+        do {
+          COPY_64(dst, match);
+          COPY_64(dst + 8, match + 8);
+          dst += 16;
+          match += 16;
+          length -= 16;
+        } while (length > 0);
+      }
       dst += length;
     } else /* flag == 2 */ {
       if (src_end - length_stream == 0)
@@ -3895,21 +4644,32 @@ const byte *Mermaid_Mode1(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
         return NULL;
       match = dst_begin - *off32_stream++;
       recent_offs = (match - dst);
-      
-      do {
-        COPY_64(dst, match);
-        COPY_64(dst + 8, match + 8);
-        dst += 16;
-        match += 16;
-        length -= 16;
-      } while (length > 0);
+      if (dst_end - dst < length)
+        return NULL;
+
+      // The wide copies write up to 15 bytes past the match.
+      if (dst_end - dst < length + 15) {
+        CopyExact(dst, match, length);
+      } else {
+        do {
+          COPY_64(dst, match);
+          COPY_64(dst + 8, match + 8);
+          dst += 16;
+          match += 16;
+          length -= 16;
+        } while (length > 0);
+      }
       dst += length;
 
       simde_mm_prefetch((char*)dst_begin - off32_stream[3], SIMDE_MM_HINT_T0);
     }
+    if (lit_stream > lit_stream_end || off16_stream > off16_stream_end)
+      return NULL;
   }
 
   length = dst_end - dst;
+  if (lit_stream_end - lit_stream < length)
+    return NULL;
   if (length >= 8) {
     do {
       COPY_64(dst, lit_stream);
@@ -3931,27 +4691,30 @@ const byte *Mermaid_Mode1(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *d
   return length_stream;
 }
 
-bool Mermaid_ProcessLzRuns(int mode,
-                           const byte *src, const byte *src_end,
-                           byte *dst, size_t dst_size, uint64 offset, byte *dst_end,
-                           MermaidLzTable *lz) {
+static OOZ_ALWAYS_INLINE bool Mermaid_ProcessLzRuns_Impl(int mode,
+                                                        const byte *src, const byte *src_end,
+                                                        byte *dst, size_t dst_size, uint64 offset, byte *dst_end,
+                                                        MermaidLzTable *lz) {
   
   int iteration = 0;
   byte *dst_start = dst - offset;
   int32 saved_dist = -8;
   const byte *src_cur;
 
+  if (offset == 0 && dst_size < 8)
+    return false;
+
   for (iteration = 0; iteration != 2; iteration++) {
     size_t dst_size_cur = dst_size;
     if (dst_size_cur > 0x10000) dst_size_cur = 0x10000;
     
     if (iteration == 0) {
       lz->off32_stream = lz->off32_stream_1;
-      lz->off32_stream_end = lz->off32_stream_1 + lz->off32_size_1 * 4;
+      lz->off32_stream_end = lz->off32_stream_1 + lz->off32_size_1;
       lz->cmd_stream_end = lz->cmd_stream + lz->cmd_stream_2_offs;
     } else {
       lz->off32_stream = lz->off32_stream_2;
-      lz->off32_stream_end = lz->off32_stream_2 + lz->off32_size_2 * 4;
+      lz->off32_stream_end = lz->off32_stream_2 + lz->off32_size_2;
       lz->cmd_stream_end = lz->cmd_stream + lz->cmd_stream_2_offs_end;
       lz->cmd_stream += lz->cmd_stream_2_offs;
     }
@@ -3978,6 +4741,34 @@ bool Mermaid_ProcessLzRuns(int mode,
   return true;
 }
 
+OOZ_MULTIVERSION(bool, Mermaid_ProcessLzRuns,
+                 (int mode, const byte *src, const byte *src_end, byte *dst, size_t dst_size, uint64 offset,
+                  byte *dst_end, MermaidLzTable *lz),
+                 (mode, src, src_end, dst, dst_size, offset, dst_end, lz))
+
+bool Mermaid_ProcessLzRuns(int mode,
+                           const byte *src, const byte *src_end,
+                           byte *dst, size_t dst_size, uint64 offset, byte *dst_end,
+                           MermaidLzTable *lz) {
+  return Mermaid_ProcessLzRuns_Current(mode, src, src_end, dst, dst_size, offset, dst_end, lz);
+}
+
+// The three LZ processors are built from the same variant list, so one index
+// selects the same instruction set level in each.
+const char *Lz_KernelName(int index) { return CpuKernelName(Kraken_ProcessLzRuns_Kernels, index); }
+
+bool Lz_SelectKernel(int index) {
+  return CpuSelectKernel(Kraken_ProcessLzRuns_Kernels, index, &Kraken_ProcessLzRuns_Current) &&
+         CpuSelectKernel(Leviathan_ProcessLzRuns_Kernels, index, &Leviathan_ProcessLzRuns_Current) &&
+         CpuSelectKernel(Mermaid_ProcessLzRuns_Kernels, index, &Mermaid_ProcessLzRuns_Current);
+}
+
+void Lz_SelectDefaultKernel() {
+  Kraken_ProcessLzRuns_Current = CpuPickKernel(Kraken_ProcessLzRuns_Kernels);
+  Leviathan_ProcessLzRuns_Current = CpuPickKernel(Leviathan_ProcessLzRuns_Kernels);
+  Mermaid_ProcessLzRuns_Current = CpuPickKernel(Mermaid_ProcessLzRuns_Kernels);
+}
+
 
 int Mermaid_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                           const byte *src, const byte *src_end,
@@ -4053,18 +4844,178 @@ void Kraken_CopyWholeMatch(byte *dst, uint32 offset, size_t length) {
     dst[i] = src[i];
 }
 
+#define KRAKEN_PHASE_SLOT_SIZE (KRAKEN_SCRATCH_SIZE + 0x20000)
+#define KRAKEN_PHASE_RING_SIZE ((sizeof(KrakenPhaseRing) + 63) & ~(size_t)63)
+
+// Memory needed for a ring, its slots and the phase 2 decoder, including slack for alignment.
+size_t Kraken_PhaseMemorySize() {
+  return KRAKEN_PHASE_RING_SIZE + KRAKEN_PHASE_SLOTS * KRAKEN_PHASE_SLOT_SIZE + Kraken_MemorySize() + 63;
+}
+
+KrakenPhaseRing *Kraken_PhaseRingFromMemory(void *memory, size_t memory_size) {
+  if (memory == NULL || memory_size < Kraken_PhaseMemorySize())
+    return NULL;
+  return (KrakenPhaseRing*)(((uintptr_t)memory + 63) & ~(uintptr_t)63);
+}
+
+// Constructs an empty ring in |memory|. Must happen before either phase starts.
+KrakenPhaseRing *Kraken_PhaseRingInit(void *memory, size_t memory_size) {
+  KrakenPhaseRing *ring = Kraken_PhaseRingFromMemory(memory, memory_size);
+  if (ring == NULL)
+    return NULL;
+  return new (ring) KrakenPhaseRing{};
+}
+
+byte *Kraken_PhaseSlot(KrakenPhaseRing *ring, int i) {
+  return (byte*)ring + KRAKEN_PHASE_RING_SIZE + i * KRAKEN_PHASE_SLOT_SIZE;
+}
+
+byte *Kraken_PhaseDecoderMemory(KrakenPhaseRing *ring) {
+  return Kraken_PhaseSlot(ring, KRAKEN_PHASE_SLOTS);
+}
+
+// Times a phase checks the ring before going to sleep on it. Short waits for the
+// other phase then don't go through the scheduler, long ones don't burn a core.
+#define KRAKEN_PHASE_SPINS 64
+
+// Returns once |ready| does, first spinning and then sleeping until the other phase
+// calls Kraken_PhaseWake.
+template<typename Ready>
+void Kraken_PhaseWait(KrakenPhaseRing *ring, Ready ready) {
+  for (int i = 0; i < KRAKEN_PHASE_SPINS; i++) {
+    if (ready())
+      return;
+    std::this_thread::yield();
+  }
+  std::unique_lock<std::mutex> lock(ring->lock);
+  ring->sleepers.fetch_add(1);
+  // Pairs with the fence in Kraken_PhaseWake: either |ready| sees the change or the
+  // waker sees the sleeper.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  ring->wake.wait(lock, ready);
+  ring->sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Called after every change to the ring the other phase may be waiting for.
+void Kraken_PhaseWake(KrakenPhaseRing *ring) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (ring->sleepers.load(std::memory_order_relaxed) != 0) {
+    std::lock_guard<std::mutex> lock(ring->lock);
+    ring->wake.notify_all();
+  }
+}
+
+// Waits for a free slot. Returns NULL if phase 2 failed in the meantime.
+KrakenPhaseJob *Kraken_PhaseBeginJob(KrakenPhaseRing *ring, byte **slot) {
+  uint32 n = ring->produced.load(std::memory_order_relaxed);
+  Kraken_PhaseWait(ring, [=] {
+    return n - ring->consumed.load(std::memory_order_acquire) < KRAKEN_PHASE_SLOTS ||
+           ring->failed.load(std::memory_order_relaxed);
+  });
+  if (n - ring->consumed.load(std::memory_order_acquire) >= KRAKEN_PHASE_SLOTS)
+    return NULL;
+  *slot = Kraken_PhaseSlot(ring, n % KRAKEN_PHASE_SLOTS);
+  return &ring->jobs[n % KRAKEN_PHASE_SLOTS];
+}
+
+void Kraken_PhaseCommitJob(KrakenPhaseRing *ring) {
+  ring->produced.fetch_add(1, std::memory_order_release);
+  Kraken_PhaseWake(ring);
+}
+
+// Phase 1 of a single 128k chunk of a Kraken or Leviathan quantum. LZ tables are
+// read into the slot, entropy only chunks are decoded into it. Returns the number
+// of source bytes used, or -1 on error.
+int Kraken_PhaseReadChunk(KrakenPhaseRing *ring, int decoder_type, byte *dst, int dst_count, int offset,
+                          const byte *src, const byte *src_end) {
+  byte *scratch, *scratch_end;
+  int chunkhdr, mode, src_used, written_bytes;
+  KrakenPhaseJob *job = Kraken_PhaseBeginJob(ring, &scratch);
+  if (!job)
+    return -1;
+  scratch_end = scratch + KRAKEN_PHASE_SLOT_SIZE;
+  job->decoder_type = decoder_type;
+  job->offset = offset;
+  job->dst_count = dst_count;
+
+  chunkhdr = src[2] | src[1] << 8 | src[0] << 16;
+  if (!(chunkhdr & 0x800000)) {
+    // Stored as entropy without any match copying. This may leave |out| pointing into |src|.
+    byte *out = scratch;
+    src_used = Kraken_DecodeBytes(&out, src, src_end, &written_bytes, dst_count, false, scratch + 0x20000, scratch_end);
+    if (src_used < 0 || written_bytes != dst_count)
+      return -1;
+    job->kind = kPhaseJob_Copy;
+    job->src = out;
+  } else {
+    src += 3;
+    src_used = chunkhdr & 0x7FFFF;
+    mode = (chunkhdr >> 19) & 0xF;
+    if (src_end - src < src_used)
+      return -1;
+    if (src_used < dst_count) {
+      int scratch_usage = Min(3 * dst_count + 32 + 0xd000, 0x6C000);
+      if (decoder_type == 6) {
+        if (!Kraken_ReadLzTable(mode, src, src + src_used, dst, dst_count, offset,
+                                scratch + sizeof(KrakenLzTable), scratch + scratch_usage, (KrakenLzTable*)scratch))
+          return -1;
+      } else {
+        if (!Leviathan_ReadLzTable(mode, src, src + src_used, dst, dst_count, offset,
+                                   scratch + sizeof(LeviathanLzTable), scratch + scratch_usage, (LeviathanLzTable*)scratch))
+          return -1;
+      }
+      job->kind = kPhaseJob_Lz;
+      job->mode = mode;
+    } else if (src_used > dst_count || mode != 0) {
+      return -1;
+    } else {
+      job->kind = kPhaseJob_Copy;
+      job->src = src;
+    }
+    src_used += 3;
+  }
+  Kraken_PhaseCommitJob(ring);
+  return src_used;
+}
+
+// Phase 1 of a quantum that has to be decoded in output order, it's handed to
+// phase 2 as it is.
+bool Kraken_PhaseDeferStep(KrakenPhaseRing *ring, KrakenDecoder *dec, int offset, int dst_count,
+                           const byte *src, const byte *src_end) {
+  byte *slot;
+  KrakenPhaseJob *job = Kraken_PhaseBeginJob(ring, &slot);
+  if (!job)
+    return false;
+  job->kind = kPhaseJob_Step;
+  job->offset = offset;
+  job->dst_count = dst_count;
+  job->src = src;
+  job->src_end = src_end;
+  job->hdr = dec->hdr;
+  Kraken_PhaseCommitJob(ring);
+  dec->src_used = src_end - src;
+  dec->dst_used = dst_count;
+  return true;
+}
+
+// Decodes the next quantum. With a |ring| only phase 1 is done and the rest is
+// queued for |Kraken_DecodePhase2|.
 bool Kraken_DecodeStep(struct KrakenDecoder *dec,
                        byte *dst_start, int offset, size_t dst_bytes_left_in,
-                       const byte *src, size_t src_bytes_left) {
+                       const byte *src, size_t src_bytes_left, KrakenPhaseRing *ring = NULL) {
   const byte *src_in = src;
   const byte *src_end = src + src_bytes_left;
   KrakenQuantumHeader qhdr;
   int n;
 
   if ((offset & 0x3FFFF) == 0) {
-    src = Kraken_ParseHeader(&dec->hdr, src);
+    src = Kraken_ParseHeader(&dec->hdr, src, src_end);
     if (!src)
       return false;
+    if (src > src_end) {
+      dec->src_used = dec->dst_used = 0;
+      return true;
+    }
   }
 
   bool is_kraken_decoder = (dec->hdr.decoder_type == 6 || dec->hdr.decoder_type == 10 || dec->hdr.decoder_type == 12);
@@ -4076,6 +5027,8 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
       dec->src_used = dec->dst_used = 0;
       return true;
     }
+    if (ring)
+      return Kraken_PhaseDeferStep(ring, dec, offset, dst_bytes_left, src_in, src + dst_bytes_left);
     memmove(dst_start + offset, src, dst_bytes_left);
     dec->src_used = (src - src_in) + dst_bytes_left;
     dec->dst_used = dst_bytes_left;
@@ -4083,14 +5036,20 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
   }
 
   if (is_kraken_decoder) {
-    src = Kraken_ParseQuantumHeader(&qhdr, src, dec->hdr.use_checksums);
+    src = Kraken_ParseQuantumHeader(&qhdr, src, src_end, dec->hdr.use_checksums);
   } else {
-    src = LZNA_ParseQuantumHeader(&qhdr, src, dec->hdr.use_checksums, dst_bytes_left);
+    src = LZNA_ParseQuantumHeader(&qhdr, src, src_end, dec->hdr.use_checksums, dst_bytes_left);
   }
 
-  if (!src || src > src_end)
+  if (!src)
     return false;
 
+  // Header cut off, wait for more input.
+  if (src > src_end) {
+    dec->src_used = dec->dst_used = 0;
+    return true;
+  }
+
   // Too few bytes in buffer to make any progress?
   if ((uintptr_t)(src_end - src) < qhdr.compressed_size) {
     dec->src_used = dec->dst_used = 0;
@@ -4101,6 +5060,8 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
     return false;
 
   if (qhdr.compressed_size == 0) {
+    if (ring)
+      return Kraken_PhaseDeferStep(ring, dec, offset, dst_bytes_left, src_in, src);
     if (qhdr.whole_match_distance != 0) {
       if (qhdr.whole_match_distance > (uint32)offset)
         return false;
@@ -4117,6 +5078,9 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
      (Kraken_GetCrc(src, qhdr.compressed_size) & 0xFFFFFF) != qhdr.checksum)
     return false;
 
+  if (ring && (qhdr.compressed_size == dst_bytes_left || (dec->hdr.decoder_type != 6 && dec->hdr.decoder_type != 12)))
+    return Kraken_PhaseDeferStep(ring, dec, offset, dst_bytes_left, src_in, src + qhdr.compressed_size);
+
   if (qhdr.compressed_size == dst_bytes_left) {
     memmove(dst_start + offset, src, dst_bytes_left);
     dec->src_used = (src - src_in) + dst_bytes_left;
@@ -4124,14 +5088,21 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
     return true;
   }
 
+  // The other decoders use the scratch for temporaries.
+  if (dec->hdr.decoder_type != 5 && dec->hdr.decoder_type != 11)
+    dec->scratch_owner = 0;
+
   if (dec->hdr.decoder_type == 6) {
     n = Kraken_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left, dst_start,
                          src, src + qhdr.compressed_size,
-                         dec->scratch, dec->scratch + dec->scratch_size);
+                         dec->scratch, dec->scratch + dec->scratch_size, ring);
   } else if (dec->hdr.decoder_type == 5) {
     if (dec->hdr.restart_decoder) {
       dec->hdr.restart_decoder = false;
       LZNA_InitLookup((struct LznaState*)dec->scratch);
+      dec->scratch_owner = 5;
+    } else if (dec->scratch_owner != 5) {
+      return false;
     }
     n = LZNA_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left, dst_start,
                               src, src + qhdr.compressed_size,
@@ -4140,6 +5111,9 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
     if (dec->hdr.restart_decoder) {
       dec->hdr.restart_decoder = false;
       BitknitState_Init((struct BitknitState*)dec->scratch);
+      dec->scratch_owner = 11;
+    } else if (dec->scratch_owner != 11) {
+      return false;
     }
     n = (int)Bitknit_Decode(src, src + qhdr.compressed_size, dst_start + offset, dst_start + offset + dst_bytes_left, dst_start, (struct BitknitState*)dec->scratch);
 
@@ -4150,7 +5124,7 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
   } else if (dec->hdr.decoder_type == 12) {
     n = Leviathan_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left, dst_start,
                                 src, src + qhdr.compressed_size,
-                                dec->scratch, dec->scratch + dec->scratch_size);
+                                dec->scratch, dec->scratch + dec->scratch_size, ring);
   } else {
     return false;
   }
@@ -4163,85 +5137,579 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec,
   return true;
 }
 
-int Kraken_Decompress(const byte *src, size_t src_len, byte *dst, size_t dst_len) {
-  KrakenDecoder *dec = Kraken_Create();
-  int offset = 0;
+// Decompresses a whole stream using an existing decoder, which may be reused afterwards.
+// With |history| the stream is decoded after that many bytes at |dst|, which it
+// may reference, and must be a multiple of 256k. Returns the bytes decoded.
+int Kraken_DecompressWith(KrakenDecoder *dec, const byte *src, size_t src_len, byte *dst, size_t dst_len,
+                          int history = 0) {
+  int offset = history;
   while (dst_len != 0) {
     if (!Kraken_DecodeStep(dec, dst, offset, dst_len, src, src_len))
-      goto FAIL;
+      return -1;
     if (dec->src_used == 0)
-      goto FAIL;
+      return -1;
     src += dec->src_used;
     src_len -= dec->src_used;
     dst_len -= dec->dst_used;
     offset += dec->dst_used;
   }
   if (src_len != 0)
-    goto FAIL;
+    return -1;
+  return offset - history;
+}
+
+int Kraken_Decompress(const byte *src, size_t src_len, byte *dst, size_t dst_len) {
+  KrakenDecoder *dec = Kraken_Create();
+  int result = Kraken_DecompressWith(dec, src, src_len, dst, dst_len);
   Kraken_Destroy(dec);
-  return offset;
+  return result;
+}
+
+// Runs phase 1 over a whole stream, queueing the jobs for |Kraken_DecodePhase2|.
+bool Kraken_DecodePhase1(KrakenPhaseRing *ring, const byte *src, size_t src_len, byte *dst, size_t dst_len) {
+  KrakenDecoder dec;
+  memset(&dec, 0, sizeof(dec));
+  int offset = 0;
+  while (dst_len != 0) {
+    if (!Kraken_DecodeStep(&dec, dst, offset, dst_len, src, src_len, ring) || dec.src_used == 0)
+      goto FAIL;
+    src += dec.src_used;
+    src_len -= dec.src_used;
+    dst_len -= dec.dst_used;
+    offset += dec.dst_used;
+  }
+  if (src_len != 0)
+    goto FAIL;
+  ring->finished.store(1, std::memory_order_release);
+  Kraken_PhaseWake(ring);
+  return true;
 FAIL:
-  Kraken_Destroy(dec);
-  return -1;
+  ring->failed.store(1);
+  Kraken_PhaseWake(ring);
+  return false;
 }
 
-extern "C" {
-    OOZ_DLL_PUBLIC int Ooz_Decompress(uint8_t const* src_buf, int src_len, uint8_t* dst, size_t dst_size,
-        int, int, int, uint8_t*, size_t, void*, void*, void*, size_t, int) {
-        return Kraken_Decompress(src_buf, src_len, dst, dst_size);
+bool Kraken_PhaseRunJob(KrakenDecoder *dec, KrakenPhaseJob *job, byte *slot, byte *dst_start, int *hdr_block) {
+  byte *dst = dst_start + job->offset;
+  switch (job->kind) {
+  case kPhaseJob_Lz:
+    if (job->decoder_type == 6)
+      return Kraken_ProcessLzRuns(job->mode, dst, job->dst_count, job->offset, (KrakenLzTable*)slot);
+    return Leviathan_ProcessLzRuns(job->mode, dst, job->dst_count, job->offset, (LeviathanLzTable*)slot);
+  case kPhaseJob_Copy:
+    memmove(dst, job->src, job->dst_count);
+    return true;
+  case kPhaseJob_Step:
+    // A step in the middle of a block needs the header phase 1 read at its start,
+    // unless this decoder parsed it itself on an earlier step.
+    if ((job->offset & 0x3FFFF) != 0 && (job->offset >> 18) != *hdr_block)
+      dec->hdr = job->hdr;
+    *hdr_block = job->offset >> 18;
+    if (!Kraken_DecodeStep(dec, dst_start, job->offset, job->dst_count, job->src, job->src_end - job->src))
+      return false;
+    return dec->src_used == job->src_end - job->src && dec->dst_used == job->dst_count;
+  }
+  return false;
+}
+
+// Runs phase 2, consuming jobs until phase 1 is finished.
+bool Kraken_DecodePhase2(KrakenPhaseRing *ring, byte *dst) {
+  KrakenDecoder *dec = Kraken_CreateInPlace(Kraken_PhaseDecoderMemory(ring), Kraken_MemorySize());
+  int hdr_block = -1;
+  for (uint32 n = 0; ; n++) {
+    Kraken_PhaseWait(ring, [=] {
+      return ring->produced.load(std::memory_order_acquire) != n ||
+             ring->failed.load(std::memory_order_relaxed) ||
+             ring->finished.load(std::memory_order_acquire);
+    });
+    // Phase 1 sets |finished| after its last commit, so no more jobs are coming.
+    if (ring->produced.load(std::memory_order_acquire) == n)
+      return !ring->failed.load();
+    int i = n % KRAKEN_PHASE_SLOTS;
+    if (!Kraken_PhaseRunJob(dec, &ring->jobs[i], Kraken_PhaseSlot(ring, i), dst, &hdr_block)) {
+      ring->failed.store(1);
+      Kraken_PhaseWake(ring);
+      return false;
     }
+    ring->consumed.store(n + 1, std::memory_order_release);
+    Kraken_PhaseWake(ring);
+  }
 }
 
-// The decompressor will write outside of the target buffer.
-#define SAFE_SPACE 64
+// Threads that run phase 1 for Kraken_DecompressThreaded. One is only started when
+// all the others are busy, and afterwards waits for the next job instead of exiting,
+// so decoding stream after stream doesn't create a thread per call. The pool is
+// never destroyed as its threads live until the process exits.
+struct KrakenWorkerPool {
+  std::mutex lock;
+  std::condition_variable wake;
+  std::vector<std::function<void()>> jobs;
+  int idle = 0;
+};
 
-#if !OOZ_BUILD_DLL
+void Kraken_RunOnWorker(std::function<void()> job) {
+  static KrakenWorkerPool *pool = new KrakenWorkerPool;
+  std::lock_guard<std::mutex> lock(pool->lock);
+  pool->jobs.push_back(std::move(job));
+  if (pool->idle >= (int)pool->jobs.size()) {
+    pool->wake.notify_one();
+    return;
+  }
+  std::thread([] {
+    std::unique_lock<std::mutex> lock(pool->lock);
+    for (;;) {
+      pool->idle++;
+      pool->wake.wait(lock, [] { return !pool->jobs.empty(); });
+      pool->idle--;
+      std::function<void()> job = std::move(pool->jobs.back());
+      pool->jobs.pop_back();
+      lock.unlock();
+      job();
+      lock.lock();
+    }
+  }).detach();
+}
 
-void error(const char *s, const char *curfile = NULL) {
-  if (curfile)
-    fprintf(stderr, "%s: ", curfile);
-  fprintf(stderr, "%s\n", s);
-  exit(1);
+// Decompresses with phase 1 on a pooled worker thread and phase 2 on the calling thread.
+int Kraken_DecompressThreaded(const byte *src, size_t src_len, byte *dst, size_t dst_len) {
+  size_t memory_size = Kraken_PhaseMemorySize();
+  void *memory = MallocAligned(memory_size, 64);
+  KrakenPhaseRing *ring = Kraken_PhaseRingInit(memory, memory_size);
+  std::mutex done_lock;
+  std::condition_variable done_wake;
+  bool done = false;
+  Kraken_RunOnWorker([&] {
+    Kraken_DecodePhase1(ring, src, src_len, dst, dst_len);
+    std::lock_guard<std::mutex> lock(done_lock);
+    done = true;
+    done_wake.notify_one();
+  });
+  bool ok = Kraken_DecodePhase2(ring, dst);
+  {
+    // Phase 1 may still be queueing a job when phase 2 fails, and uses |ring| until it returns.
+    std::unique_lock<std::mutex> lock(done_lock);
+    done_wake.wait(lock, [&] { return done; });
+  }
+  ok = ok && !ring->failed.load();
+  FreeAligned(memory);
+  return ok ? (int)dst_len : -1;
 }
 
+// Slack allocated past the end of buffers. This decoder stays inside its output but
+// an Oodle DLL used with --dll writes up to this far past it.
+#define SAFE_SPACE 64
+
+// Push mode decoding. Compressed input is buffered until a whole step has arrived
+// and output is decoded into a window that keeps at least |history| bytes behind the
+// current block for matches. The window only slides by whole 256k blocks, so block
+// headers and the literal modes that depend on the stream position see the same
+// offsets as in a flat decode.
+#define KRAKEN_STREAM_BLOCK 0x40000
+#define KRAKEN_STREAM_INPUT_SIZE (KRAKEN_STREAM_BLOCK + 0x100)
+
+struct KrakenStream {
+  KrakenDecoder *dec;
+  int64 raw_size;       // Decompressed size of the whole stream.
+  int64 window_pos;     // Stream position of |window[0]|.
+  byte *window;
+  size_t history;       // Bytes of output kept for matches when sliding.
+  size_t window_size;   // Usable bytes in |window|, not counting the decoder's overrun.
+  size_t decoded, drained;
+  byte *input;
+  size_t input_start, input_end;
+  bool failed;
+};
 
-byte *load_file(const char *filename, int *size) {
-  FILE *f = fopen(filename, "rb");
-  if (!f) error("file open error", filename);
-  fseek(f, 0, SEEK_END);
-  int packed_size = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  byte *input = new byte[packed_size];
-  if (!input) error("memory error", filename);
-  if (fread(input, 1, packed_size, f) != packed_size) error("error reading", filename);
-  fclose(f);
-  *size = packed_size;
-  return input;
+void Kraken_StreamDestroy(KrakenStream *s) {
+  if (s) {
+    Kraken_Destroy(s->dec);
+    delete[] s->window;
+    delete[] s->input;
+    delete s;
+  }
 }
 
-enum {
-  kCompressor_Kraken = 8,
-  kCompressor_Mermaid = 9,
-  kCompressor_Selkie = 11,
-  kCompressor_Hydra = 12,
-  kCompressor_Leviathan = 13,
-};
+// |history| of 0 keeps the whole output. The window has room for twice the history
+// so sliding copies each byte about once.
+KrakenStream *Kraken_StreamCreate(int64 raw_size, size_t history) {
+  if (raw_size < 0)
+    return NULL;
+  int64 window_size = raw_size;
+  if (history != 0) {
+    history = (Max(history, KRAKEN_STREAM_BLOCK) + KRAKEN_STREAM_BLOCK - 1) & ~(size_t)(KRAKEN_STREAM_BLOCK - 1);
+    int64 max_size = (int64)history * 2 + KRAKEN_STREAM_BLOCK;
+    if (window_size > max_size)
+      window_size = max_size;
+  }
+  // |Kraken_DecodeStep| takes int offsets.
+  if (window_size > 0x7FFFFFFF - SAFE_SPACE)
+    return NULL;
+  KrakenStream *s = new KrakenStream();
+  s->dec = Kraken_Create();
+  s->raw_size = raw_size;
+  s->history = history;
+  s->window_size = (size_t)window_size;
+  s->window = new byte[s->window_size + SAFE_SPACE];
+  s->input = new byte[KRAKEN_STREAM_INPUT_SIZE + SAFE_SPACE];
+  return s;
+}
 
-bool arg_stdout, arg_force, arg_quiet, arg_dll;
-int arg_compressor = kCompressor_Kraken, arg_level = 4;
-char arg_direction;
-const char *verifyfolder;
+// Decodes as many steps as the buffered input and the free window space allow.
+bool Kraken_StreamDecode(KrakenStream *s) {
+  while (!s->failed && s->window_pos + (int64)s->decoded < s->raw_size) {
+    size_t left = (size_t)(s->raw_size - s->window_pos - (int64)s->decoded);
+    if (s->decoded + Min(left, KRAKEN_STREAM_BLOCK) > s->window_size) {
+      size_t shift = (s->decoded - s->history) & ~(size_t)(KRAKEN_STREAM_BLOCK - 1);
+      if (s->drained < shift)
+        break;
+      memmove(s->window, s->window + shift, s->decoded - shift);
+      s->window_pos += shift;
+      s->decoded -= shift;
+      s->drained -= shift;
+    }
+    if (!Kraken_DecodeStep(s->dec, s->window, (int)s->decoded, left,
+                           s->input + s->input_start, s->input_end - s->input_start)) {
+      s->failed = true;
+      break;
+    }
+    if (s->dec->src_used == 0)
+      break;
+    s->input_start += s->dec->src_used;
+    s->decoded += s->dec->dst_used;
+  }
+  return !s->failed;
+}
 
-int ParseCmdLine(int argc, char *argv[]) {
-  int i;
-  // parse command line
-  for (i = 1; i < argc; i++) {
-    const char *s = argv[i];
-    char c;
-    if (*s != '-')
+int Kraken_StreamFeed(KrakenStream *s, const byte *src, size_t src_len) {
+  size_t taken = 0;
+  while (!s->failed) {
+    if (s->input_start != 0) {
+      memmove(s->input, s->input + s->input_start, s->input_end - s->input_start);
+      s->input_end -= s->input_start;
+      s->input_start = 0;
+    }
+    size_t n = Min(src_len - taken, KRAKEN_STREAM_INPUT_SIZE - s->input_end);
+    memcpy(s->input + s->input_end, src + taken, n);
+    s->input_end += n;
+    taken += n;
+    if (!Kraken_StreamDecode(s) || s->input_start == 0 || taken == src_len)
       break;
-    if (*++s == '-') {
-      if (*++s == 0) {
+  }
+  // A full input buffer that can't be decoded means the window is waiting to be drained,
+  // unless the next step is larger than any valid step.
+  if (!s->failed && s->input_start == 0 && s->input_end == KRAKEN_STREAM_INPUT_SIZE &&
+      s->drained == s->decoded)
+    s->failed = true;
+  return s->failed ? -1 : (int)taken;
+}
+
+int Kraken_StreamDrain(KrakenStream *s, byte *dst, size_t dst_size) {
+  size_t total = 0;
+  while (!s->failed) {
+    size_t n = Min(dst_size - total, s->decoded - s->drained);
+    memcpy(dst + total, s->window + s->drained, n);
+    s->drained += n;
+    total += n;
+    // Draining may have freed the window space the next step was waiting for.
+    size_t decoded = s->decoded;
+    if (total == dst_size || !Kraken_StreamDecode(s) || s->decoded == decoded)
+      break;
+  }
+  return s->failed ? -1 : (int)total;
+}
+
+int Kraken_StreamFinish(KrakenStream *s) {
+  if (s->failed)
+    return -1;
+  if (s->window_pos + (int64)s->drained < s->raw_size)
+    return 0;
+  return s->input_start == s->input_end ? 1 : -1;
+}
+
+extern "C" {
+    OOZ_DLL_PUBLIC int Ooz_Decompress(uint8_t const* src_buf, int src_len, uint8_t* dst, size_t dst_size,
+        int, int, int, uint8_t*, size_t, void*, void*, void* decoderMemory, size_t decoderMemorySize, int threadPhase) {
+        if (threadPhase == OOZ_THREADPHASE_1 || threadPhase == OOZ_THREADPHASE_2) {
+            KrakenPhaseRing *ring = Kraken_PhaseRingFromMemory(decoderMemory, decoderMemorySize);
+            if (ring == NULL)
+                return -1;
+            bool ok = threadPhase == OOZ_THREADPHASE_1 ? Kraken_DecodePhase1(ring, src_buf, src_len, dst, dst_size)
+                                                       : Kraken_DecodePhase2(ring, dst);
+            return ok ? (int)dst_size : -1;
+        }
+        // Use the caller's decoder memory when it is large enough so repeated calls don't hit the heap.
+        if (decoderMemory != NULL) {
+            KrakenDecoder *dec = Kraken_CreateInPlace(decoderMemory, decoderMemorySize);
+            if (dec != NULL)
+                return Kraken_DecompressWith(dec, src_buf, src_len, dst, dst_size);
+        }
+        return Kraken_Decompress(src_buf, src_len, dst, dst_size);
+    }
+
+    OOZ_DLL_PUBLIC int Ooz_IsFuzzSafe(void) {
+        return 1;
+    }
+
+    OOZ_DLL_PUBLIC int Ooz_IsExactBounds(void) {
+        return 1;
+    }
+
+    OOZ_DLL_PUBLIC size_t Ooz_DecoderMemorySize(void) {
+        return Kraken_MemorySize();
+    }
+
+    OOZ_DLL_PUBLIC OozDecoder *Ooz_DecoderCreate(void *memory, size_t memory_size) {
+        if (memory == NULL)
+            return (OozDecoder*)Kraken_Create();
+        return (OozDecoder*)Kraken_CreateInPlace(memory, memory_size);
+    }
+
+    OOZ_DLL_PUBLIC void Ooz_DecoderDestroy(OozDecoder *dec) {
+        Kraken_Destroy((KrakenDecoder*)dec);
+    }
+
+    OOZ_DLL_PUBLIC size_t Ooz_ThreadPhaseMemorySize(void) {
+        return Kraken_PhaseMemorySize();
+    }
+
+    OOZ_DLL_PUBLIC int Ooz_ThreadPhaseInit(void *memory, size_t memory_size) {
+        return Kraken_PhaseRingInit(memory, memory_size) ? 0 : -1;
+    }
+
+    OOZ_DLL_PUBLIC int Ooz_DecompressThreaded(uint8_t const *src, size_t src_len, uint8_t *dst, size_t dst_size) {
+        return Kraken_DecompressThreaded(src, src_len, dst, dst_size);
+    }
+
+    OOZ_DLL_PUBLIC int Ooz_DecoderDecompress(OozDecoder *dec, uint8_t const *src, size_t src_len, uint8_t *dst, size_t dst_size) {
+        if (dec == NULL)
+            return -1;
+        return Kraken_DecompressWith((KrakenDecoder*)dec, src, src_len, dst, dst_size);
+    }
+
+    OOZ_DLL_PUBLIC int Ooz_DecoderDecompressDict(OozDecoder *dec, const OozDictionary *dict, uint8_t const *src,
+                                                 size_t src_len, uint8_t *dst, size_t dst_size) {
+        if (dec == NULL || dict == NULL)
+            return -1;
+        KrakenDecoder *kraken = (KrakenDecoder*)dec;
+        byte *window = PresetDict_Window(&kraken->dict_window, dict, dst_size);
+        if (window == NULL)
+            return -1;
+        int offset = (int)PresetDict_DataOffset(dict);
+        int n = Kraken_DecompressWith(kraken, src, src_len, window, dst_size, offset);
+        if (n > 0)
+            memcpy(dst, window + offset, n);
+        return n;
+    }
+
+    OOZ_DLL_PUBLIC OozStream *Ooz_StreamCreate(int64_t raw_size, size_t window_size) {
+        return (OozStream*)Kraken_StreamCreate(raw_size, window_size);
+    }
+
+    OOZ_DLL_PUBLIC void Ooz_StreamDestroy(OozStream *s) {
+        Kraken_StreamDestroy((KrakenStream*)s);
+    }
+
+    OOZ_DLL_PUBLIC int Ooz_StreamFeed(OozStream *s, uint8_t const *src, size_t src_len) {
+        if (s == NULL || src_len > 0x7FFFFFFF)
+            return -1;
+        return Kraken_StreamFeed((KrakenStream*)s, src, src_len);
+    }
+
+    OOZ_DLL_PUBLIC int Ooz_StreamDrain(OozStream *s, uint8_t *dst, size_t dst_size) {
+        if (s == NULL || dst_size > 0x7FFFFFFF)
+            return -1;
+        return Kraken_StreamDrain((KrakenStream*)s, dst, dst_size);
+    }
+
+    OOZ_DLL_PUBLIC int Ooz_StreamFinish(OozStream *s) {
+        if (s == NULL)
+            return -1;
+        return Kraken_StreamFinish((KrakenStream*)s);
+    }
+}
+
+
+#if !OOZ_BUILD_DLL
+
+void error(const char *s, const char *curfile = NULL) {
+  if (curfile)
+    fprintf(stderr, "%s: ", curfile);
+  fprintf(stderr, "%s\n", s);
+  exit(1);
+}
+
+
+// Prints an error for |curfile| and returns false, for errors that only stop
+// the current file.
+bool file_error(const char *s, const char *curfile) {
+  fprintf(stderr, "%s: %s\n", curfile, s);
+  return false;
+}
+
+// Read only view of a whole file. Files are mapped rather than read, so only the
+// pages in use have to be resident however large the file is.
+struct MappedFile {
+  const byte *data = NULL;
+  int64 size = 0;
+  // Bytes at the start dropped by Release.
+  int64 released = 0;
+#if defined(_MSC_VER)
+  HANDLE mapping = NULL;
+#endif
+
+  MappedFile() {}
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() { Close(); }
+
+  bool Open(const char *filename) {
+#if defined(_MSC_VER)
+    HANDLE h = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+      return file_error("file open error", filename);
+    LARGE_INTEGER file_size;
+    bool ok = GetFileSizeEx(h, &file_size) != 0;
+    size = ok ? file_size.QuadPart : 0;
+    if (ok && size != 0) {
+      mapping = CreateFileMappingA(h, NULL, PAGE_READONLY, 0, 0, NULL);
+      data = mapping ? (const byte*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+      ok = data != NULL;
+    }
+    CloseHandle(h);
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+      return file_error("file open error", filename);
+    struct stat sb;
+    bool ok = fstat(fd, &sb) == 0;
+    size = ok ? sb.st_size : 0;
+    if (ok && size != 0) {
+      void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ok = p != MAP_FAILED;
+      if (ok) {
+        madvise(p, size, MADV_SEQUENTIAL);
+        data = (const byte*)p;
+      }
+    }
+    close(fd);
+#endif
+    if (!ok) {
+      Close();
+      return file_error("error reading", filename);
+    }
+    if (size == 0)
+      data = (const byte*)"";
+    return true;
+  }
+
+  void Close() {
+#if defined(_MSC_VER)
+    if (mapping) {
+      UnmapViewOfFile(data);
+      CloseHandle(mapping);
+    }
+    mapping = NULL;
+#else
+    if (data && size != 0)
+      munmap((void*)data, size);
+#endif
+    data = NULL;
+    size = 0;
+    released = 0;
+  }
+
+  // Drops the pages before |end| from memory once they won't be read again.
+  // Sequential passes then keep a bounded part of the file resident.
+  void Release(int64 end) {
+#if !defined(_MSC_VER)
+    end = std::min(end, size) & ~(int64)0xFFFF;
+    if (end > released) {
+      madvise((void*)(data + released), end - released, MADV_DONTNEED);
+      released = end;
+    }
+#endif
+  }
+};
+
+enum {
+  kCompressor_Kraken = 8,
+  kCompressor_Mermaid = 9,
+  kCompressor_Selkie = 11,
+  kCompressor_Hydra = 12,
+  kCompressor_Leviathan = 13,
+};
+
+bool arg_stdout, arg_force, arg_quiet, arg_dll, arg_crc;
+int arg_compressor = kCompressor_Kraken, arg_level = 4;
+int arg_seekable;  // chunk size, 0 for a plain stream
+int arg_threads = 1;  // compression threads per file, 0 for one per core
+int arg_jobs;  // files processed at once with -j, 0 without it
+int64 arg_mem = 1024 << 20;  // input bytes worked on at once with -j
+char arg_direction;
+const char *arg_calibrate;  // cost profile to fit to this machine and write
+const char *arg_cost_profile;  // cost profile to compress with
+int cost_platforms;  // the profile read from it
+bool arg_selftest;
+int arg_match_finder = OOZ_MATCH_FINDER_DEFAULT;  // at levels 5 and up
+const char *verifyfolder;
+
+// Benchmark settings. Each -m adds a codec to the matrix benchmarked with -bz,
+// and each --match-finder a match finder.
+bool arg_bench;
+int arg_iters = 5, arg_warmup = 1;
+const char *arg_json;
+int arg_codecs[8], arg_num_codecs;
+int arg_match_finders[8], arg_num_match_finders;
+int arg_levels[32], arg_num_levels;
+
+// Parses a list of levels such as "1,4-6" into |arg_levels|.
+static bool ParseLevels(const char *s) {
+  arg_num_levels = 0;
+  while (*s) {
+    char *end;
+    int lo = strtol(s, &end, 10), hi = lo;
+    if (end == s)
+      return false;
+    s = end;
+    if (*s == '-') {
+      hi = strtol(s + 1, &end, 10);
+      if (end == s + 1)
+        return false;
+      s = end;
+    }
+    for (int level = lo; level <= hi; level++) {
+      if (arg_num_levels == 32 || level < -4 || level > 10)
+        return false;
+      arg_levels[arg_num_levels++] = level;
+    }
+    if (*s == ',')
+      s++;
+    else if (*s)
+      return false;
+  }
+  return arg_num_levels > 0;
+}
+
+// The name --match-finder takes for an OOZ_MATCH_FINDER_* value.
+static const char *MatchFinderName(int match_finder) {
+  switch (match_finder) {
+  case OOZ_MATCH_FINDER_DEFAULT: return "default";
+  case OOZ_MATCH_FINDER_SUFFIX_ARRAY: return "sa";
+  case OOZ_MATCH_FINDER_BINARY_TREE: return "bt";
+  default: return "unknown";
+  }
+}
+
+int ParseCmdLine(int argc, char *argv[]) {
+  int i;
+  // parse command line
+  for (i = 1; i < argc; i++) {
+    const char *s = argv[i];
+    char c;
+    if (*s != '-')
+      break;
+    if (*++s == '-') {
+      if (*++s == 0) {
         i++;
         break;  // --
       }
@@ -4258,6 +5726,17 @@ int ParseCmdLine(int argc, char *argv[]) {
       } else if (!strcmp(s, "dll")) {
         arg_dll = true;
         continue;
+      } else if (!strcmp(s, "crc")) {
+        arg_crc = true;
+        continue;
+      } else if (!strcmp(s, "seekable")) {
+        arg_seekable = 0x40000;
+        continue;
+      } else if (!strncmp(s, "seekable=", 9)) {
+        arg_seekable = atoi(s + 9);
+        if (arg_seekable < kSeekableMinChunk || arg_seekable > kSeekableMaxChunk || (arg_seekable & (arg_seekable - 1)))
+          return -1;
+        continue;
       } else if (!strcmp(s, "kraken")) s = "mk";
       else if (!strcmp(s, "mermaid")) s = "mm";
       else if (!strcmp(s, "selkie")) s = "ms";
@@ -4266,6 +5745,57 @@ int ParseCmdLine(int argc, char *argv[]) {
       else if (!strncmp(s, "level=", 6)) {
         arg_level = atoi(s + 6);
         continue;
+      } else if (!strncmp(s, "levels=", 7)) {
+        if (!ParseLevels(s + 7))
+          return -1;
+        continue;
+      } else if (!strncmp(s, "iters=", 6)) {
+        arg_iters = atoi(s + 6);
+        if (arg_iters < 1)
+          return -1;
+        continue;
+      } else if (!strncmp(s, "warmup=", 7)) {
+        arg_warmup = atoi(s + 7);
+        if (arg_warmup < 0)
+          return -1;
+        continue;
+      } else if (!strncmp(s, "json=", 5)) {
+        arg_json = s + 5;
+        continue;
+      } else if (!strncmp(s, "jobs=", 5)) {
+        arg_jobs = atoi(s + 5);
+        if (arg_jobs < 1)
+          return -1;
+        continue;
+      } else if (!strncmp(s, "threads=", 8)) {
+        arg_threads = atoi(s + 8);
+        if (arg_threads < 0)
+          return -1;
+        continue;
+      } else if (!strncmp(s, "calibrate=", 10)) {
+        arg_calibrate = s + 10;
+        continue;
+      } else if (!strncmp(s, "cost-profile=", 13)) {
+        arg_cost_profile = s + 13;
+        continue;
+      } else if (!strcmp(s, "selftest")) {
+        arg_selftest = true;
+        continue;
+      } else if (!strncmp(s, "match-finder=", 13)) {
+        arg_match_finder = -1;
+        for (int mf = OOZ_MATCH_FINDER_DEFAULT; mf <= OOZ_MATCH_FINDER_BINARY_TREE; mf++)
+          if (!strcmp(s + 13, MatchFinderName(mf)))
+            arg_match_finder = mf;
+        if (arg_match_finder < 0)
+          return -1;
+        if (arg_num_match_finders < 8)
+          arg_match_finders[arg_num_match_finders++] = arg_match_finder;
+        continue;
+      } else if (!strncmp(s, "mem=", 4)) {
+        arg_mem = (int64)atoi(s + 4) << 20;
+        if (arg_mem <= 0)
+          return -1;
+        continue;
       } else {
         return -1;
       }
@@ -4275,11 +5805,31 @@ int ParseCmdLine(int argc, char *argv[]) {
       switch (c = *s++) {
       case 'z':
       case 'd':
-      case 'b':
         if (arg_direction)
           return -1;
         arg_direction = c;
         break;
+      case 'b':
+        arg_bench = true;
+        break;
+      case 'j': {
+        char *end;
+        arg_jobs = strtol(s, &end, 10);
+        if (end == s)
+          arg_jobs = std::max(1u, std::thread::hardware_concurrency());
+        if (arg_jobs < 1)
+          return -1;
+        s = end;
+        break;
+      }
+      case 'T': {
+        char *end;
+        arg_threads = strtol(s, &end, 10);
+        if (arg_threads < 0)
+          return -1;
+        s = end;
+        break;
+      }
       case 'c':
         arg_stdout = true;
         break;
@@ -4302,6 +5852,8 @@ int ParseCmdLine(int argc, char *argv[]) {
                          (c == 'h') ? kCompressor_Hydra : -1;
         if (arg_compressor < 0)
           return -1;
+        if (arg_num_codecs < 8)
+          arg_codecs[arg_num_codecs++] = arg_compressor;
         break;
       default:
         return -1;
@@ -4311,33 +5863,95 @@ int ParseCmdLine(int argc, char *argv[]) {
   return i;
 }
 
-bool Verify(const char *filename, uint8 *output, int outbytes, const char *curfile) {
-  int test_size;
-  byte *test = load_file(filename, &test_size);
-  if (!test) {
-    fprintf(stderr, "file open error: %s\n", filename);
-    return false;
-  }
-  if (test_size != outbytes) {
-    fprintf(stderr, "%s: ERROR: File size difference: %d vs %d\n", filename, outbytes, test_size);
-    return false;
+// Takes a file's output as it is produced and writes it to the output file
+// and stdout and compares it with the files it is verified against.
+struct OutputSink {
+  const char *curfile;
+  const char *outfile = NULL;
+  FILE *file = NULL;
+  bool to_stdout = false;
+  // Set once an error has been reported, so callers don't report another.
+  bool failed = false;
+  MappedFile refs[2];
+  const char *ref_names[2];
+  int num_refs = 0;
+  int64 pos = 0;
+
+  explicit OutputSink(const char *curfile) : curfile(curfile) {}
+  OutputSink(const OutputSink &) = delete;
+  OutputSink &operator=(const OutputSink &) = delete;
+  ~OutputSink() {
+    if (file)
+      fclose(file);
+  }
+
+  bool AddRef(const char *filename) {
+    ref_names[num_refs] = filename;
+    return refs[num_refs++].Open(filename);
+  }
+
+  bool Write(const byte *p, size_t n) {
+    for (int r = 0; r < num_refs; r++) {
+      const MappedFile &ref = refs[r];
+      size_t overlap = pos < ref.size ? (size_t)std::min<int64>(n, ref.size - pos) : 0;
+      if (memcmp(p, ref.data + pos, overlap) != 0) {
+        size_t i = 0;
+        while (p[i] == ref.data[pos + i])
+          i++;
+        fprintf(stderr, "%s: ERROR: File difference at 0x%llx. Was %d instead of %d\n", curfile,
+                (unsigned long long)(pos + i), p[i], ref.data[pos + i]);
+        failed = true;
+        return false;
+      }
+      refs[r].Release(pos);
+    }
+    if (to_stdout)
+      fwrite(p, 1, n, stdout);
+    if (file && fwrite(p, 1, n, file) != n) {
+      failed = true;
+      return file_error("file write error", outfile);
+    }
+    pos += n;
+    return true;
   }
-  for (int i = 0; i != test_size; i++) {
-    if (test[i] != output[i]) {
-      fprintf(stderr, "%s: ERROR: File difference at 0x%x. Was %d instead of %d\n", curfile, i, output[i], test[i]);
+
+  // Starts over, for decoding the same file again.
+  bool Rewind() {
+    if (to_stdout || (file && fseek(file, 0, SEEK_SET) != 0))
       return false;
+    pos = 0;
+    return true;
+  }
+
+  bool Finish() {
+    for (int r = 0; r < num_refs; r++) {
+      if (refs[r].size != pos) {
+        fprintf(stderr, "%s: ERROR: File size difference: %lld vs %lld\n", ref_names[r],
+                (long long)pos, (long long)refs[r].size);
+        failed = true;
+        return false;
+      }
     }
+    if (file) {
+      bool ok = fclose(file) == 0;
+      file = NULL;
+      if (!ok) {
+        failed = true;
+        return file_error("file write error", outfile);
+      }
+    }
+    return true;
   }
-  return true;
-}
+};
 
 #ifndef _MSC_VER
 typedef uint64_t LARGE_INTEGER;
+// Nanoseconds on the monotonic clock.
 void QueryPerformanceCounter(LARGE_INTEGER *a) {
-  *a = 0;
+  *a = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 void QueryPerformanceFrequency(LARGE_INTEGER *a) {
-  *a = 1;
+  *a = 1000000000;
 }
 #define WINAPI
 typedef void* HINSTANCE;
@@ -4380,145 +5994,1286 @@ void LoadLib() {
 
 struct CompressOptions;
 struct LRMCascade;
+struct LzEncoder;
+
+LzEncoder *LzEncoder_Create(size_t memory_limit);
+void LzEncoder_Destroy(LzEncoder *enc);
+int LzEncoder_Compress(LzEncoder *enc, int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
+                       const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm);
+const CompressOptions *GetCompressOpts(int level, bool make_qh_crc, int match_finder, int platforms);
+bool CompressLevelSupported(int codec_id, int level);
+typedef bool CompressUnitsWriteFunc(void *ctx, const uint8 *data, int size);
+bool CompressUnits(int codec_id, uint8 *src, int64 src_size, int level, const CompressOptions *compressopts,
+                   int unit_size, int history, int num_threads, CompressUnitsWriteFunc *write, void *ctx,
+                   LzEncoder *enc);
+
+// Memory a compressor keeps from one file or slab to the next.
+static const size_t kEncoderMemoryLimit = 256 << 20;
+
+struct KernelFamily {
+  const char *name;
+  const char *(*kernel_name)(int index);
+  bool (*select)(int index);
+  void (*select_default)();
+};
 
-int CompressBlock(int codec_id, uint8 *src_in, uint8 *dst_in, int src_size, int level,
-                  const CompressOptions *compressopts, uint8 *src_window_base, LRMCascade *lrm);
+static const KernelFamily kKernelFamilies[] = {
+  { "huffman", Huff_KernelName, Huff_SelectKernel, Huff_SelectDefaultKernel },
+  { "tans", Tans_KernelName, Tans_SelectKernel, Tans_SelectDefaultKernel },
+  { "lz", Lz_KernelName, Lz_SelectKernel, Lz_SelectDefaultKernel },
+  { "crc", Crc_KernelName, Crc_SelectKernel, Crc_SelectDefaultKernel },
+};
 
-int main(int argc, char *argv[]) {
+static const char *CompressorName(int codec_id) {
+  switch (codec_id) {
+  case kCompressor_Kraken: return "kraken";
+  case kCompressor_Mermaid: return "mermaid";
+  case kCompressor_Selkie: return "selkie";
+  case kCompressor_Hydra: return "hydra";
+  case kCompressor_Leviathan: return "leviathan";
+  default: return "unknown";
+  }
+}
+
+struct BenchStats {
+  int iters;
+  double min, median, p99;
+};
+
+// Calls |run| |arg_warmup| times untimed, then |arg_iters| times on the clock.
+// Stops with an error if a call fails.
+template<typename Func>
+BenchStats BenchmarkRun(const char *curfile, Func run) {
+  for (int i = 0; i < arg_warmup; i++) {
+    if (!run())
+      error("benchmark run failed", curfile);
+  }
+  std::vector<double> times;
+  for (int i = 0; i < arg_iters; i++) {
+    auto start = std::chrono::steady_clock::now();
+    if (!run())
+      error("benchmark run failed", curfile);
+    times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::sort(times.begin(), times.end());
+  BenchStats st;
+  st.iters = arg_iters;
+  st.min = times[0];
+  st.median = (times[(times.size() - 1) / 2] + times[times.size() / 2]) * 0.5;
+  // Nearest rank, so with fewer than 100 iterations it's the slowest one.
+  st.p99 = times[(times.size() * 99 + 99) / 100 - 1];
+  return st;
+}
+
+static FILE *bench_json;
+static int bench_json_rows;
+
+static void JsonString(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((uint8)*s < 0x20)
+      fprintf(f, "\\u%04x", *s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+// Prints one benchmark result and adds it to the JSON output. MB/s are of
+// uncompressed data, from the fastest run. |match_finder| is named when
+// several are benchmarked.
+static void BenchmarkReport(const char *curfile, const char *op, const char *codec, int level, const char *kernel,
+                            size_t raw_size, size_t comp_size, const BenchStats &st, const char *match_finder = NULL) {
+  char what[64];
+  if (kernel)
+    snprintf(what, sizeof(what), "%s %s", codec, kernel);
+  else if (level >= -4 && match_finder)
+    snprintf(what, sizeof(what), "%s level %d %s", codec, level, match_finder);
+  else if (level >= -4)
+    snprintf(what, sizeof(what), "%s level %d", codec, level);
+  else
+    snprintf(what, sizeof(what), "%s", codec);
+  fprintf(stderr, "%-20s: %-10s %-*s %9.2f MB/s  min %9.3f ms  median %9.3f ms  p99 %9.3f ms  %zu => %zu\n",
+          curfile, op, arg_num_match_finders > 1 ? 26 : 18, what, raw_size * 1e-6 / st.min, st.min * 1e3, st.median * 1e3, st.p99 * 1e3,
+          !strcmp(op, "compress") ? raw_size : comp_size, !strcmp(op, "compress") ? comp_size : raw_size);
+  if (!bench_json)
+    return;
+  fprintf(bench_json, "%s\n    {\"file\": ", bench_json_rows++ ? "," : "");
+  JsonString(bench_json, curfile);
+  fprintf(bench_json, ", \"op\": \"%s\", \"codec\": \"%s\"", op, codec);
+  if (level >= -4)
+    fprintf(bench_json, ", \"level\": %d", level);
+  if (kernel)
+    fprintf(bench_json, ", \"kernel\": \"%s\"", kernel);
+  if (match_finder)
+    fprintf(bench_json, ", \"match_finder\": \"%s\"", match_finder);
+  fprintf(bench_json, ", \"raw_size\": %zu, \"compressed_size\": %zu, \"iters\": %d, "
+          "\"min_ms\": %.4f, \"median_ms\": %.4f, \"p99_ms\": %.4f, \"mb_per_s\": %.2f}",
+          raw_size, comp_size, st.iters, st.min * 1e3, st.median * 1e3, st.p99 * 1e3, raw_size * 1e-6 / st.min);
+}
+
+// Decodes the input with the default kernels, with phase 1 on a second thread,
+// then with each kernel the CPU supports, checks that they all produce |expected|
+// and prints the timings.
+void BenchmarkDecompress(const char *curfile, const byte *src, int src_len, const byte *expected, size_t dst_len) {
+  byte *dst = new byte[dst_len + SAFE_SPACE];
+  auto decode = [&] {
+    int n = arg_dll ? OodLZ_Decompress((uint8*)src, src_len, dst, dst_len, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)
+                    : Kraken_Decompress(src, src_len, dst, dst_len);
+    return n == (int)dst_len;
+  };
+  BenchmarkReport(curfile, "decompress", arg_dll ? "dll" : "default", -5, NULL, dst_len, src_len,
+                  BenchmarkRun(curfile, decode));
+  if (!arg_dll) {
+    auto decode_threaded = [&] {
+      return Kraken_DecompressThreaded(src, src_len, dst, dst_len) == (int)dst_len;
+    };
+    memset(dst, 0, dst_len);
+    BenchmarkReport(curfile, "decompress", "threaded", -5, NULL, dst_len, src_len,
+                    BenchmarkRun(curfile, decode_threaded));
+    if (memcmp(dst, expected, dst_len) != 0)
+      error("threaded output mismatch", curfile);
+    for (const KernelFamily &family : kKernelFamilies) {
+      for (int i = 0; family.kernel_name(i); i++) {
+        if (!family.select(i)) {
+          fprintf(stderr, "%-20s: %-10s %s %s not supported by this cpu\n", curfile, "decompress", family.name, family.kernel_name(i));
+          continue;
+        }
+        memset(dst, 0, dst_len);
+        BenchmarkReport(curfile, "decompress", family.name, -5, family.kernel_name(i), dst_len, src_len,
+                        BenchmarkRun(curfile, decode));
+        if (memcmp(dst, expected, dst_len) != 0)
+          error("kernel output mismatch", curfile);
+      }
+      family.select_default();
+    }
+  }
+  delete[] dst;
+}
+
+// Compresses the input with every codec, level and match finder asked for,
+// then times decoding each result. Levels a codec has no encoder for are
+// skipped.
+void BenchmarkCompress(const char *curfile, byte *input, int input_size, LzEncoder *enc) {
+  int num_codecs = arg_num_codecs ? arg_num_codecs : 1;
+  int num_levels = arg_num_levels ? arg_num_levels : 1;
+  // Seekable chunks are compressed with the default match finder.
+  int num_match_finders = arg_num_match_finders > 1 && !arg_seekable ? arg_num_match_finders : 1;
+  for (int ci = 0; ci < num_codecs; ci++) {
+    int codec = arg_num_codecs ? arg_codecs[ci] : arg_compressor;
+    for (int li = 0; li < num_levels; li++) {
+      int level = arg_num_levels ? arg_levels[li] : arg_level;
+      if (!CompressLevelSupported(codec, level))
+        continue;
+      for (int mi = 0; mi < num_match_finders; mi++) {
+        int match_finder = num_match_finders > 1 ? arg_match_finders[mi] : arg_match_finder;
+        const char *mf_name = num_match_finders > 1 ? MatchFinderName(match_finder) : NULL;
+        int64 bound = arg_seekable ? Seekable_CompressBound(input_size, arg_seekable) : input_size + 65536;
+        byte *packed = new byte[bound];
+        int64 packed_size = -1;
+        auto compress = [&] {
+          if (arg_seekable)
+            packed_size = Seekable_Compress(codec, level, arg_crc, cost_platforms, arg_seekable, 1, input, input_size, packed, bound);
+          else
+            packed_size = LzEncoder_Compress(enc, codec, input, packed, input_size, level, GetCompressOpts(level, arg_crc, match_finder, cost_platforms), 0, 0);
+          return packed_size >= 0;
+        };
+        if (!compress()) {
+          fprintf(stderr, "%-20s: %-10s %s level %d failed\n", curfile, "compress", CompressorName(codec), level);
+          delete[] packed;
+          continue;
+        }
+        BenchmarkReport(curfile, "compress", CompressorName(codec), level, NULL, input_size, packed_size,
+                        BenchmarkRun(curfile, compress), mf_name);
+
+        byte *unpacked = new byte[input_size];
+        OozSeekable *seekable = arg_seekable ? Ooz_SeekableOpen(packed, packed_size) : NULL;
+        auto decode = [&] {
+          int64 n = seekable ? Ooz_SeekableDecompress(seekable, unpacked, input_size, 0)
+                             : Kraken_Decompress(packed, packed_size, unpacked, input_size);
+          return n == input_size;
+        };
+        BenchStats st = BenchmarkRun(curfile, decode);
+        if (memcmp(unpacked, input, input_size) != 0)
+          error("decompressed output differs", curfile);
+        BenchmarkReport(curfile, "decompress", CompressorName(codec), level, NULL, input_size, packed_size, st, mf_name);
+        Ooz_SeekableClose(seekable);
+        delete[] unpacked;
+        delete[] packed;
+      }
+    }
+  }
+}
+
+// Output name used with -j: compressing appends .ooz, decompressing strips it
+// or appends .out if it isn't there.
+static std::string JobOutputName(const char *input) {
+  size_t len = strlen(input);
+  if (arg_direction == 'z')
+    return std::string(input) + ".ooz";
+  if (len > 4 && !strcmp(input + len - 4, ".ooz"))
+    return std::string(input, len - 4);
+  return std::string(input) + ".out";
+}
+
+struct FileTotals {
+  std::atomic<int64> in_bytes, out_bytes, raw_bytes;
+  std::atomic<int> files, verified;
+};
+
+// Plain streams are compressed |kStreamSlab| bytes at a time with the
+// |kStreamHistory| bytes before each slab as its dictionary, so offsets stay
+// under |kStreamWindow| and neither side needs the whole file in memory. Both
+// are whole 256k blocks.
+static const int kStreamSlab = 64 << 20;
+static const int kStreamHistory = 64 << 20;
+static const int kStreamWindow = kStreamSlab + kStreamHistory;
+// Largest output decoded or benchmarked in one buffer.
+static const int64 kMaxWholeFile = 1 << 30;
+// Size of the pieces fed to and drained from a stream decoder.
+static const size_t kStreamPiece = 1 << 20;
+
+struct StreamWriter {
+  OutputSink *sink;
+  MappedFile *input;
+  int64 raw_pos;
+};
+
+static bool StreamWriter_Write(void *ctx, const uint8 *data, int size) {
+  StreamWriter *w = (StreamWriter*)ctx;
+  if (!w->sink->Write(data, size))
+    return false;
+  // Slabs still to come only look back this far.
+  w->raw_pos += kStreamSlab;
+  w->input->Release(w->raw_pos - kStreamHistory);
+  return true;
+}
+
+static bool CompressStream(const char *curfile, MappedFile *input, OutputSink *sink, LzEncoder *enc) {
+  // The compressors take non-const input but only read it.
+  byte *src = (byte*)input->data;
+  int64 src_size = input->size;
+  byte header[8];
+  *(uint64*)header = src_size;
+  if (!sink->Write(header, 8))
+    return false;
+  if (!arg_dll) {
+    StreamWriter w = { sink, input, 0 };
+    if (!CompressUnits(arg_compressor, src, src_size, arg_level, GetCompressOpts(arg_level, arg_crc, arg_match_finder, cost_platforms),
+                       kStreamSlab, kStreamHistory, arg_threads, StreamWriter_Write, &w, enc))
+      return sink->failed ? false : file_error("compress failed", curfile);
+    return true;
+  }
+  int slab_size = (int)std::min<int64>(src_size, kStreamSlab);
+  std::unique_ptr<byte[]> dst(new byte[slab_size + 274 * (slab_size / 0x40000 + 1) + 65536]);
+  for (int64 pos = 0; pos < src_size; pos += kStreamSlab) {
+    int n = (int)std::min<int64>(src_size - pos, kStreamSlab);
+    // The dll takes no dictionary, each slab starts over with a keyframe.
+    int outbytes = OodLZ_Compress(arg_compressor, src + pos, n, dst.get(), arg_level, 0, 0, 0, 0, 0);
+    if (outbytes < 0)
+      return file_error("compress failed", curfile);
+    if (!sink->Write(dst.get(), outbytes))
+      return false;
+    input->Release(pos + n);
+  }
+  return true;
+}
+
+// Decodes a plain stream keeping |history| bytes of output, 0 for all of it.
+static bool DecompressStream(MappedFile *input, int hdrsize, int64 raw_size, size_t history, OutputSink *sink) {
+  const byte *src = input->data + hdrsize, *src_end = input->data + input->size;
+  OozStream *stream = Ooz_StreamCreate(raw_size, history);
+  if (!stream)
+    return false;
+  std::unique_ptr<byte[]> piece(new byte[kStreamPiece]);
+  int done = 0;
+  while (done == 0) {
+    int taken = Ooz_StreamFeed(stream, src, std::min<size_t>(src_end - src, kStreamPiece));
+    if (taken < 0)
+      break;
+    src += taken;
+    input->Release(src - input->data);
+    int n, drained = 0;
+    while ((n = Ooz_StreamDrain(stream, piece.get(), kStreamPiece)) > 0 && sink->Write(piece.get(), n))
+      drained += n;
+    if (n != 0)
+      break;
+    done = Ooz_StreamFinish(stream);
+    // Truncated input.
+    if (done == 0 && taken == 0 && drained == 0)
+      break;
+  }
+  Ooz_StreamDestroy(stream);
+  return done == 1 && src == src_end;
+}
+
+// Compresses or decompresses |src| into |sink|. Sets |raw_bytes| to the
+// uncompressed size.
+static bool CodeFile(const char *curfile, MappedFile *input, OutputSink *sink, int64 *raw_bytes, LzEncoder *enc) {
   int64_t start, end, freq;
+  byte *src = (byte*)input->data;
+  int64 src_size = input->size;
+
+  if (arg_direction == 'z' && arg_seekable) {
+    int64 bound = Seekable_CompressBound(src_size, arg_seekable);
+    std::unique_ptr<byte[]> output(new byte[bound]);
+    QueryPerformanceCounter((LARGE_INTEGER*)&start);
+    int64 outbytes = Seekable_Compress(arg_compressor, arg_level, arg_crc, cost_platforms, arg_seekable, arg_threads, src, src_size, output.get(), bound);
+    if (outbytes < 0) return file_error("compress failed", curfile);
+    QueryPerformanceCounter((LARGE_INTEGER*)&end);
+    QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
+    if (!sink->Write(output.get(), outbytes))
+      return false;
+    double seconds = (double)(end - start) / freq;
+    *raw_bytes = src_size;
+    if (!arg_quiet)
+      fprintf(stderr, "%-20s: %8lld => %8lld (%.2f seconds, %.2f MB/s)\n", curfile, (long long)src_size,
+              (long long)outbytes, seconds, src_size * 1e-6 / seconds);
+  } else if (src_size >= kSeekableMagicSize && !memcmp(src, SEEKABLE_MAGIC, kSeekableMagicSize) &&
+             arg_direction != 'z') {
+    OozSeekable *seekable = Ooz_SeekableOpen(src, src_size);
+    if (!seekable) return file_error("bad seek table", curfile);
+    int64 unpacked_size = Ooz_SeekableRawSize(seekable);
+    bool ok = true;
+    QueryPerformanceCounter((LARGE_INTEGER*)&start);
+    if (unpacked_size <= kMaxWholeFile) {
+      std::unique_ptr<byte[]> output(new byte[unpacked_size]);
+      // With -j the cores are busy with other files already.
+      int threads = arg_jobs > 1 ? 1 : 0;
+      ok = Ooz_SeekableDecompress(seekable, output.get(), unpacked_size, threads) == unpacked_size;
+      QueryPerformanceCounter((LARGE_INTEGER*)&end);
+      if (ok && arg_bench) {
+        auto decode = [&] { return Ooz_SeekableDecompress(seekable, output.get(), unpacked_size, 0) == unpacked_size; };
+        BenchmarkReport(curfile, "decompress", "seekable", -5, NULL, unpacked_size, src_size, BenchmarkRun(curfile, decode));
+      }
+      ok = ok && sink->Write(output.get(), unpacked_size);
+    } else if (arg_bench) {
+      ok = file_error("file too large", curfile);
+    } else {
+      // Too large to hold, decode a slab at a time.
+      std::unique_ptr<byte[]> output(new byte[kStreamSlab]);
+      for (int64 pos = 0; ok && pos < unpacked_size; pos += kStreamSlab) {
+        size_t n = (size_t)std::min<int64>(unpacked_size - pos, kStreamSlab);
+        ok = Ooz_SeekableDecodeRange(seekable, pos, output.get(), n) == n && sink->Write(output.get(), n);
+      }
+      QueryPerformanceCounter((LARGE_INTEGER*)&end);
+    }
+    QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
+    int chunks = Ooz_SeekableChunkCount(seekable);
+    Ooz_SeekableClose(seekable);
+    if (!ok)
+      return sink->failed ? false : file_error("decompress error", curfile);
+    double seconds = (double)(end - start) / freq;
+    *raw_bytes = unpacked_size;
+    if (!arg_quiet)
+      fprintf(stderr, "%-20s: %8lld => %8lld (%d chunks, %.2f seconds, %.2f MB/s)\n", curfile, (long long)src_size,
+              (long long)unpacked_size, chunks, seconds, unpacked_size * 1e-6 / seconds);
+  } else if (arg_direction == 'z') {
+    QueryPerformanceCounter((LARGE_INTEGER*)&start);
+    if (!CompressStream(curfile, input, sink, enc))
+      return false;
+    QueryPerformanceCounter((LARGE_INTEGER*)&end);
+    QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
+    double seconds = (double)(end - start) / freq;
+    *raw_bytes = src_size;
+    if (!arg_quiet)
+      fprintf(stderr, "%-20s: %8lld => %8lld (%.2f seconds, %.2f MB/s)\n", curfile, (long long)src_size,
+              (long long)sink->pos, seconds, src_size * 1e-6 / seconds);
+  } else {
+    if (src_size < 8)
+      return file_error("file too small", curfile);
+    // stupidly attempt to autodetect if file uses 4-byte or 8-byte header,
+    // the previous version of this tool wrote a 4-byte header.
+    int hdrsize = *(uint64*)src >= 0x10000000000 ? 4 : 8;
+
+    uint64 unpacked_size = (hdrsize == 8) ? *(uint64*)src : *(uint32*)src;
+    if (hdrsize == 4 && unpacked_size > 52*1024*1024)
+      return file_error("file too large", curfile);
+    bool ok;
+
+    QueryPerformanceCounter((LARGE_INTEGER*)&start);
+
+    // Outputs that fit the stream window are decoded in one go.
+    if (arg_dll || arg_bench || unpacked_size <= kStreamWindow) {
+      if (unpacked_size > kMaxWholeFile || src_size - hdrsize > INT_MAX)
+        return file_error("file too large", curfile);
+      std::unique_ptr<byte[]> output(new byte[unpacked_size + SAFE_SPACE]);
+      int outbytes;
+      if (arg_dll) {
+        outbytes = OodLZ_Decompress(src + hdrsize, src_size - hdrsize, output.get(), unpacked_size, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+      } else {
+        outbytes = Kraken_Decompress(src + hdrsize, src_size - hdrsize, output.get(), unpacked_size);
+      }
+      ok = outbytes == unpacked_size;
+      QueryPerformanceCounter((LARGE_INTEGER*)&end);
+      if (ok && arg_bench)
+        BenchmarkDecompress(curfile, src + hdrsize, src_size - hdrsize, output.get(), unpacked_size);
+      ok = ok && sink->Write(output.get(), unpacked_size);
+    } else {
+      // Streams written by CompressStream reach back at most kStreamWindow bytes.
+      // Other encoders reach further, those get the whole output kept for them
+      // in a second try when it fits, or from the start when it goes to stdout.
+      bool whole = unpacked_size <= kMaxWholeFile;
+      ok = DecompressStream(input, hdrsize, unpacked_size, whole && arg_stdout ? 0 : kStreamWindow, sink);
+      if (!ok && whole && !arg_stdout && !sink->failed && sink->Rewind())
+        ok = DecompressStream(input, hdrsize, unpacked_size, 0, sink);
+      QueryPerformanceCounter((LARGE_INTEGER*)&end);
+    }
+    if (!ok)
+      return sink->failed ? false : file_error("decompress error", curfile);
+    QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
+    double seconds = (double)(end - start) / freq;
+    *raw_bytes = unpacked_size;
+    if (!arg_quiet)
+      fprintf(stderr, "%-20s: %8lld => %8lld (%.2f seconds, %.2f MB/s)\n", curfile, (long long)src_size,
+              (long long)unpacked_size, seconds, unpacked_size * 1e-6 / seconds);
+  }
+  return true;
+}
+
+// Compresses or decompresses |curfile|, writes the result to |outfile| and
+// compares it with |reffile| when those aren't NULL. Compresses with |enc|.
+bool ProcessFile(const char *curfile, const char *outfile, const char *reffile, FileTotals *totals, LzEncoder *enc) {
+  if (outfile && !arg_force) {
+    struct stat sb;
+    if (stat(outfile, &sb) >= 0) {
+      fprintf(stderr, "file %s already exists, skipping.\n", outfile);
+      return arg_jobs != 0;
+    }
+  }
+
+  MappedFile input;
+  if (!input.Open(curfile))
+    return false;
+
+  if (arg_bench && arg_direction == 'z') {
+    if (input.size > kMaxWholeFile)
+      return file_error("file too large", curfile);
+    BenchmarkCompress(curfile, (byte*)input.data, (int)input.size, enc);
+    return true;
+  }
+
+  OutputSink sink(curfile);
+  char verifyfile[1024];
+  if (verifyfolder) {
+    // Verify against the file in verifyfolder with the same basename excluding extension
+    const char *basename = curfile;
+    for(const char *s = curfile; *s; s++)
+      if (*s == '/' || *s == '\\')
+        basename = s + 1;
+    const char *ext = strrchr(basename, '.');
+    snprintf(verifyfile, sizeof(verifyfile), "%s/%.*s", verifyfolder, (int)(ext ? (ext - basename) : strlen(basename)), basename);
+    if (!sink.AddRef(verifyfile))
+      return false;
+  }
+  if (reffile && !sink.AddRef(reffile))
+    return false;
+  sink.to_stdout = arg_stdout && !arg_bench;
+  if (outfile) {
+    sink.outfile = outfile;
+    sink.file = fopen(outfile, "wb");
+    if (!sink.file)
+      return file_error("file open for write error", outfile);
+  }
+
+  int64 raw_bytes;
+  if (!CodeFile(curfile, &input, &sink, &raw_bytes, enc) || !sink.Finish()) {
+    // Don't leave a partial output behind.
+    if (outfile) {
+      if (sink.file)
+        fclose(sink.file);
+      sink.file = NULL;
+      remove(outfile);
+    }
+    return false;
+  }
+
+  if (verifyfolder)
+    totals->verified++;
+  if (reffile)
+    fprintf(stderr, "%s: Verify OK\n", curfile);
+  totals->files++;
+  totals->in_bytes += input.size;
+  totals->out_bytes += sink.pos;
+  totals->raw_bytes += raw_bytes;
+  return true;
+}
+
+// Runs ProcessFile over |files| on |arg_jobs| threads. Files are started in
+// order and only while the ones in progress add up to less than |arg_mem|
+// bytes of input, a larger file runs on its own. After a failure no new files
+// are started.
+bool ProcessFilesParallel(char **files, int num_files, FileTotals *totals) {
+  std::mutex mutex;
+  std::condition_variable cond;
+  int64 in_flight = 0;
+  int next = 0;
+  bool failed = false;
+
+  auto worker = [&] {
+    std::unique_ptr<LzEncoder, void(*)(LzEncoder*)> enc(LzEncoder_Create(kEncoderMemoryLimit), LzEncoder_Destroy);
+    for (;;) {
+      int i;
+      int64 size;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (failed || next == num_files)
+          return;
+        i = next++;
+        struct stat sb;
+        size = stat(files[i], &sb) >= 0 ? sb.st_size : 0;
+        cond.wait(lock, [&] { return in_flight == 0 || in_flight + size <= arg_mem; });
+        in_flight += size;
+      }
+      const char *outfile = NULL;
+      std::string name;
+      if (!verifyfolder) {
+        name = JobOutputName(files[i]);
+        outfile = name.c_str();
+      }
+      bool ok = ProcessFile(files[i], outfile, NULL, totals, enc.get());
+      std::lock_guard<std::mutex> lock(mutex);
+      in_flight -= size;
+      failed |= !ok;
+      cond.notify_all();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < std::min(arg_jobs, num_files); i++)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread &t : threads)
+    t.join();
+  return !failed;
+}
+
+// Fits a decode cost profile to this machine with |files| as the sample data
+// and writes it to |arg_calibrate|.
+static bool CalibrateCostProfile(char **files, int num_files) {
+  std::vector<std::unique_ptr<MappedFile>> inputs;
+  std::vector<const uint8*> srcs;
+  std::vector<int64> sizes;
+  for (int i = 0; i < num_files; i++) {
+    inputs.emplace_back(new MappedFile);
+    if (!inputs.back()->Open(files[i]))
+      return false;
+    srcs.push_back(inputs.back()->data);
+    sizes.push_back(inputs.back()->size);
+  }
+  CostProfileFit fit;
+  int platforms = CostProfile_Calibrate(srcs.data(), sizes.data(), num_files, &fit);
+  if (platforms < 0)
+    return file_error("not enough data to calibrate with", arg_calibrate);
+  if (!CostProfile_Write(arg_calibrate, platforms))
+    return file_error("file write error", arg_calibrate);
+  if (!arg_quiet) {
+    const CostProfile *p = CostProfile_Get(platforms);
+    fprintf(stderr, "%s: weights %.3f %.3f %.3f %.3f from %d streams (%d skipped), codec scales %.3f %.3f %.3f %.3f, "
+            "entropy decoders from %d arrays, decode time error %.1f%% => %.1f%%\n", arg_calibrate,
+            p->weights[0], p->weights[1], p->weights[2], p->weights[3], fit.samples, fit.skipped,
+            p->scale[0], p->scale[1], p->scale[2], p->scale[3], fit.kernel_samples,
+            fit.default_error * 100, fit.fitted_error * 100);
+  }
+  return true;
+}
+
+// Checks run by "ooz --selftest" and by ctest. Each one reports what failed
+// on stderr and returns false.
+
+static uint32 SelfTestRandom(uint64 *state) {
+  *state = *state * 6364136223846793005ull + 1442695040888963407ull;
+  return (uint32)(*state >> 33);
+}
+
+// Fills |td| with |num_syms| random symbols whose weights add up to 1 << L_bits,
+// sorted the way Tans_DecodeTable leaves them. |shape| 0 gives all the spare
+// weight to one symbol, 1 spreads it evenly and 2 halves it from one symbol to
+// the next.
+static void SelfTestTansTable(TansData *td, int L_bits, int num_syms, int shape, uint64 *rng) {
+  uint8 syms[256];
+  uint32 weights[256];
+  for (int i = 0; i < 256; i++)
+    syms[i] = (uint8)i;
+  for (int i = 255; i > 0; i--)
+    std::swap(syms[i], syms[SelfTestRandom(rng) % (i + 1)]);
+  int spare = (1 << L_bits) - num_syms;
+  for (int i = 0; i < num_syms; i++) {
+    int w = shape == 0 ? (i == 0 ? spare : 0) :
+            shape == 1 ? spare / num_syms + (i < spare % num_syms) :
+            (i == num_syms - 1 ? spare : (spare + 1) >> 1);
+    weights[i] = 1 + w;
+    spare -= w;
+  }
+  td->A_used = td->B_used = 0;
+  for (int i = 0; i < num_syms; i++) {
+    if (weights[i] == 1)
+      td->A[td->A_used++] = syms[i];
+    else
+      td->B[td->B_used++] = syms[i] << 16 | weights[i];
+  }
+  SimpleSort(td->A, td->A + td->A_used);
+  SimpleSort(td->B, td->B + td->B_used);
+}
+
+// Bit |pos| of the forward or backward stream of |p|, counting the bits left
+// in |bits_f| or |bits_b| first.
+static uint32 SelfTestTansBit(const TansDecoderParams &p, bool backward, int pos) {
+  int bitpos = backward ? p.bitpos_b : p.bitpos_f;
+  if (pos < bitpos)
+    return ((backward ? p.bits_b : p.bits_f) >> pos) & 1;
+  pos -= bitpos;
+  uint8 byte = backward ? p.ptr_b[-1 - pos / 8] : p.ptr_f[pos / 8];
+  return (byte >> (pos & 7)) & 1;
+}
+
+// Decodes |dst_count| symbols in the order Tans_Decode does, one bit at a time,
+// and returns how many bytes of each stream that used up.
+static void SelfTestTansReference(const TansDecoderParams &p, uint8 *dst, int dst_count, int *bytes_f, int *bytes_b) {
+  uint32 state[5] = { p.state_0, p.state_1, p.state_2, p.state_3, p.state_4 };
+  int used[2] = { 0, 0 };
+  for (int i = 0; i < dst_count; i++) {
+    bool backward = i % 10 >= 5;
+    const TansLutEnt &e = p.lut[state[i % 5]];
+    dst[i] = e.symbol;
+    uint32 v = 0;
+    for (int b = 0; b < e.bits_x; b++)
+      v |= SelfTestTansBit(p, backward, used[backward]++) << b;
+    state[i % 5] = v + e.w;
+  }
+  *bytes_f = std::max(used[0] - p.bitpos_f + 7, 0) >> 3;
+  *bytes_b = std::max(used[1] - p.bitpos_b + 7, 0) >> 3;
+}
+
+// Runs |init| through every tANS kernel the CPU supports. The first one, the
+// scalar Tans_Decode, leaves its output in |expected|. Returns false if
+// another kernel gives a different result, or different output when
+// |compare_output| is set. Kernels that reject a stream may stop writing at
+// different points.
+static bool SelfTestTansRun(const TansDecoderParams &init, int dst_count, bool compare_output,
+                            std::vector<uint8> &expected, bool *expected_ok) {
+  std::vector<uint8> out;
+  for (const CpuKernel<TansDecodeFunc> &kernel : kTansKernels) {
+    if ((CpuFeatures() & kernel.cpu_features) != kernel.cpu_features)
+      continue;
+    bool reference = &kernel == kTansKernels;
+    std::vector<uint8> &dst = reference ? expected : out;
+    dst.assign(dst_count + 5, 0xCD);
+    TansDecoderParams params = init;
+    params.dst = dst.data();
+    params.dst_end = dst.data() + dst_count;
+    bool ok = kernel.func(&params);
+    if (reference) {
+      *expected_ok = ok;
+    } else if (ok != *expected_ok || (compare_output && out != expected)) {
+      fprintf(stderr, "selftest: tans kernel %s differs from %s\n", kernel.name, kTansKernels[0].name);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks the tANS kernels against the scalar Tans_Decode for each table size
+// and every value of each of the five states. Each case decodes a random
+// stream long enough that the stream pointers never cross, the same stream
+// cut to the bytes the decode used up, which passes the end checks unless a
+// final state is too large, and a short stream that is rejected part way.
+static bool SelfTestTansKernels() {
+  static const int kSymCounts[] = { 2, 3, 17, 200, 256 };
+  uint64 rng = 1;
+  TansData td;
+  std::vector<TansLutEnt> lut(1 << 11);
+  std::vector<uint8> stream, exact, expected, symbols;
+  int cases = 0, accepted = 0;
+  for (int L_bits = 8; L_bits <= 11; L_bits++) {
+    int L = 1 << L_bits;
+    for (int num_syms : kSymCounts) {
+      for (int shape = 0; shape < 3; shape++) {
+        SelfTestTansTable(&td, L_bits, num_syms, shape, &rng);
+        Tans_InitLut(&td, L_bits, lut.data());
+        for (int s = 0; s < L; s++) {
+          int dst_count = SelfTestRandom(&rng) % 400;
+          int src_len = dst_count * 11 / 8 + 16 + SelfTestRandom(&rng) % 32;
+          // The decoders read a little past either stream pointer.
+          int pad = 16;
+          stream.resize(pad + src_len + pad);
+          for (uint8 &b : stream)
+            b = (uint8)SelfTestRandom(&rng);
+          TansDecoderParams init;
+          init.lut = lut.data();
+          init.ptr_f = stream.data() + pad;
+          init.ptr_b = init.ptr_f + src_len;
+          init.bitpos_f = SelfTestRandom(&rng) & 7;
+          init.bitpos_b = SelfTestRandom(&rng) & 7;
+          init.bits_f = SelfTestRandom(&rng) & ((1u << init.bitpos_f) - 1);
+          init.bits_b = SelfTestRandom(&rng) & ((1u << init.bitpos_b) - 1);
+          // Odd multipliers, so each state takes every value as |s| does.
+          uint32 offset = SelfTestRandom(&rng);
+          init.state_0 = s;
+          init.state_1 = (s * 3 + offset) & (L - 1);
+          init.state_2 = (s * 5 + (offset >> 8)) & (L - 1);
+          init.state_3 = (s * 7 + (offset >> 16)) & (L - 1);
+          init.state_4 = (s * 9 + (offset >> 24)) & (L - 1);
+
+          bool ok;
+          symbols.resize(dst_count);
+          int bytes_f, bytes_b;
+          SelfTestTansReference(init, symbols.data(), dst_count, &bytes_f, &bytes_b);
+          if (!SelfTestTansRun(init, dst_count, true, expected, &ok))
+            goto fail;
+          if (!std::equal(symbols.begin(), symbols.end(), expected.begin())) {
+            fprintf(stderr, "selftest: tans kernel %s differs from a bit at a time decode\n", kTansKernels[0].name);
+            goto fail;
+          }
+
+          exact.assign(stream.begin(), stream.begin() + pad + bytes_f);
+          exact.insert(exact.end(), init.ptr_b - bytes_b, init.ptr_b + pad);
+          init.ptr_f = exact.data() + pad;
+          init.ptr_b = init.ptr_f + bytes_f + bytes_b;
+          if (!SelfTestTansRun(init, dst_count, true, expected, &ok))
+            goto fail;
+          accepted += ok;
+
+          init.ptr_b = init.ptr_f + SelfTestRandom(&rng) % 16;
+          if (!SelfTestTansRun(init, dst_count, false, expected, &ok))
+            goto fail;
+          cases += 3;
+          continue;
+        fail:
+          fprintf(stderr, "selftest: L_bits %d, %d symbols, shape %d, state %d\n", L_bits, num_syms, shape, s);
+          return false;
+        }
+      }
+    }
+  }
+  if (!arg_quiet)
+    fprintf(stderr, "selftest: tans kernels agree on %d streams, %d of them valid\n", cases, accepted);
+  return true;
+}
+
+// Text-like input of |size| bytes: words from a small vocabulary with the
+// odd random number, so every codec finds near and far matches and literals.
+static void SelfTestText(std::vector<uint8> *text, size_t size, uint64 *rng) {
+  static const char *const kWords[] = {
+    "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog ", "static ", "int ",
+    "return ", "while ", "(void)", "{\n", "}\n", "  ", "const ", "uint8 *", "= ", "0x",
+  };
+  const int kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+  char num[16];
+  text->clear();
+  while (text->size() < size) {
+    uint32 r = SelfTestRandom(rng);
+    const char *word = kWords[(r >> 8) % kNumWords];
+    if ((r & 15) == 0) {
+      snprintf(num, sizeof(num), "%u ", SelfTestRandom(rng) % 100000);
+      word = num;
+    }
+    text->insert(text->end(), word, word + strlen(word));
+  }
+  text->resize(size);
+}
+
+// Compresses with every codec at levels -4 to 10 and checks that the levels a
+// codec has no encoder for are rejected and the others round-trip.
+static bool SelfTestCompressLevels() {
+  static const int kCodecs[] = {
+    OOZ_COMPRESSOR_KRAKEN, OOZ_COMPRESSOR_MERMAID, OOZ_COMPRESSOR_SELKIE, OOZ_COMPRESSOR_HYDRA,
+    OOZ_COMPRESSOR_LEVIATHAN,
+  };
+  uint64 rng = 1;
+  std::vector<uint8> text;
+  // Past one 256k block, so Hydra has two to pick codecs for. The first 128k
+  // are zeros, stored as a memset chunk before one with text.
+  SelfTestText(&text, 0x42000, &rng);
+  std::fill(text.begin(), text.begin() + 0x20000, 0);
+  std::vector<uint8> packed(Ooz_CompressBound(text.size())), out(text.size());
+  int pairs = 0;
+  for (int codec : kCodecs) {
+    for (int level = -4; level <= 10; level++) {
+      bool supported = CompressLevelSupported(codec, level);
+      int n = Ooz_Compress(codec, level, NULL, text.data(), text.size(), packed.data(), packed.size());
+      if (!supported) {
+        if (n != -1) {
+          fprintf(stderr, "selftest: %s level %d has no encoder but compressed\n", CompressorName(codec), level);
+          return false;
+        }
+        continue;
+      }
+      if (n <= 0 || Ooz_Decompress(packed.data(), n, out.data(), out.size(), 0, 0, 0, NULL, 0, NULL, NULL,
+                                   NULL, 0, 0) != (int)out.size() || out != text) {
+        fprintf(stderr, "selftest: %s level %d doesn't round-trip\n", CompressorName(codec), level);
+        return false;
+      }
+      pairs++;
+    }
+  }
+  if (!arg_quiet)
+    fprintf(stderr, "selftest: %d codec and level pairs round-trip\n", pairs);
+  return true;
+}
+
+// Compresses with a registered cost profile on two threads at once, and checks
+// that both get the same output and that it round-trips.
+static bool SelfTestCostProfile() {
+  static const int kCodecs[] = {
+    OOZ_COMPRESSOR_KRAKEN, OOZ_COMPRESSOR_MERMAID, OOZ_COMPRESSOR_SELKIE, OOZ_COMPRESSOR_LEVIATHAN,
+  };
+  CostProfile profile = {
+    { 0.1f, 0.2f, 0.3f, 0.4f }, { 1.5f, 0.5f, 0.5f, 1.0f }, true,
+    { { 20.0f, 0.02f }, { 800.0f, 2.5f, 40.0f }, { 1000.0f, 2.5f, 40.0f }, { 330.0f, 2.4f, 21.0f, 2.3f } },
+  };
+  int platforms = CostProfile_Register(profile);
+  if (platforms < 0 || CostProfile_Register(profile) != platforms || !CostProfile_IsValid(platforms)) {
+    fprintf(stderr, "selftest: a cost profile doesn't register once\n");
+    return false;
+  }
+  uint64 rng = 2;
+  std::vector<uint8> text;
+  SelfTestText(&text, 0x30000, &rng);
+  for (int codec : kCodecs) {
+    OozCompressOptions opts;
+    Ooz_CompressOptionsDefault(&opts, 4);
+    opts.cost_profile = platforms;
+    std::vector<uint8> packed[2], out(text.size());
+    int n[2];
+    std::thread threads[2];
+    for (int i = 0; i < 2; i++) {
+      packed[i].resize(Ooz_CompressBound(text.size()));
+      threads[i] = std::thread([&, i] {
+        n[i] = Ooz_Compress(codec, 4, &opts, text.data(), text.size(), packed[i].data(), packed[i].size());
+      });
+    }
+    for (std::thread &t : threads)
+      t.join();
+    if (n[0] <= 0 || n[1] != n[0] || memcmp(packed[0].data(), packed[1].data(), n[0]) != 0 ||
+        Ooz_Decompress(packed[0].data(), n[0], out.data(), out.size(), 0, 0, 0, NULL, 0, NULL, NULL, NULL, 0, 0) !=
+            (int)out.size() || out != text) {
+      fprintf(stderr, "selftest: %s doesn't round-trip the same on two threads with a cost profile\n",
+              CompressorName(codec));
+      return false;
+    }
+  }
+  if (!arg_quiet)
+    fprintf(stderr, "selftest: codecs compress alike on two threads with a cost profile\n");
+  return true;
+}
+
+// Compresses records against two dictionaries in turn with every codec at
+// levels -4 to 10, and checks that the levels a codec has no encoder for are
+// rejected and the others round-trip through one decoder.
+static bool SelfTestDictionary() {
+  static const int kCodecs[] = {
+    OOZ_COMPRESSOR_KRAKEN, OOZ_COMPRESSOR_MERMAID, OOZ_COMPRESSOR_SELKIE, OOZ_COMPRESSOR_HYDRA,
+    OOZ_COMPRESSOR_LEVIATHAN,
+  };
+  static const size_t kRecordSizes[] = { 1000, 20000 };
+  uint64 rng = 3;
+  std::vector<uint8> text;
+  OozDictionary *dicts[2];
+  SelfTestText(&text, 16384, &rng);
+  dicts[0] = Ooz_DictionaryCreate(text.data(), text.size());
+  SelfTestText(&text, 5000, &rng);
+  dicts[1] = Ooz_DictionaryCreate(text.data(), text.size());
+  OozEncoder *enc = Ooz_EncoderCreate(kEncoderMemoryLimit);
+  OozDecoder *dec = Ooz_DecoderCreate(NULL, 0);
+  bool ok = dicts[0] && dicts[1] && enc && dec;
+  int pairs = 0;
+  for (int codec : kCodecs) {
+    for (int level = -4; level <= 10 && ok; level++) {
+      bool supported = CompressLevelSupported(codec, level);
+      for (size_t ri = 0; ri < sizeof(kRecordSizes) / sizeof(kRecordSizes[0]) && ok; ri++) {
+        const OozDictionary *dict = dicts[(level + ri) & 1];
+        SelfTestText(&text, kRecordSizes[ri], &rng);
+        std::vector<uint8> packed(Ooz_CompressBound(text.size())), out(text.size());
+        int n = Ooz_EncoderCompressDict(enc, dict, codec, level, NULL, text.data(), text.size(), packed.data(),
+                                        packed.size());
+        if (!supported) {
+          if (n != -1) {
+            fprintf(stderr, "selftest: %s level %d has no encoder but compressed with a dictionary\n",
+                    CompressorName(codec), level);
+            ok = false;
+          }
+          break;
+        }
+        if (n <= 0 || Ooz_DecoderDecompressDict(dec, dict, packed.data(), n, out.data(), out.size()) !=
+                          (int)out.size() || out != text) {
+          fprintf(stderr, "selftest: %s level %d doesn't round-trip with a dictionary\n", CompressorName(codec),
+                  level);
+          ok = false;
+        }
+      }
+      pairs += supported && ok;
+    }
+  }
+  if (ok && !arg_quiet)
+    fprintf(stderr, "selftest: %d codec and level pairs round-trip with a dictionary\n", pairs);
+  Ooz_DecoderDestroy(dec);
+  Ooz_EncoderDestroy(enc);
+  Ooz_DictionaryDestroy(dicts[1]);
+  Ooz_DictionaryDestroy(dicts[0]);
+  return ok;
+}
+
+// |size| bytes of memory that end right before an unreadable page, so
+// reading or writing past the end faults.
+struct GuardedBuffer {
+  uint8 *data = NULL;
+  size_t size = 0;
+  uint8 *base = NULL;
+  size_t mapped = 0;
+
+  GuardedBuffer() {}
+  GuardedBuffer(const GuardedBuffer &) = delete;
+  GuardedBuffer &operator=(const GuardedBuffer &) = delete;
+  ~GuardedBuffer() { Free(); }
+
+  bool Alloc(size_t n) {
+    Free();
+#if defined(_MSC_VER)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    size_t page = si.dwPageSize;
+#else
+    size_t page = sysconf(_SC_PAGESIZE);
+#endif
+    size_t body = (n + page - 1) / page * page;
+#if defined(_MSC_VER)
+    DWORD old_protect;
+    base = (uint8*)VirtualAlloc(NULL, body + page, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (base && !VirtualProtect(base + body, page, PAGE_NOACCESS, &old_protect)) {
+      VirtualFree(base, 0, MEM_RELEASE);
+      base = NULL;
+    }
+#else
+    base = (uint8*)mmap(NULL, body + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+      base = NULL;
+    else if (mprotect(base + body, page, PROT_NONE) != 0) {
+      munmap(base, body + page);
+      base = NULL;
+    }
+#endif
+    if (!base) {
+      fprintf(stderr, "selftest: can't map a guard page\n");
+      return false;
+    }
+    mapped = body + page;
+    data = base + body - n;
+    size = n;
+    return true;
+  }
+
+  void Free() {
+    if (base) {
+#if defined(_MSC_VER)
+      VirtualFree(base, 0, MEM_RELEASE);
+#else
+      munmap(base, mapped);
+#endif
+    }
+    base = data = NULL;
+    size = mapped = 0;
+  }
+};
+
+// Compresses input that ends right before an unreadable page with each match
+// finder, which must not read past the end of the input.
+static bool SelfTestMatchFinderEnd() {
+  static const int kMatchFinders[] = {
+    OOZ_MATCH_FINDER_DEFAULT, OOZ_MATCH_FINDER_SUFFIX_ARRAY, OOZ_MATCH_FINDER_BINARY_TREE,
+  };
+  const size_t kSize = 0x40000;
+  GuardedBuffer mem;
+  if (!mem.Alloc(kSize))
+    return false;
+  uint64 rng = 2;
+  std::vector<uint8> text;
+  SelfTestText(&text, kSize, &rng);
+  memcpy(mem.data, text.data(), kSize);
+  std::vector<uint8> packed(Ooz_CompressBound(kSize)), out(kSize);
+  bool ok = true;
+  for (int match_finder : kMatchFinders) {
+    OozCompressOptions opts;
+    Ooz_CompressOptionsDefault(&opts, 5);
+    opts.match_finder = match_finder;
+    int n = Ooz_Compress(OOZ_COMPRESSOR_KRAKEN, 5, &opts, mem.data, kSize, packed.data(), packed.size());
+    if (n <= 0 || Ooz_Decompress(packed.data(), n, out.data(), out.size(), 0, 0, 0, NULL, 0, NULL, NULL, NULL,
+                                 0, 0) != (int)kSize || out != text) {
+      fprintf(stderr, "selftest: match finder %d doesn't round-trip input ending at a page\n", match_finder);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// Decodes |src_len| bytes of |src| into exactly |dst_size| bytes. Both the
+// input and the output end right before an unreadable page, so a decoder
+// reading or writing past either end crashes the selftest. Returns false if
+// the decoder claims more output than there was room for.
+static bool SelfTestDecodeGuarded(const uint8 *src, size_t src_len, size_t dst_size, GuardedBuffer *in,
+                                  GuardedBuffer *out) {
+  if ((in->size != src_len && !in->Alloc(src_len)) || (out->size != dst_size && !out->Alloc(dst_size)))
+    return false;
+  memcpy(in->data, src, src_len);
+  int n = Ooz_Decompress(in->data, (int)src_len, out->data, dst_size, 0, 0, 0, NULL, 0, NULL, NULL, NULL, 0, 0);
+  return n <= (int)dst_size;
+}
+
+// Decodes corrupt streams into exactly sized output. Streams from every codec
+// get bits flipped, bytes of their headers changed and are cut short, and are
+// decoded into room for all, or part, of the output. LZNA and Bitknit have no
+// encoder, so their streams are a valid header followed by random bytes. Any
+// result is fine as long as the decoder stays inside both buffers.
+static bool SelfTestCorruptStreams() {
+  static const int kCodecs[] = {
+    OOZ_COMPRESSOR_KRAKEN, OOZ_COMPRESSOR_MERMAID, OOZ_COMPRESSOR_SELKIE, OOZ_COMPRESSOR_HYDRA,
+    OOZ_COMPRESSOR_LEVIATHAN,
+  };
+  static const int kLevels[] = { 1, 4, 7 };
+  uint64 rng = 4;
+  std::vector<uint8> text, packed, bad;
+  GuardedBuffer in, out;
+  // Past one 256k block, so some edits land in the second block's headers.
+  SelfTestText(&text, 0x41000, &rng);
+  packed.resize(Ooz_CompressBound(text.size()));
+  int streams = 0;
+  for (int codec : kCodecs) {
+    for (int level : kLevels) {
+      int n = Ooz_Compress(codec, level, NULL, text.data(), text.size(), packed.data(), packed.size());
+      if (n <= 0 || !SelfTestDecodeGuarded(packed.data(), n, text.size(), &in, &out) ||
+          memcmp(out.data, text.data(), text.size()) != 0) {
+        fprintf(stderr, "selftest: %s level %d doesn't round-trip into exactly sized output\n",
+                CompressorName(codec), level);
+        return false;
+      }
+      for (int i = 0; i < 400; i++) {
+        bad.assign(packed.begin(), packed.begin() + n);
+        size_t dst_size = text.size();
+        switch (i & 3) {
+        case 0:
+          for (int k = SelfTestRandom(&rng) % 4; k >= 0; k--)
+            bad[SelfTestRandom(&rng) % bad.size()] ^= 1 << (SelfTestRandom(&rng) & 7);
+          break;
+        case 1:
+          bad[SelfTestRandom(&rng) % std::min<size_t>(bad.size(), 8)] = (uint8)SelfTestRandom(&rng);
+          break;
+        case 2:
+          bad.resize(SelfTestRandom(&rng) % bad.size());
+          break;
+        case 3:
+          bad[SelfTestRandom(&rng) % bad.size()] = (uint8)SelfTestRandom(&rng);
+          dst_size = 1 + SelfTestRandom(&rng) % text.size();
+          break;
+        }
+        if (!SelfTestDecodeGuarded(bad.data(), bad.size(), dst_size, &in, &out)) {
+          fprintf(stderr, "selftest: %s level %d decoded a corrupt stream past its output\n",
+                  CompressorName(codec), level);
+          return false;
+        }
+        streams++;
+      }
+    }
+  }
+
+  // LZNA (5) and Bitknit (11) quanta are 16k: a block header that restarts
+  // the decoder, a quantum header giving the compressed size and that many
+  // random bytes. Random commands soon fail, so most outputs are short enough
+  // for the first few commands to reach the end.
+  static const int kDecoderTypes[] = { 5, 11 };
+  for (int decoder_type : kDecoderTypes) {
+    for (int i = 0; i < 2000; i++) {
+      size_t dst_size = 2 + SelfTestRandom(&rng) % ((i & 3) ? 32 : 0x4000);
+      size_t comp_size = 1 + SelfTestRandom(&rng) % (dst_size - 1);
+      bad.assign(4 + comp_size, 0);
+      bad[0] = 0x8C;
+      bad[1] = (uint8)decoder_type;
+      bad[2] = (uint8)((comp_size - 1) >> 8);
+      bad[3] = (uint8)(comp_size - 1);
+      for (size_t k = 4; k < bad.size(); k++)
+        bad[k] = (uint8)SelfTestRandom(&rng);
+      if (!SelfTestDecodeGuarded(bad.data(), bad.size(), dst_size, &in, &out)) {
+        fprintf(stderr, "selftest: decoder type %d decoded a random stream past its output\n", decoder_type);
+        return false;
+      }
+      streams++;
+    }
+  }
+  if (!arg_quiet)
+    fprintf(stderr, "selftest: %d corrupt streams decoded inside their buffers\n", streams);
+  return true;
+}
+
+// Decodes with phase 1 on a pooled worker, for streams longer than the ring so
+// phase 1 has to wait for free slots. Each stream is decoded several times to
+// reuse the worker, then bits are flipped so one of the phases fails while the
+// other may be waiting on it.
+static bool SelfTestThreadedDecode() {
+  static const int kCodecs[] = { OOZ_COMPRESSOR_KRAKEN, OOZ_COMPRESSOR_LEVIATHAN, OOZ_COMPRESSOR_MERMAID };
+  static const int kLevels[] = { 1, 4 };
+  uint64 rng = 5;
+  std::vector<uint8> text, bad;
+  SelfTestText(&text, (KRAKEN_PHASE_SLOTS + 2) * 0x20000 + 0x1234, &rng);
+  std::vector<uint8> packed(Ooz_CompressBound(text.size())), out(text.size());
+  int streams = 0;
+  for (int codec : kCodecs) {
+    for (int level : kLevels) {
+      int n = Ooz_Compress(codec, level, NULL, text.data(), text.size(), packed.data(), packed.size());
+      for (int i = 0; i < 8; i++) {
+        std::fill(out.begin(), out.end(), 0);
+        if (n <= 0 || Ooz_DecompressThreaded(packed.data(), n, out.data(), out.size()) != (int)out.size() ||
+            out != text) {
+          fprintf(stderr, "selftest: %s level %d doesn't round-trip on two threads\n",
+                  CompressorName(codec), level);
+          return false;
+        }
+      }
+      for (int i = 0; i < 40; i++) {
+        bad.assign(packed.begin(), packed.begin() + n);
+        for (int k = SelfTestRandom(&rng) % 4; k >= 0; k--)
+          bad[SelfTestRandom(&rng) % bad.size()] ^= 1 << (SelfTestRandom(&rng) & 7);
+        int m = Ooz_DecompressThreaded(bad.data(), bad.size(), out.data(), out.size());
+        if (m != -1 && m != (int)out.size()) {
+          fprintf(stderr, "selftest: %s level %d returned %d for a corrupt stream on two threads\n",
+                  CompressorName(codec), level, m);
+          return false;
+        }
+        streams++;
+      }
+    }
+  }
+  if (!arg_quiet)
+    fprintf(stderr, "selftest: %d corrupt streams decoded on two threads\n", streams);
+  return true;
+}
+
+static bool RunSelfTests() {
+  bool ok = true;
+  ok &= SelfTestTansKernels();
+  ok &= SelfTestCompressLevels();
+  ok &= SelfTestCostProfile();
+  ok &= SelfTestDictionary();
+  ok &= SelfTestMatchFinderEnd();
+  ok &= SelfTestCorruptStreams();
+  ok &= SelfTestThreadedDecode();
+  fprintf(stderr, "selftest: %s\n", ok ? "OK" : "FAILED");
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
   int argi;
 
   if (argc < 2 || 
       (argi = ParseCmdLine(argc, argv)) < 0 || 
-      argi >= argc ||  // no files
-      (arg_direction != 'b' && (argc - argi) > 2) ||  // too many files
-      (arg_direction == 't' && (argc - argi) != 2)     // missing argument for verify
+      (argi >= argc && !arg_selftest) ||  // no files
+      (!arg_bench && !arg_jobs && !arg_calibrate && (argc - argi) > 2) ||  // too many files
+      (arg_direction == 't' && (arg_jobs || (argc - argi) != 2)) ||    // missing argument for verify
+      (arg_jobs && arg_stdout) ||
+      (arg_jobs && arg_bench)  // benchmarks time one file at a time
       ) {
     fprintf(stderr, "ooz v7.1 - compressor by Rarten\n\n"
       "Usage: ooz [options] input [output]\n"
+      "       ooz -j<n> [options] input...\n"
       " -c --stdout              write to stdout\n"
       " -d --decompress          decompress (default)\n"
       " -z --compress            compress\n"
-      " -b                       just benchmark, don't overwrite anything\n"
+      " -b                       just benchmark, don't overwrite anything. Times decoding\n"
+      "                          compressed input on one thread and on two, or with -z\n"
+      "                          compressing raw input and decoding the result for each\n"
+      "                          -m codec and --levels level\n"
+      " --iters=<n>              timed benchmark runs (default 5)\n"
+      " --warmup=<n>             untimed benchmark runs before them (default 1)\n"
+      " --levels=<list>          levels to benchmark, as in 1,4-6\n"
+      " --json=<file>            also write the benchmark results as JSON\n"
+      " -j<n> --jobs=<n>         process <n> files at once, one per core without <n>.\n"
+      "                          Compressing writes input.ooz, decompressing writes the\n"
+      "                          input without .ooz or with .out added. Not with -b\n"
+      " --mem=<MB>               input size processed at once with -j (default 1024)\n"
+      " -T<n> --threads=<n>      compress each file on <n> threads, one per core with 0.\n"
+      "                          The output is the same for any number of threads\n"
       " -f                       force overwrite existing file\n"
       " --dll                    decompress with the dll\n"
       " --verify                 decompress and verify that it matches output\n"
       " --verify=<folder>        verify with files in this folder\n"
-      " -<1-9> --level=<-4..10>  compression level\n"
+      " --crc                    store a checksum with each compressed quantum\n"
+      " --seekable[=<size>]      compress into chunks of <size> bytes (default 262144)\n"
+      "                          that can be decoded separately and in parallel\n"
+      " -<1-9> --level=<-4..10>  compression level. Kraken has no 0 or -4 and Leviathan\n"
+      "                          starts at 1\n"
       " -m<k>                    [k|m|s|l|h] compressor selection\n"
-      " --kraken --mermaid --selkie --leviathan --hydra    compressor selection\n\n"
-      "(Warning! not fuzz safe, so please trust the input)\n"
+      " --kraken --mermaid --selkie --leviathan --hydra    compressor selection\n"
+      " --calibrate=<file>       time decoding the input files on this machine and\n"
+      "                          write a cost profile fitted to it\n"
+      " --cost-profile=<file>    weigh decode time as measured by --calibrate\n"
+      " --match-finder=<default|sa|bt> at levels 5 and up, search with a suffix\n"
+      "                          array, which needs less memory than the trie, or\n"
+      "                          with binary trees, finding more than hashing.\n"
+      "                          With -b each one given is benchmarked\n"
+      " --selftest               check the decode kernels, every codec and level and\n"
+      "                          corrupt input, then exit\n\n"
+      "Corrupt input is rejected without reading or writing out of bounds.\n"
       );
     return 1;
   }
-  bool write_mode = (argi + 1 < argc) && (arg_direction != 't' && arg_direction != 'b');
 
-  if (!arg_force && write_mode) {
-    struct stat sb;
-    if (stat(argv[argi + 1], &sb) >= 0) {
-      fprintf(stderr, "file %s already exists, skipping.\n", argv[argi + 1]);
-      return 1;
-    }
-  }
-
-  int nverify = 0;
+  if (arg_selftest)
+    return RunSelfTests() ? 0 : 1;
 
-  for (; argi < argc; argi++) {
-    const char *curfile = argv[argi];
+  if (arg_direction == 'z' && !arg_bench && !CompressLevelSupported(arg_compressor, arg_level))
+    error("the compressor has no encoder for this level");
 
-    int input_size;
-    byte *input = load_file(curfile, &input_size);
+  if (arg_dll)
+    LoadLib();
 
-    byte *output = NULL;
-    int outbytes = 0;
-
-    if (arg_direction == 'z') {
-      // compress using the dll
-      if (arg_dll)
-        LoadLib();
-      output = new byte[input_size + 65536];
-      if (!output) error("memory error", curfile);
-      *(uint64*)output = input_size;
-      QueryPerformanceCounter((LARGE_INTEGER*)&start);
-      if (arg_dll) {
-        outbytes = OodLZ_Compress(arg_compressor, input, input_size, output + 8, arg_level, 0, 0, 0, 0, 0);
-      } else {
-        outbytes = CompressBlock(arg_compressor, input, output + 8, input_size, arg_level, 0, 0, 0);
-      }
-      if (outbytes < 0) error("compress failed", curfile);
-      outbytes += 8;
-      QueryPerformanceCounter((LARGE_INTEGER*)&end);
-      QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
-      double seconds = (double)(end - start) / freq;
-      if (!arg_quiet)
-        fprintf(stderr, "%-20s: %8d => %8d (%.2f seconds, %.2f MB/s)\n", argv[argi], input_size, outbytes, seconds, input_size * 1e-6 / seconds);
-    } else {
-      if (arg_dll)
-        LoadLib();
+  if (arg_cost_profile) {
+    cost_platforms = CostProfile_Read(arg_cost_profile);
+    if (cost_platforms < 0)
+      error("error reading cost profile", arg_cost_profile);
+  }
+  if (arg_calibrate)
+    return CalibrateCostProfile(argv + argi, argc - argi) ? 0 : 1;
 
-      // stupidly attempt to autodetect if file uses 4-byte or 8-byte header,
-      // the previous version of this tool wrote a 4-byte header.
-      int hdrsize = *(uint64*)input >= 0x10000000000 ? 4 : 8;
-      
-      uint64 unpacked_size = (hdrsize == 8) ? *(uint64*)input : *(uint32*)input;
-      if (unpacked_size > (hdrsize == 4 ? 52*1024*1024 : 1024 * 1024 * 1024)) 
-        error("file too large", curfile);
-      output = new byte[unpacked_size + SAFE_SPACE];
-      if (!output) error("memory error", curfile);
+  if (arg_json) {
+    bench_json = fopen(arg_json, "w");
+    if (!bench_json) error("file open for write error", arg_json);
+    fprintf(bench_json, "{\n  \"tool\": \"ooz v7.1\",\n  \"cpu\": \"%s\",\n  \"iters\": %d,\n  \"warmup\": %d,\n  \"results\": [",
+            CpuFeaturesName(CpuFeatures()), arg_iters, arg_warmup);
+  }
 
-      QueryPerformanceCounter((LARGE_INTEGER*)&start);
+  FileTotals totals = {};
+  bool ok = true;
+  auto start = std::chrono::steady_clock::now();
 
-      if (arg_dll) {
-        outbytes = OodLZ_Decompress(input + hdrsize, input_size - hdrsize, output, unpacked_size, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-      } else {
-        outbytes = Kraken_Decompress(input + hdrsize, input_size - hdrsize, output, unpacked_size);
-      }
-      if (outbytes != unpacked_size)
-        error("decompress error", curfile);
-      QueryPerformanceCounter((LARGE_INTEGER*)&end);
-      QueryPerformanceFrequency((LARGE_INTEGER*)&freq);
-      double seconds = (double)(end - start) / freq;
-      if (!arg_quiet)
-        fprintf(stderr, "%-20s: %8d => %8d (%.2f seconds, %.2f MB/s)\n", argv[argi], input_size, (int)unpacked_size, seconds, unpacked_size * 1e-6 / seconds);
-    }
-
-    if (verifyfolder) {
-      // Verify against the file in verifyfolder with the same basename excluding extension
-      char buf[1024];
-      const char *basename = curfile;
-      for(const char *s = curfile; *s; s++)
-        if (*s == '/' || *s == '\\')
-          basename = s + 1;
-      const char *ext = strrchr(basename, '.');
-      snprintf(buf, sizeof(buf), "%s/%.*s", verifyfolder, (int)(ext ? (ext - basename) : strlen(basename)), basename);
-      if (!Verify(buf, output, outbytes, curfile))
-        return 1;
-      nverify++;
-    }
+  LzEncoder *enc = LzEncoder_Create(kEncoderMemoryLimit);
+  if (arg_jobs) {
+    ok = ProcessFilesParallel(argv + argi, argc - argi, &totals);
+  } else if (argi + 1 < argc && !arg_bench) {
+    // input and output, or the file to verify against
+    if (arg_direction == 't')
+      ok = ProcessFile(argv[argi], NULL, argv[argi + 1], &totals, enc);
+    else
+      ok = ProcessFile(argv[argi], argv[argi + 1], NULL, &totals, enc);
+  } else {
+    for (; ok && argi < argc; argi++)
+      ok = ProcessFile(argv[argi], NULL, NULL, &totals, enc);
+  }
+  LzEncoder_Destroy(enc);
 
-    if (arg_stdout && arg_direction != 't' && arg_direction != 'b')
-      fwrite(output, 1, outbytes, stdout);
+  if (bench_json) {
+    fprintf(bench_json, "\n  ]\n}\n");
+    fclose(bench_json);
+  }
 
-    if (write_mode) {
-      if (arg_direction == 't') {
-        if (!Verify(argv[argi + 1], output, outbytes, curfile))
-          return 1;
-        fprintf(stderr, "%s: Verify OK\n", curfile);
-      } else {
-        FILE *f = fopen(argv[argi + 1], "wb");
-        if (!f) error("file open for write error", argv[argi + 1]);
-        if (fwrite(output, 1, outbytes, f) != outbytes)
-          error("file write error", argv[argi + 1]);
-        fclose(f);
-      }
-      break;
-    }
-    delete[] input;
-    delete[] output;
+  if (arg_jobs && !arg_quiet) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "%d files: %lld => %lld (%.2f seconds, %.2f MB/s)\n", (int)totals.files,
+            (long long)totals.in_bytes, (long long)totals.out_bytes, seconds, totals.raw_bytes * 1e-6 / seconds);
   }
 
-  if (nverify)
-    fprintf(stderr, "%d files verified OK!\n", nverify);
+  if (!ok)
+    return 1;
+  if (totals.verified)
+    fprintf(stderr, "%d files verified OK!\n", (int)totals.verified);
   return 0;
 }
 
@@ -173,37 +173,47 @@ void LZNA_InitLookup(LznaState *lut) {
 struct LznaBitReader {
   uint64 bits_a, bits_b;
   const uint32 *src, *src_start;
+  const byte *src_end;
 };
 
 // Initialize bit reader with 2 parallel streams. Every decode operation
 // swaps the two streams.
-static void LznaBitReader_Init(LznaBitReader *tab, const byte *src) {
+static bool LznaBitReader_Init(LznaBitReader *tab, const byte *src, const byte *src_end) {
   int d, n, i;
   uint64 v;
   
   tab->src_start = (uint32*)src;
+  tab->src_end = src_end;
 
+  if (src_end - src < 1)
+    return false;
   d = *src++;
   n = d >> 4;
-  assert(n <= 8);
+  if (n > 8 || src_end - src < n + 1)
+    return false;
   for (i = 0, v = 0; i < n; i++)
     v = (v << 8) | *src++;
   tab->bits_a = (v << 4) | (d & 0xF);
 
   d = *src++;
   n = d >> 4;
-  assert(n <= 8);
+  if (n > 8 || src_end - src < n)
+    return false;
   for (i = 0, v = 0; i < n; i++)
     v = (v << 8) | *src++;
   tab->bits_b = (v << 4) | (d & 0xF);
   tab->src = (uint32*)src;
+  return true;
 }
 
-// Renormalize by filling up the RANS state and swapping the two streams
+// Renormalize by filling up the RANS state and swapping the two streams. Reads past
+// the end return zeros, the caller notices from the number of bytes used.
 static void __forceinline LznaRenormalize(LznaBitReader *tab) {
   uint64 x = tab->bits_a;
-  if (x < 0x80000000)
-    x = (x << 32) | *tab->src++;
+  if (x < 0x80000000) {
+    x = (x << 32) | ((const byte*)(tab->src + 1) <= tab->src_end ? *tab->src : 0);
+    tab->src++;
+  }
   tab->bits_a = tab->bits_b;
   tab->bits_b = x;
 }
@@ -442,6 +452,14 @@ static void LznaCopy4to12(byte *dst, size_t dist, size_t length) {
   }
 }
 
+// Copies exactly |length| bytes, for matches that end within a wide copy of
+// the end of the output.
+static void LznaCopyExact(byte *dst, size_t dist, size_t length) {
+  const byte *src = dst - dist;
+  for (size_t i = 0; i < length; i++)
+    dst[i] = src[i];
+}
+
 static void LznaPreprocessMatchHistory(LznaState *lut) {
   if (lut->match_history[4] >= 0xc000) {
     size_t i = 0;
@@ -475,7 +493,8 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
   uint32 dist;
 
   LznaPreprocessMatchHistory(lut);
-  LznaBitReader_Init(&tab, src_in);
+  if (!LznaBitReader_Init(&tab, src_in, src_end))
+    return -1;
   dist = lut->match_history[4];
 
   state = 5;
@@ -507,6 +526,8 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
           // Copy count 3-4
           length = 3 + LznaRead1Bit(&tab, &lut->short_length[state][dst_offs & 3], 14, 4);
           dist = LznaReadNearDistance(&tab, lut, &lut->near_dist[length - 3]);
+          if (dist > dst_offs)
+            return -1;
           dst[0] = (dst - dist)[0];
           dst[1] = (dst - dist)[1];
           dst[2] = (dst - dist)[2];
@@ -515,16 +536,27 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
           // Copy count 5-12
           length = 5 + LznaRead3bit(&tab, &lut->medium_length);
           dist = LznaReadFarDistance(&tab, lut);
-          if (dist >= 8) {
+          if (dist > dst_offs)
+            return -1;
+          // The 16 byte copy only fits when the output goes on for 8 more bytes
+          // and LznaCopy4to12's 12 bytes when it goes on for 4, so closer to
+          // the end the match is checked against the room left.
+          if (dist >= 8 && dst_end - dst >= 8) {
             ((uint64*)dst)[0] = ((uint64*)(dst - dist))[0];
             ((uint64*)dst)[1] = ((uint64*)(dst - dist))[1];
-          } else {
+          } else if (dst_end - dst >= 4) {
             LznaCopy4to12(dst, dist, length);
+          } else {
+            if (length > (size_t)(dst_end + 8 - dst))
+              return -1;
+            LznaCopyExact(dst, dist, length);
           }
         } else {
           // Copy count 13-
           length = LznaReadLength(&tab, &lut->long_length, dst_offs) + 13;
           dist = LznaReadFarDistance(&tab, lut);
+          if (dist > dst_offs || length > (uintptr_t)(dst_end - dst))
+            return -1;
           if (dist >= 8)
             LznaCopyLongDist(dst, dist, length);
           else
@@ -560,6 +592,8 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
         if (x & 1) {
           // Copy 11- bytes from recent distance
           length = 11 + LznaReadLength(&tab, &lut->long_length_recent, dst_offs);
+          if (length > (uintptr_t)(dst_end - dst))
+            return -1;
           if (dist >= 8) {
             LznaCopyLongDist(dst, dist, length);
           } else {
@@ -568,11 +602,15 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
         } else {
           // Copy 3-10 bytes from recent distance
           length = 3 + LznaRead3bit(&tab, &lut->short_length_recent[idx].a[dst_offs & 3]);
-          if (dist >= 8) {
+          if (dist >= 8 && dst_end - dst >= 8) {
             ((uint64*)dst)[0] = ((uint64*)(dst - dist))[0];
             ((uint64*)dst)[1] = ((uint64*)(dst - dist))[1];
-          } else {
+          } else if (dst_end - dst >= 4) {
             LznaCopy4to12(dst, dist, length);
+          } else {
+            if (length > (size_t)(dst_end + 8 - dst))
+              return -1;
+            LznaCopyExact(dst, dist, length);
           }
         }
         state = (state >= 7) ? 11 : 8;
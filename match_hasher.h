@@ -22,9 +22,20 @@ public:
     hash_mask_ = (1 << bits) - NumHash;
     k = std::max(std::min(k > 0 ? k : 4, 8), 1);
     hashmult_ = 0xCF1BBCDCB7A56463ull << (8 * (8 - k));
-    malloced_ptr_ = malloc(sizeof(uint32) * (1 << bits) + 64);
+    // A table from an earlier call is kept if it's big enough.
+    if (bits > alloc_bits_) {
+      free(malloced_ptr_);
+      malloced_ptr_ = malloc(sizeof(uint32) * (1 << bits) + 64);
+      alloc_bits_ = bits;
+    }
     hash_ptr_ = (uint32*)(((uintptr_t)malloced_ptr_ + 63) & ~63);
     memset(hash_ptr_, 0, sizeof(uint32) * (1 << bits));
+    src_base_ = src_cur_ = 0;
+    hashentry_ptr_next_ = hashentry2_ptr_next_ = 0;
+  }
+
+  size_t AllocatedBytes() const {
+    return malloced_ptr_ ? sizeof(uint32) * (1 << alloc_bits_) + 64 : 0;
   }
 
   struct HashPos {
@@ -154,6 +165,7 @@ public:
   }
 public:
   void *malloced_ptr_ = 0;
+  int alloc_bits_ = 0;
   uint32 *hash_ptr_ = 0;
   int hash_bits_;
   uint32 hash_mask_;
@@ -185,15 +197,29 @@ public:
     longhash_mask_ = (1 << b_bits) - 1;
     nexthash_mask_ = (1 << c_bits) - 1;
 
-    firsthash_ = new uint32[1 << a_bits];
-    longhash_ = new uint32[1 << b_bits];
-    nexthash_ = new uint16[1 << c_bits];
+    if (a_bits > firsthash_alloc_bits_) {
+      delete[] firsthash_;
+      firsthash_ = new uint32[1 << a_bits];
+      firsthash_alloc_bits_ = a_bits;
+    }
+    if (b_bits > longhash_alloc_bits_) {
+      delete[] longhash_;
+      longhash_ = new uint32[1 << b_bits];
+      longhash_alloc_bits_ = b_bits;
+    }
+    if (!nexthash_)
+      nexthash_ = new uint16[1 << c_bits];
+    src_base_ = src_cur_ = 0;
 
     memset(firsthash_, 0, sizeof(uint32) * (1 << a_bits));
     memset(longhash_, 0, sizeof(uint32) * (1 << b_bits));
     memset(nexthash_, 0, sizeof(uint16) * (1 << c_bits));
   }
 
+  size_t AllocatedBytes() const {
+    return sizeof(uint32) * ((1 << firsthash_alloc_bits_) + (1 << longhash_alloc_bits_)) + sizeof(uint16) * (1 << 16);
+  }
+
   struct HashPos {
     uint32 pos;
     uint32 hash_a, hash_b, hash_b_hi;
@@ -291,6 +317,8 @@ public:
   uint32 nexthash_mask_;
   uint8 firsthash_bits_;
   uint8 longhash_bits_;
+  int firsthash_alloc_bits_ = 0;
+  int longhash_alloc_bits_ = 0;
 };
 
 
@@ -298,6 +326,11 @@ template<typename T>
 class FastMatchHasher {
 public:
   typedef T ElemType;
+
+  ~FastMatchHasher() {
+    free(malloced_ptr_);
+  }
+
   void AllocateHash(int bits, int k) {
     hash_bits_ = bits;
     if (k == 0)
@@ -307,9 +340,18 @@ public:
     } else {
       hashmult_ = 0x9E3779B100000000ull;
     }
-    malloced_ptr_ = malloc(sizeof(T) * (1 << bits) + 64);
+    if (bits > alloc_bits_) {
+      free(malloced_ptr_);
+      malloced_ptr_ = malloc(sizeof(T) * (1 << bits) + 64);
+      alloc_bits_ = bits;
+    }
     hash_ptr_ = (T*)(((uintptr_t)malloced_ptr_ + 63) & ~63);
     memset(hash_ptr_, 0, sizeof(T) * (1 << bits));
+    src_base_ = 0;
+  }
+
+  size_t AllocatedBytes() const {
+    return malloced_ptr_ ? sizeof(T) * (1 << alloc_bits_) + 64 : 0;
   }
 
   void SetBaseWithoutPreload(const uint8 *p) {
@@ -349,6 +391,7 @@ public:
   }
 
   void *malloced_ptr_ = NULL;
+  int alloc_bits_ = 0;
   T *hash_ptr_ = NULL;
   const uint8 *src_base_;
   uint64 hashmult_;
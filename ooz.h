@@ -0,0 +1,267 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined _WIN32 || defined __CYGWIN__
+#ifdef OOZ_DYNAMIC
+#ifdef OOZ_BUILD_DLL
+#ifdef __GNUC__
+#define OOZ_DLL_PUBLIC __attribute__ ((dllexport))
+#else
+#define OOZ_DLL_PUBLIC __declspec(dllexport) // Note: actually gcc seems to also supports this syntax.
+#endif
+#else
+#ifdef __GNUC__
+#define OOZ_DLL_PUBLIC __attribute__ ((dllimport))
+#else
+#define OOZ_DLL_PUBLIC __declspec(dllimport) // Note: actually gcc seems to also supports this syntax.
+#endif
+#endif
+#define OOZ_DLL_LOCAL
+#else
+#define OOZ_DLL_PUBLIC
+#define OOZ_DLL_LOCAL
+#endif
+#else
+#if __GNUC__ >= 4
+#define OOZ_DLL_PUBLIC __attribute__ ((visibility ("default")))
+#define OOZ_DLL_LOCAL  __attribute__ ((visibility ("hidden")))
+#else
+#define OOZ_DLL_PUBLIC
+#define OOZ_DLL_LOCAL
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Values for |threadPhase|. Anything else decodes both phases in the one call.
+enum {
+  OOZ_THREADPHASE_1 = 1,
+  OOZ_THREADPHASE_2 = 2,
+  OOZ_THREADPHASE_ALL = 3,
+};
+
+// Oodle compatible entry point. If |decoderMemory| is supplied and at least
+// Ooz_DecoderMemorySize() bytes it is used as scratch instead of the heap.
+// With OOZ_THREADPHASE_1/2 it must be the shared block described at
+// Ooz_ThreadPhaseMemorySize(). |fuzz| is ignored, see Ooz_IsFuzzSafe().
+OOZ_DLL_PUBLIC int Ooz_Decompress(uint8_t const *src_buf, int src_len, uint8_t *dst, size_t dst_size,
+                                  int fuzz, int crc, int verbose,
+                                  uint8_t *dst_base, size_t e, void *cb, void *cb_ctx,
+                                  void *decoderMemory, size_t decoderMemorySize, int threadPhase);
+
+// Nonzero if decoding never reads past |src_len| or writes more than 64 bytes past
+// |dst_size|, whatever the input. Corrupt streams fail with -1 instead. Callers can
+// then hand read only or memory mapped input straight to the decoder. ooz
+// --selftest checks this and Ooz_IsExactBounds() on corrupt streams.
+OOZ_DLL_PUBLIC int Ooz_IsFuzzSafe(void);
+
+// Nonzero if decoding never writes past |dst_size|, valid input or not, so |dst| can be
+// an exactly sized buffer such as a memory mapped output file. Decoders without this
+// export need 64 bytes of scratch space after it.
+OOZ_DLL_PUBLIC int Ooz_IsExactBounds(void);
+
+// A decoder holds the scratch memory needed to decompress a stream and can be
+// reused for any number of streams without touching the heap. A decoder must
+// only be used by one thread at a time, create one per thread to decode in parallel.
+typedef struct OozDecoder OozDecoder;
+
+// Number of bytes needed for caller provided decoder memory.
+OOZ_DLL_PUBLIC size_t Ooz_DecoderMemorySize(void);
+
+// Creates a decoder inside |memory|, which must be at least Ooz_DecoderMemorySize()
+// bytes and outlive the decoder. If |memory| is NULL the decoder allocates its own.
+OOZ_DLL_PUBLIC OozDecoder *Ooz_DecoderCreate(void *memory, size_t memory_size);
+OOZ_DLL_PUBLIC void Ooz_DecoderDestroy(OozDecoder *dec);
+
+// Decompresses a whole stream into |dst|, writing nothing past |dst_size|.
+// Returns the number of bytes written or -1 on error.
+OOZ_DLL_PUBLIC int Ooz_DecoderDecompress(OozDecoder *dec, uint8_t const *src, size_t src_len, uint8_t *dst, size_t dst_size);
+
+// Decompresses a Kraken or Leviathan stream on two threads: a worker does the entropy
+// decoding (phase 1) while the calling thread copies matches (phase 2) a few chunks
+// behind it. Other codecs work too but their quantums all run in phase 2.
+OOZ_DLL_PUBLIC int Ooz_DecompressThreaded(uint8_t const *src, size_t src_len, uint8_t *dst, size_t dst_size);
+
+// Decoder memory needed to split a decode with |threadPhase|. Call Ooz_Decompress with
+// OOZ_THREADPHASE_1 and OOZ_THREADPHASE_2 concurrently on two threads, passing the same
+// block to both. The block must be set up with Ooz_ThreadPhaseInit before either
+// call starts.
+OOZ_DLL_PUBLIC size_t Ooz_ThreadPhaseMemorySize(void);
+
+// Prepares a block of Ooz_ThreadPhaseMemorySize() bytes for one split decode.
+// Returns 0, or -1 if the block is NULL or too small.
+OOZ_DLL_PUBLIC int Ooz_ThreadPhaseInit(void *memory, size_t memory_size);
+
+// Push mode decoder for streams that arrive in pieces or are too large to hold in
+// memory. Only the last |window_size| bytes of output are kept for matches, so the
+// stream must have been compressed with a dictionary no larger than that. A window
+// of 0 keeps the whole output. Memory use is about twice the window plus 256k.
+typedef struct OozStream OozStream;
+
+// |raw_size| is the decompressed size of the stream, which the format doesn't store.
+// Returns NULL if the window doesn't fit in 2GB.
+OOZ_DLL_PUBLIC OozStream *Ooz_StreamCreate(int64_t raw_size, size_t window_size);
+OOZ_DLL_PUBLIC void Ooz_StreamDestroy(OozStream *s);
+
+// Buffers compressed bytes and decodes as far as they allow. Returns the number of
+// bytes taken, which is less than |src_len| when the output must be drained before
+// more input fits, or -1 if the stream is corrupt.
+OOZ_DLL_PUBLIC int Ooz_StreamFeed(OozStream *s, uint8_t const *src, size_t src_len);
+
+// Copies up to |dst_size| decoded bytes to |dst|. Returns the number of bytes copied,
+// 0 when more input is needed, or -1 if the stream is corrupt.
+OOZ_DLL_PUBLIC int Ooz_StreamDrain(OozStream *s, uint8_t *dst, size_t dst_size);
+
+// Returns 1 once the whole stream has been decoded and drained, 0 if it needs more
+// input or draining, and -1 on errors or trailing input.
+OOZ_DLL_PUBLIC int Ooz_StreamFinish(OozStream *s);
+
+// Seekable container written by "ooz -z --seekable". The data is split into chunks
+// compressed as separate streams and a table at the end says where each chunk is,
+// so a byte range can be decoded from just the chunks covering it.
+typedef struct OozSeekable OozSeekable;
+
+// Reads the seek table of |src|, which must stay valid until Ooz_SeekableClose.
+// Returns NULL if |src| isn't a seekable container or its table is inconsistent.
+OOZ_DLL_PUBLIC OozSeekable *Ooz_SeekableOpen(uint8_t const *src, size_t src_len);
+OOZ_DLL_PUBLIC void Ooz_SeekableClose(OozSeekable *s);
+
+// Decompressed size of the whole container, and the number of chunks in it.
+OOZ_DLL_PUBLIC int64_t Ooz_SeekableRawSize(const OozSeekable *s);
+OOZ_DLL_PUBLIC int Ooz_SeekableChunkCount(const OozSeekable *s);
+
+// Decodes |len| bytes starting at decompressed offset |offset| into |dst|, which
+// needs no slack past |len|. Returns |len|, or -1 if the range is out of bounds or
+// a chunk is corrupt. Safe to call from several threads on the same container.
+OOZ_DLL_PUBLIC int64_t Ooz_SeekableDecodeRange(const OozSeekable *s, int64_t offset, uint8_t *dst, size_t len);
+
+// Decodes the whole container into |dst| with up to |num_threads| threads, one per
+// core if it's 0 or less. Returns the decompressed size or -1 on error.
+OOZ_DLL_PUBLIC int64_t Ooz_SeekableDecompress(const OozSeekable *s, uint8_t *dst, size_t dst_size, int num_threads);
+
+
+// Codecs Ooz_Compress can produce. Hydra picks Kraken, Mermaid or Leviathan
+// for each 256k block, whichever is cheapest in size and decode time.
+enum {
+  OOZ_COMPRESSOR_KRAKEN = 8,
+  OOZ_COMPRESSOR_MERMAID = 9,
+  OOZ_COMPRESSOR_SELKIE = 11,
+  OOZ_COMPRESSOR_HYDRA = 12,
+  OOZ_COMPRESSOR_LEVIATHAN = 13,
+};
+
+// Match finders for levels 5 and up. The default hashes at level 5 and builds a
+// suffix trie above, whose memory grows with how repetitive the input is. The
+// suffix array takes about 9.5 bytes per input byte and finds about the same
+// matches as the trie, in more time. Binary trees search less deeply than either, in 8 bytes per
+// byte of a window of up to 16 MB, finding more than hashing does.
+enum {
+  OOZ_MATCH_FINDER_DEFAULT = 0,
+  OOZ_MATCH_FINDER_SUFFIX_ARRAY = 1,
+  OOZ_MATCH_FINDER_BINARY_TREE = 2,
+};
+
+// Compressor settings. Start from Ooz_CompressOptionsDefault() and change what
+// you need, so fields added later in |reserved| keep their defaults.
+typedef struct OozCompressOptions {
+  // Shortest match to look for, 0 for the codec's choice.
+  int min_match_length;
+  // With |seek_chunk_reset| each |seek_chunk_len| bytes, a power of two, start
+  // without a dictionary so they can be decoded on their own.
+  int seek_chunk_reset;
+  int seek_chunk_len;
+  // Farthest a match may reach back, 0 for no limit.
+  int dictionary_size;
+  // Bytes of output one unit of decode time is worth, higher favors speed.
+  int space_speed_tradeoff_bytes;
+  // Nonzero to store a checksum with each compressed quantum.
+  int make_qh_crc;
+  // Window searched directly at levels 5 and up, beyond it only the long range
+  // matcher enabled by |make_long_range_matcher| finds matches.
+  int max_local_dictionary_size;
+  int make_long_range_matcher;
+  // Size of the match hash table as a power of two, 0 for one based on the level.
+  int hash_bits;
+  // Threads searching for matches at level 5, 0 for one. Only the default
+  // hashing match finder uses them, levels 6 and up and the other match
+  // finders search on one thread.
+  int match_finder_threads;
+  // Decode time model the size is weighed against, 0 for the built in one or
+  // a profile from Ooz_CostProfileLoad.
+  int cost_profile;
+  // OOZ_MATCH_FINDER_*, how matches are searched for at levels 5 and up.
+  int match_finder;
+  int reserved[4];
+} OozCompressOptions;
+
+// Fills |opts| with the settings the compressor uses at |level|.
+OOZ_DLL_PUBLIC void Ooz_CompressOptionsDefault(OozCompressOptions *opts, int level);
+
+// Reads a decode cost profile written by "ooz --calibrate", which fits the
+// compressor's decode time estimates to the machine it ran on. Returns a value
+// for OozCompressOptions.cost_profile, or -1 if the file can't be read. The
+// value stays valid until the process exits and can be used from any thread,
+// it only changes the compressions whose options carry it. Loading is thread
+// safe, and loading the same profile again returns the same value.
+OOZ_DLL_PUBLIC int Ooz_CostProfileLoad(const char *path);
+
+// Size Ooz_Compress needs for the output of |src_len| bytes.
+OOZ_DLL_PUBLIC size_t Ooz_CompressBound(size_t src_len);
+
+// Compresses |src| with |codec| at |level|, higher being smaller and slower,
+// into |dst|, which must hold at least Ooz_CompressBound(src_len) bytes.
+// Mermaid, Selkie and Hydra take levels -4 to 10, where 0 and -4 store the data
+// uncompressed, Kraken -3 to -1 and 1 to 10, and Leviathan 1 to 10. |opts| may
+// be NULL for the level's defaults. Returns the compressed size, or -1 if an
+// argument is out of range. Decode the result with Ooz_Decompress and
+// |src_len| as the output size.
+OOZ_DLL_PUBLIC int Ooz_Compress(int codec, int level, const OozCompressOptions *opts,
+                                uint8_t const *src, size_t src_len, uint8_t *dst, size_t dst_size);
+
+// An encoder keeps the compressor's tables and scratch memory between calls, so
+// compressing many buffers doesn't allocate for each one. After a call that
+// needed more than |memory_limit| bytes all of it is freed. An encoder must
+// only be used by one thread at a time.
+typedef struct OozEncoder OozEncoder;
+
+OOZ_DLL_PUBLIC OozEncoder *Ooz_EncoderCreate(size_t memory_limit);
+OOZ_DLL_PUBLIC void Ooz_EncoderDestroy(OozEncoder *enc);
+
+// Same as Ooz_Compress, using the memory of |enc|.
+OOZ_DLL_PUBLIC int Ooz_EncoderCompress(OozEncoder *enc, int codec, int level, const OozCompressOptions *opts,
+                                       uint8_t const *src, size_t src_len, uint8_t *dst, size_t dst_size);
+
+// Preset dictionary for compressing many small buffers with content in common,
+// such as records of one format. Each buffer is compressed as if it followed
+// the dictionary, and decoding it needs the same dictionary. A dictionary isn't
+// changed after it's created and can be used by any number of threads at once.
+typedef struct OozDictionary OozDictionary;
+
+// Copies |size| bytes, 1 byte to 1GB, into a new dictionary. Returns NULL if
+// |size| is out of range.
+OOZ_DLL_PUBLIC OozDictionary *Ooz_DictionaryCreate(uint8_t const *data, size_t size);
+OOZ_DLL_PUBLIC void Ooz_DictionaryDestroy(OozDictionary *dict);
+
+// Same as Ooz_EncoderCompress with the dictionary as the data before |src|.
+// The encoder keeps a copy of the last dictionary it used, so a call with the
+// same one only copies |src| next to it. Returns -1 with |seek_chunk_reset|,
+// which would drop the dictionary.
+OOZ_DLL_PUBLIC int Ooz_EncoderCompressDict(OozEncoder *enc, const OozDictionary *dict, int codec, int level,
+                                           const OozCompressOptions *opts, uint8_t const *src, size_t src_len,
+                                           uint8_t *dst, size_t dst_size);
+
+// Decompresses the output of Ooz_EncoderCompressDict with the same |dict|. The
+// first call allocates a window in |dec| holding a copy of the dictionary, and
+// calls with the same one decode right after it and copy only the output to
+// |dst|. Decoders created in caller memory must be destroyed to free it.
+// Returns the number of bytes written or -1 on error.
+OOZ_DLL_PUBLIC int Ooz_DecoderDecompressDict(OozDecoder *dec, const OozDictionary *dict, uint8_t const *src,
+                                             size_t src_len, uint8_t *dst, size_t dst_size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,76 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <atomic>
+#include "ooz.h"
+#include "preset_dict.h"
+
+static std::atomic<uint64> preset_dict_next_id(1);
+
+OozDictionary *PresetDict_Create(const uint8 *data, size_t size) {
+  if (size == 0 || size > kPresetDictMaxSize)
+    return NULL;
+  OozDictionary *dict = new OozDictionary;
+  dict->data = new uint8[size];
+  memcpy(dict->data, data, size);
+  dict->size = (int)size;
+  dict->id = preset_dict_next_id++;
+  return dict;
+}
+
+void PresetDict_Destroy(OozDictionary *dict) {
+  if (dict) {
+    delete[] dict->data;
+    delete dict;
+  }
+}
+
+size_t PresetDict_DataOffset(const OozDictionary *dict) {
+  return ((size_t)dict->size + 0x3FFFF) & ~(size_t)0x3FFFF;
+}
+
+size_t PresetDict_HistoryOffset(const OozDictionary *dict) {
+  return PresetDict_DataOffset(dict) - (((size_t)dict->size + 15) & ~(size_t)15);
+}
+
+uint8 *PresetDict_Window(PresetDictWindow *w, const OozDictionary *dict, size_t data_size) {
+  size_t offset = PresetDict_DataOffset(dict);
+  // The decoder takes int offsets.
+  if (data_size > 0x7FFFFFFF - offset)
+    return NULL;
+  if (offset + data_size > w->mem_size) {
+    PresetDict_FreeWindow(w);
+    // Sized in steps of 64k so records of varying size rarely grow it. calloc
+    // leaves the unused part untouched, and reading it is harmless anyway.
+    size_t mem_size = std::min<size_t>((offset + data_size + 0xFFFF) & ~(size_t)0xFFFF, 0x7FFFFFFF);
+    w->mem = (uint8*)calloc(mem_size, 1);
+    if (!w->mem)
+      return NULL;
+    w->mem_size = mem_size;
+  }
+  if (w->dict_id != dict->id) {
+    size_t history = PresetDict_HistoryOffset(dict);
+    memset(w->mem + history, 0, offset - dict->size - history);
+    memcpy(w->mem + offset - dict->size, dict->data, dict->size);
+    w->dict_id = dict->id;
+  }
+  return w->mem;
+}
+
+void PresetDict_FreeWindow(PresetDictWindow *w) {
+  free(w->mem);
+  w->mem = NULL;
+  w->mem_size = 0;
+  w->dict_id = 0;
+}
+
+extern "C" {
+  OOZ_DLL_PUBLIC OozDictionary *Ooz_DictionaryCreate(uint8_t const *data, size_t size) {
+    if (data == NULL)
+      return NULL;
+    return PresetDict_Create(data, size);
+  }
+
+  OOZ_DLL_PUBLIC void Ooz_DictionaryDestroy(OozDictionary *dict) {
+    PresetDict_Destroy(dict);
+  }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+// Preset dictionaries. Data compressed with a dictionary is compressed and
+// decoded in a window that holds the dictionary and then the data. The decoder
+// reads a block header every 256k of output, so the data starts on a 256k
+// boundary of the window and the dictionary ends there:
+//
+//   unused        up to the last 16 byte boundary before the dictionary
+//   zeros         up to 15 bytes, part of the history the compressor sees
+//   dictionary
+//   data          at a multiple of 256k
+//
+// The zeros keep the data's position the same modulo 16 for the compressor and
+// the decoder, which some literal modes depend on. Encoders and decoders each
+// keep a window and only copy a dictionary into it when it changes.
+
+struct OozDictionary {
+  uint8 *data;
+  int size;
+  // Unique for the life of the process, so windows can tell dictionaries apart.
+  uint64 id;
+};
+
+struct PresetDictWindow {
+  uint8 *mem;
+  size_t mem_size;
+  uint64 dict_id;
+};
+
+enum {
+  kPresetDictMaxSize = 0x40000000,
+};
+
+// Copies |size| bytes, 1 to kPresetDictMaxSize, into a new dictionary. Returns
+// NULL if |size| is out of range.
+OozDictionary *PresetDict_Create(const uint8 *data, size_t size);
+void PresetDict_Destroy(OozDictionary *dict);
+
+// Offset of the data in a window for |dict|, and of the first byte before it
+// the compressor may reference.
+size_t PresetDict_DataOffset(const OozDictionary *dict);
+size_t PresetDict_HistoryOffset(const OozDictionary *dict);
+
+// Sets |w| up to hold |dict| with room for |data_size| bytes after it and
+// returns the start of the window, or NULL if the window would exceed 2GB or
+// can't be allocated.
+uint8 *PresetDict_Window(PresetDictWindow *w, const OozDictionary *dict, size_t data_size);
+void PresetDict_FreeWindow(PresetDictWindow *w);
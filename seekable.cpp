@@ -0,0 +1,261 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "ooz.h"
+#include "compress.h"
+#include "seekable.h"
+
+struct SeekableChunk {
+  uint64 comp_offset;
+  uint32 comp_size;
+  uint32 raw_size;
+  int64 raw_offset;
+  // Index of the keyframe chunk this one's stream starts at.
+  int keyframe;
+};
+
+struct OozSeekable {
+  const uint8 *src;
+  int64 raw_size;
+  std::vector<SeekableChunk> chunks;
+};
+
+int64 Seekable_CompressBound(int64 src_size, int chunk_size) {
+  int64 num_chunks = (src_size + chunk_size - 1) / chunk_size;
+  // Same slack per 256k block as the compressor's own output buffers.
+  return kSeekableMagicSize + src_size + 274 * ((src_size + 0x3FFFF) / 0x40000 + num_chunks) +
+         num_chunks * kSeekableEntrySize + kSeekableFooterSize;
+}
+
+struct SeekableWriter {
+  uint8 *dst;
+  int64 dst_size;
+  int64 pos;
+  int64 raw_pos;
+  int64 src_size;
+  int chunk_size;
+  uint8 *entry;
+  int64 table_size;
+};
+
+static bool Seekable_WriteChunk(void *ctx, const uint8 *data, int size) {
+  SeekableWriter *w = (SeekableWriter*)ctx;
+  if (size <= 0 || size > w->dst_size - w->table_size - w->pos)
+    return false;
+  memcpy(w->dst + w->pos, data, size);
+  *(uint64*)&w->entry[0] = w->pos;
+  *(uint32*)&w->entry[8] = size;
+  *(uint32*)&w->entry[12] = (uint32)std::min<int64>(w->chunk_size, w->src_size - w->raw_pos);
+  *(uint32*)&w->entry[16] = (data[0] & 0x80) ? kSeekableFlagKeyframe : 0;
+  w->entry += kSeekableEntrySize;
+  w->pos += size;
+  w->raw_pos += w->chunk_size;
+  return true;
+}
+
+int64 Seekable_Compress(int codec_id, int level, bool crc, int platforms, int chunk_size, int num_threads,
+                        const uint8 *src, int64 src_size, uint8 *dst, int64 dst_size) {
+  if (chunk_size < kSeekableMinChunk || chunk_size > kSeekableMaxChunk || (chunk_size & (chunk_size - 1)))
+    return -1;
+  int64 num_chunks = (src_size + chunk_size - 1) / chunk_size;
+  if (num_chunks > 0xFFFFFFFF || dst_size < kSeekableMagicSize + num_chunks * kSeekableEntrySize + kSeekableFooterSize)
+    return -1;
+
+  // Every chunk starts from an empty dictionary so it decodes on its own.
+  CompressOptions copts = *GetDefaultCompressOpts(level);
+  copts.makeQHCrc = crc;
+  copts.platforms = platforms;
+  copts.seekChunkReset = 1;
+  copts.seekChunkLen = chunk_size;
+
+  uint8 *table = new uint8[num_chunks * kSeekableEntrySize + kSeekableFooterSize];
+  uint8 *table_end = table + num_chunks * kSeekableEntrySize;
+  SeekableWriter w = { dst, dst_size, kSeekableMagicSize, 0, src_size, chunk_size, table,
+                       table_end + kSeekableFooterSize - table };
+
+  memcpy(dst, SEEKABLE_MAGIC, kSeekableMagicSize);
+  int64 pos = -1;
+  if (CompressUnits(codec_id, (uint8*)src, src_size, level, &copts, chunk_size, 0, num_threads, Seekable_WriteChunk, &w)) {
+    *(uint32*)&table_end[0] = (uint32)num_chunks;
+    *(uint32*)&table_end[4] = 0;
+    *(uint64*)&table_end[8] = src_size;
+    memcpy(&table_end[16], SEEKABLE_MAGIC, kSeekableMagicSize);
+    memcpy(dst + w.pos, table, w.table_size);
+    pos = w.pos + w.table_size;
+  }
+  delete[] table;
+  return pos;
+}
+
+static OozSeekable *Seekable_Open(const uint8 *src, size_t src_len) {
+  if (src_len < kSeekableMagicSize + kSeekableFooterSize ||
+      memcmp(src, SEEKABLE_MAGIC, kSeekableMagicSize) != 0)
+    return NULL;
+  const uint8 *footer = src + src_len - kSeekableFooterSize;
+  if (memcmp(&footer[16], SEEKABLE_MAGIC, kSeekableMagicSize) != 0)
+    return NULL;
+  uint32 num_chunks = *(const uint32*)&footer[0];
+  int64 raw_size = *(const int64*)&footer[8];
+  if ((uint64)num_chunks * kSeekableEntrySize > src_len - kSeekableMagicSize - kSeekableFooterSize || raw_size < 0)
+    return NULL;
+  const uint8 *table = footer - (size_t)num_chunks * kSeekableEntrySize;
+
+  OozSeekable *s = new OozSeekable;
+  s->src = src;
+  s->raw_size = raw_size;
+  s->chunks.resize(num_chunks);
+  uint64 comp_pos = kSeekableMagicSize;
+  int64 raw_pos = 0, group_size = 0;
+  for (uint32 i = 0; i < num_chunks; i++) {
+    const uint8 *entry = table + (size_t)i * kSeekableEntrySize;
+    SeekableChunk &c = s->chunks[i];
+    c.comp_offset = *(const uint64*)&entry[0];
+    c.comp_size = *(const uint32*)&entry[8];
+    c.raw_size = *(const uint32*)&entry[12];
+    uint32 flags = *(const uint32*)&entry[16];
+    c.raw_offset = raw_pos;
+    // Chunks are stored back to back, so a run from a keyframe is one stream.
+    if (c.comp_offset != comp_pos || c.comp_size == 0 || c.comp_size > (uint64)(table - src) - comp_pos ||
+        c.raw_size == 0 || c.raw_size > raw_size - raw_pos || (flags & ~kSeekableFlagKeyframe) != 0 ||
+        (i == 0 && !(flags & kSeekableFlagKeyframe))) {
+      delete s;
+      return NULL;
+    }
+    if (flags & kSeekableFlagKeyframe)
+      group_size = 0;
+    c.keyframe = (flags & kSeekableFlagKeyframe) ? (int)i : s->chunks[i - 1].keyframe;
+    // Runs are decoded in one call, which takes an int size.
+    group_size += c.raw_size;
+    if (group_size > INT_MAX) {
+      delete s;
+      return NULL;
+    }
+    comp_pos += c.comp_size;
+    raw_pos += c.raw_size;
+  }
+  if (comp_pos != (uint64)(table - src) || raw_pos != raw_size) {
+    delete s;
+    return NULL;
+  }
+  return s;
+}
+
+// Decodes chunks |first| to |last|, which must share a keyframe, into |dst|.
+static bool Seekable_DecodeRun(const OozSeekable *s, OozDecoder *dec, int first, int last, uint8 *dst) {
+  const SeekableChunk &a = s->chunks[first], &b = s->chunks[last];
+  size_t comp_size = b.comp_offset + b.comp_size - a.comp_offset;
+  int raw_size = (int)(b.raw_offset + b.raw_size - a.raw_offset);
+  return Ooz_DecoderDecompress(dec, s->src + a.comp_offset, comp_size, dst, raw_size) == raw_size;
+}
+
+// Index of the chunk holding raw byte |pos|.
+static int Seekable_FindChunk(const OozSeekable *s, int64 pos) {
+  auto it = std::upper_bound(s->chunks.begin(), s->chunks.end(), pos,
+                             [](int64 p, const SeekableChunk &c) { return p < c.raw_offset; });
+  return (int)(it - s->chunks.begin()) - 1;
+}
+
+static int64 Seekable_DecodeRange(const OozSeekable *s, int64 offset, uint8 *dst, size_t len) {
+  if (offset < 0 || offset > s->raw_size || len > (uint64)(s->raw_size - offset))
+    return -1;
+  if (len == 0)
+    return 0;
+  int64 end = offset + len;
+  int last = Seekable_FindChunk(s, end - 1);
+  OozDecoder *dec = Ooz_DecoderCreate(NULL, 0);
+  uint8 *temp = NULL;
+  size_t temp_size = 0;
+  bool ok = true;
+  for (int i = Seekable_FindChunk(s, offset); ok && i <= last; ) {
+    int first = s->chunks[i].keyframe, j = i;
+    while (j < last && s->chunks[j + 1].keyframe == first)
+      j++;
+    int64 run_start = s->chunks[first].raw_offset;
+    int64 run_end = s->chunks[j].raw_offset + s->chunks[j].raw_size;
+    if (run_start >= offset && run_end <= end) {
+      ok = Seekable_DecodeRun(s, dec, first, j, dst + (run_start - offset));
+    } else {
+      // Partly covered, decode the run aside and copy out the overlap.
+      if (temp_size < (size_t)(run_end - run_start)) {
+        delete[] temp;
+        temp_size = run_end - run_start;
+        temp = new uint8[temp_size];
+      }
+      ok = Seekable_DecodeRun(s, dec, first, j, temp);
+      int64 from = std::max(run_start, offset), to = std::min(run_end, end);
+      if (ok)
+        memcpy(dst + (from - offset), temp + (from - run_start), to - from);
+    }
+    i = j + 1;
+  }
+  delete[] temp;
+  Ooz_DecoderDestroy(dec);
+  return ok ? (int64)len : -1;
+}
+
+static int64 Seekable_Decompress(const OozSeekable *s, uint8 *dst, size_t dst_size, int num_threads) {
+  if (dst_size < (uint64)s->raw_size)
+    return -1;
+  // Runs from each keyframe are independent of each other.
+  std::vector<int> runs;
+  for (int i = 0; i < (int)s->chunks.size(); i++)
+    if (s->chunks[i].keyframe == i)
+      runs.push_back(i);
+  runs.push_back((int)s->chunks.size());
+
+  if (num_threads <= 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  num_threads = std::min<int>(num_threads, (int)runs.size() - 1);
+
+  std::atomic<int> next(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&] {
+    OozDecoder *dec = Ooz_DecoderCreate(NULL, 0);
+    for (int r; !failed && (r = next++) < (int)runs.size() - 1; ) {
+      if (!Seekable_DecodeRun(s, dec, runs[r], runs[r + 1] - 1, dst + s->chunks[runs[r]].raw_offset))
+        failed = true;
+    }
+    Ooz_DecoderDestroy(dec);
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread &t : threads)
+    t.join();
+  return failed ? -1 : s->raw_size;
+}
+
+extern "C" {
+  OOZ_DLL_PUBLIC OozSeekable *Ooz_SeekableOpen(uint8_t const *src, size_t src_len) {
+    if (src == NULL)
+      return NULL;
+    return Seekable_Open(src, src_len);
+  }
+
+  OOZ_DLL_PUBLIC void Ooz_SeekableClose(OozSeekable *s) {
+    delete s;
+  }
+
+  OOZ_DLL_PUBLIC int64_t Ooz_SeekableRawSize(const OozSeekable *s) {
+    return s ? s->raw_size : -1;
+  }
+
+  OOZ_DLL_PUBLIC int Ooz_SeekableChunkCount(const OozSeekable *s) {
+    return s ? (int)s->chunks.size() : -1;
+  }
+
+  OOZ_DLL_PUBLIC int64_t Ooz_SeekableDecodeRange(const OozSeekable *s, int64_t offset, uint8_t *dst, size_t len) {
+    if (s == NULL)
+      return -1;
+    return Seekable_DecodeRange(s, offset, dst, len);
+  }
+
+  OOZ_DLL_PUBLIC int64_t Ooz_SeekableDecompress(const OozSeekable *s, uint8_t *dst, size_t dst_size, int num_threads) {
+    if (s == NULL)
+      return -1;
+    return Seekable_Decompress(s, dst, dst_size, num_threads);
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+// Seekable container. The input is cut into chunks that are compressed as
+// separate streams, followed by a table of where each chunk lives so a byte
+// range can be decoded without touching the rest of the file.
+//
+//   magic                      8 bytes
+//   chunk data                 compressed streams, back to back
+//   seek table                 one entry per chunk
+//   footer                     chunk count, raw size, magic
+//
+// Every integer is little endian. A chunk that isn't a keyframe continues the
+// stream of the chunk before it, so it can only be decoded along with every
+// chunk back to the last keyframe.
+
+#define SEEKABLE_MAGIC "OozSeek1"
+
+enum {
+  kSeekableMagicSize = 8,
+  // uint64 compressed offset, uint32 compressed size, uint32 raw size, uint32 flags.
+  kSeekableEntrySize = 20,
+  // uint32 chunk count, uint32 reserved, uint64 raw size, magic.
+  kSeekableFooterSize = 24,
+  kSeekableFlagKeyframe = 1,
+};
+
+// Chunk sizes accepted by Seekable_Compress, the compressor wants a power of two.
+enum {
+  kSeekableMinChunk = 0x10000,
+  kSeekableMaxChunk = 0x40000000,
+};
+
+// Upper bound on the output of Seekable_Compress.
+int64 Seekable_CompressBound(int64 src_size, int chunk_size);
+
+// Compresses |src| into a seekable container using chunks of |chunk_size|
+// bytes, on |num_threads| threads or one per core if it's 0 or less. With |crc|
+// each compressed quantum carries a checksum, and |platforms| is the cost
+// model as in CompressOptions. Returns the number of bytes
+// written to |dst|, or -1 if a chunk fails to compress or the output doesn't
+// fit in |dst_size|.
+int64 Seekable_Compress(int codec_id, int level, bool crc, int platforms, int chunk_size, int num_threads,
+                        const uint8 *src, int64 src_size, uint8 *dst, int64 dst_size);